@@ -26,14 +26,18 @@
 // [Dependencies]
 #include "MathPresso.h"
 #include "MathPresso_AST_p.h"
+#include "MathPresso_Arena_p.h"
+#include "MathPresso_Cache_p.h"
 #include "MathPresso_Context_p.h"
 #include "MathPresso_Optimizer_p.h"
+#include "MathPresso_Parallel_p.h"
 #include "MathPresso_Parser_p.h"
 #include "MathPresso_Tokenizer_p.h"
 #include "MathPresso_Util_p.h"
 
 #include "MathPresso_DOT_p.h"
 #include "MathPresso_JIT_p.h"
+#include "MathPresso_VM_p.h"
 
 #include <math.h>
 
@@ -72,7 +76,7 @@ static mresult_t Context_addFunction(Context* self, const char* name, void* ptr,
 
   size_t nlen = strlen(name);
 
-  Function* fdata = d->functions.get(name, nlen);
+  Function* fdata = d->findFunction(name, nlen, mpGetHash(name, nlen));
   if (fdata && fdata->ptr == ptr && fdata->prototype == prototype)
     return MRESULT_OK;
 
@@ -85,9 +89,11 @@ static mresult_t Context_addFunction(Context* self, const char* name, void* ptr,
     self->_privateData = d;
   }
 
-  return d->functions.put(name, nlen, Function(ptr, prototype, functionId))
-    ? MRESULT_OK
-    : MRESULT_NO_MEMORY;
+  if (!d->functions.put(name, nlen, Function(ptr, prototype, functionId)))
+    return MRESULT_NO_MEMORY;
+
+  d->updateId();
+  return MRESULT_OK;
 }
 
 // ============================================================================
@@ -96,7 +102,6 @@ static mresult_t Context_addFunction(Context* self, const char* name, void* ptr,
 
 static mreal_t _min(mreal_t x, mreal_t y) { return x < y ? x : y; }
 static mreal_t _max(mreal_t x, mreal_t y) { return x > y ? x : y; }
-static mreal_t _round(mreal_t x) { return (mreal_t)( (int)((x < 0.0f) ? x - 0.5f : x + 0.5f) ); }
 
 static mreal_t _avg(mreal_t x, mreal_t y) { return (x + y) * 0.5f; }
 static mreal_t _recip(mreal_t x) { return 1.0f/x; }
@@ -124,10 +129,11 @@ static mresult_t Context_addEnvironment_Math(Context* self)
   MP_ADD_FUNCTION(self, "max"       , _max  , MFUNC_F_ARG2 | MFUNC_EVAL, MFUNCTION_MAX);
   MP_ADD_FUNCTION(self, "avg"       , _avg  , MFUNC_F_ARG2 | MFUNC_EVAL, MFUNCTION_AVG);
   MP_ADD_FUNCTION(self, "reciprocal", _recip, MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_RECIPROCAL); // Why would anyone want this as a function??
-  MP_ADD_FUNCTION(self, "round"     , _round, MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_ROUND);
 
   MP_ADD_FUNCTION(self, "ceil" , (DoubleFuncPtr1)ceil  , MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_CEIL);
   MP_ADD_FUNCTION(self, "floor", (DoubleFuncPtr1)floor , MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_FLOOR);
+  MP_ADD_FUNCTION(self, "trunc", (DoubleFuncPtr1)trunc , MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_TRUNC);
+  MP_ADD_FUNCTION(self, "round", (DoubleFuncPtr1)round , MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_ROUND);
   MP_ADD_FUNCTION(self, "abs"  , (DoubleFuncPtr1)fabs  , MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_ABS);
 
   MP_ADD_FUNCTION(self, "sqrt" , (DoubleFuncPtr1)sqrt  , MFUNC_F_ARG1 | MFUNC_EVAL, MFUNCTION_SQRT);
@@ -198,7 +204,7 @@ mresult_t Context::addConstant(const char* name, mreal_t value)
 
   size_t nlen = strlen(name);
 
-  Variable* variable = d->variables.get(name, nlen);
+  Variable* variable = d->findVariable(name, nlen, mpGetHash(name, nlen));
   if (variable && variable->type == MVARIABLE_CONSTANT && 
                   variable->c.value == value)
   {
@@ -214,9 +220,11 @@ mresult_t Context::addConstant(const char* name, mreal_t value)
     _privateData = d;
   }
 
-  return d->variables.put(name, nlen, Variable(MVARIABLE_CONSTANT, value))
-    ? MRESULT_OK
-    : MRESULT_NO_MEMORY;
+  if (!d->variables.put(name, nlen, Variable(MVARIABLE_CONSTANT, value)))
+    return MRESULT_NO_MEMORY;
+
+  d->updateId();
+  return MRESULT_OK;
 }
 
 // ============================================================================
@@ -231,7 +239,7 @@ mresult_t Context::addVariable(const char* name, int offset, int flags)
   size_t nlen = strlen(name);
   int type = (flags & MVAR_READ_ONLY) ? MVARIABLE_READ_ONLY : MVARIABLE_READ_WRITE;
 
-  Variable* variable = d->variables.get(name, nlen);
+  Variable* variable = d->findVariable(name, nlen, mpGetHash(name, nlen));
   if (variable && variable->type == type && 
                   variable->v.offset == offset && 
                   variable->v.flags == flags)
@@ -248,9 +256,11 @@ mresult_t Context::addVariable(const char* name, int offset, int flags)
     _privateData = d;
   }
 
-  return d->variables.put(name, nlen, Variable(type, offset, flags))
-    ? MRESULT_OK
-    : MRESULT_NO_MEMORY;
+  if (!d->variables.put(name, nlen, Variable(type, offset, flags)))
+    return MRESULT_NO_MEMORY;
+
+  d->updateId();
+  return MRESULT_OK;
 }
 
 // ============================================================================
@@ -263,8 +273,10 @@ mresult_t Context::delSymbol(const char* name)
   if (d == NULL) return MRESULT_NO_MEMORY;
 
   size_t nlen = strlen(name);
-  if (!d->variables.contains(name, nlen) &&
-      !d->functions.contains(name, nlen))
+  unsigned int hash = mpGetHash(name, nlen);
+
+  if (d->findVariable(name, nlen, hash) == NULL &&
+      d->findFunction(name, nlen, hash) == NULL)
   {
     return MRESULT_OK;
   }
@@ -280,6 +292,37 @@ mresult_t Context::delSymbol(const char* name)
 
   d->variables.remove(name, nlen);
   d->functions.remove(name, nlen);
+  d->updateId();
+  return MRESULT_OK;
+}
+
+// ============================================================================
+// [MathPresso::Context - Code Arena]
+// ============================================================================
+
+mresult_t Context::setCodeArena(CodeArena* arena)
+{
+  ContextPrivate* d = reinterpret_cast<ContextPrivate*>(_privateData);
+  if (d == NULL) return MRESULT_NO_MEMORY;
+
+  CodeArenaPrivate* a = arena ? reinterpret_cast<CodeArenaPrivate*>(arena->_privateData) : NULL;
+  if (arena != NULL && a == NULL) return MRESULT_NO_MEMORY;
+  if (d->arena == a) return MRESULT_OK;
+
+  if (!d->isDetached())
+  {
+    d = d->copy();
+    if (!d) return MRESULT_NO_MEMORY;
+
+    reinterpret_cast<ContextPrivate*>(_privateData)->release();
+    _privateData = d;
+  }
+
+  if (a) a->addRef();
+  if (d->arena) d->arena->release();
+
+  d->arena = a;
+  d->updateId();
   return MRESULT_OK;
 }
 
@@ -297,18 +340,54 @@ mresult_t Context::clear()
     d = new(std::nothrow) ContextPrivate();
     if (!d) return MRESULT_NO_MEMORY;
 
-    reinterpret_cast<ContextPrivate*>(_privateData)->release();
+    // The code arena is not a symbol, it's kept.
+    ContextPrivate* old = reinterpret_cast<ContextPrivate*>(_privateData);
+    d->arena = old->arena;
+    if (d->arena) d->arena->addRef();
+
+    old->release();
     _privateData = d;
   }
   else
   {
     d->variables.clear();
     d->functions.clear();
+    d->updateId();
   }
 
   return MRESULT_OK;
 }
 
+// ============================================================================
+// [MathPresso::Context - Freeze]
+// ============================================================================
+
+Context Context::freeze() const
+{
+  Context snapshot(*this);
+
+  ContextPrivate* d = reinterpret_cast<ContextPrivate*>(_privateData);
+  if (d == NULL || d->frozen) return snapshot;
+
+  ContextPrivate* frozen = new(std::nothrow) ContextPrivate();
+  if (frozen == NULL) return snapshot;
+
+  frozen->frozen = mpFreezeSymbols(d->variables, d->functions);
+  if (frozen->frozen == NULL)
+  {
+    // Out of memory, the snapshot shares the data of this context.
+    delete frozen;
+    return snapshot;
+  }
+
+  frozen->arena = d->arena;
+  if (frozen->arena) frozen->arena->addRef();
+
+  d->release();
+  snapshot._privateData = frozen;
+  return snapshot;
+}
+
 // ============================================================================
 // [MathPresso::Context - Operator Overload]
 // ============================================================================
@@ -329,17 +408,269 @@ Context& Context::operator=(const Context& other)
 // [MathPresso::Eval Entry-Points]
 // ============================================================================
 
-static void mEvalDummy(const void*, mreal_t* result, void*)
+static void mEvalDummy(const void*, mreal_t* result, void*, size_t, size_t count)
+{
+  for (size_t i = 0; i < count; i++) result[i] = 0.0f;
+}
+
+static void mEvalSetDummy(const void*, mreal_t*, void*, size_t, size_t)
 {
-  *result = 0.0f;
+  // Empty set has no results.
 }
 
-static void mEvalExpression(const void* _p, mreal_t* result, void* data)
+static void mEvalExpression(const void* _p, mreal_t* result, void* rows, size_t stride, size_t count)
 {
   const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
+  MP_ASSERT(p->ast != NULL);
+
+  char* data = reinterpret_cast<char*>(rows);
+  for (size_t i = 0; i < count; i++, data += stride)
+  {
+    result[i] = p->ast->evaluate(data);
+  }
+}
 
+static void mEvalExpressionF32(const void* _p, mreal_t* result, void* rows, size_t stride, size_t count)
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
   MP_ASSERT(p->ast != NULL);
-  *result = p->ast->evaluate(data);
+
+  // Used only if there is not enough memory for bytecode, intermediate
+  // values keep double precision and only the result is rounded, so it may
+  // differ from the result of the bytecode or the JIT compiled function.
+  char* data = reinterpret_cast<char*>(rows);
+  for (size_t i = 0; i < count; i++, data += stride)
+  {
+    result[i] = (float)p->ast->evaluate(data);
+  }
+}
+
+static void mEvalSetExpression(const void* _p, mreal_t* result, void* rows, size_t stride, size_t count)
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
+  MP_ASSERT(p->ast != NULL && p->ast->getElementType() == MELEMENT_BLOCK);
+
+  ASTElement** outputs = p->ast->getChildrenElements();
+  size_t k, len = p->ast->getChildrenCount();
+  bool isFloat32 = (p->options & MOPTION_FLOAT32) != 0;
+
+  char* data = reinterpret_cast<char*>(rows);
+  for (size_t i = 0; i < count; i++, data += stride)
+  {
+    for (k = 0; k < len; k++)
+    {
+      mreal_t value = outputs[k]->evaluate(data);
+      *result++ = isFloat32 ? (float)value : value;
+    }
+  }
+}
+
+static void mEvalProgram(const void* _p, mreal_t* result, void* rows, size_t stride, size_t count)
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
+  MP_ASSERT(p->program != NULL);
+
+  mpVMExecute(p->program, result, rows, stride, count);
+}
+
+//! @internal
+//!
+//! @brief Bytecode of a tiered expression that is being compiled or that
+//! can't be compiled, it's never compiled again.
+static void mEvalProgramFinal(const void* _p, mreal_t* result, void* rows, size_t stride, size_t count)
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
+  mpVMExecute(p->program, result, rows, stride, count);
+}
+
+//! @internal
+//!
+//! @brief Compile the row function of a tiered or deferred expression, the
+//! code is stored to its cache directory like by @ref Expression::create().
+static MEvalFunc Expression_compileTier(ExpressionPrivate* p)
+{
+  WorkContext ctx(p->ctx, p->options);
+  if (p->diskDirectory.empty()) return mpCompileFunction(ctx, p->ast);
+
+  std::string image;
+  MEvalFunc fn = mpCompileFunction(ctx, p->ast, NULL, &image);
+  if (fn != NULL && !image.empty()) mpStoreDiskCache(p->diskDirectory, mpGetCacheDiskKey(ctx, p->ast), image);
+  return fn;
+}
+
+//! @internal
+//!
+//! @brief Row function of expression created with @ref MOPTION_TIERED.
+//!
+//! Counts rows evaluated by the bytecode, the thread that crosses the
+//! threshold compiles the expression, the calls that follow are forwarded
+//! to the compiled function.
+static void mEvalTiered(const void* _p, mreal_t* result, void* rows, size_t stride, size_t count)
+{
+  ExpressionPrivate* p = const_cast<ExpressionPrivate*>(reinterpret_cast<const ExpressionPrivate*>(_p));
+  MEvalFunc fn = p->tierEvaluate;
+
+  if (fn == mEvalProgram && p->tierCount.add(count) >= p->tierThreshold &&
+      mpAtomicSetPtrIf((void* volatile*)&p->tierEvaluate, (void*)mEvalProgram, (void*)mEvalProgramFinal))
+  {
+    // Other threads use the bytecode until the function is compiled.
+    MEvalFunc compiled = Expression_compileTier(p);
+
+    if (compiled != NULL)
+    {
+      p->tierEvaluate = compiled;
+      fn = compiled;
+    }
+  }
+
+  fn(p, result, rows, stride, count);
+}
+
+//! @internal
+//!
+//! @brief Get whether @a fn is not JIT compiled.
+static inline bool mIsInterpreted(MEvalFunc fn)
+{
+  return fn == mEvalProgram || fn == mEvalProgramFinal || fn == mEvalTiered ||
+         fn == mEvalExpression || fn == mEvalExpressionF32 || fn == mEvalSetExpression;
+}
+
+//! @internal
+//!
+//! @brief Get whether the row function of @a p is JIT compiled, a tiered
+//! expression is once it's compiled by @ref mEvalTiered().
+static inline bool Expression_isCompiled(const ExpressionPrivate* p)
+{
+  if (p->evaluate == mEvalTiered)
+    return !mIsInterpreted(p->tierEvaluate);
+  else
+    return !mIsInterpreted(p->evaluate);
+}
+
+static void mEvalColumnsDummy(void* result, size_t valueSize, size_t count)
+{
+  // Zero bits are 0.0 in both float and double.
+  memset(result, 0, count * valueSize);
+}
+
+static void mEvalColumnsGeneric(const void* _p, void* result, const void* const* columns, size_t count)
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
+  size_t columnCount = p->columnCount;
+  size_t valueSize = p->getValueSize();
+  size_t rowSize = columnCount * valueSize;
+
+  // Gather rows to a temporary buffer and evaluate them by the row function.
+  mreal_t buffer[256];
+  mreal_t values[64];
+
+  char* rows = reinterpret_cast<char*>(buffer);
+  size_t rowsPerChunk = 64;
+
+  if (rowSize * rowsPerChunk > sizeof(buffer))
+  {
+    rowsPerChunk = sizeof(buffer) / rowSize;
+    if (rowsPerChunk == 0)
+    {
+      rows = reinterpret_cast<char*>(::malloc(rowSize));
+      if (rows == NULL)
+      {
+        mEvalColumnsDummy(result, valueSize, count);
+        return;
+      }
+      rowsPerChunk = 1;
+    }
+  }
+
+  for (size_t i = 0; i < count; i += rowsPerChunk)
+  {
+    size_t n = count - i;
+    if (n > rowsPerChunk) n = rowsPerChunk;
+
+    for (size_t k = 0; k < columnCount; k++)
+    {
+      const void* column = columns[k];
+      if (column == NULL) continue;
+
+      if (valueSize == sizeof(float))
+      {
+        const float* src = reinterpret_cast<const float*>(column) + i;
+        for (size_t r = 0; r < n; r++) reinterpret_cast<float*>(rows + r * rowSize)[k] = src[r];
+      }
+      else
+      {
+        const mreal_t* src = reinterpret_cast<const mreal_t*>(column) + i;
+        for (size_t r = 0; r < n; r++) reinterpret_cast<mreal_t*>(rows + r * rowSize)[k] = src[r];
+      }
+    }
+
+    p->evaluate(p, values, rows, rowSize, n);
+
+    if (valueSize == sizeof(float))
+    {
+      float* dst = reinterpret_cast<float*>(result) + i;
+      for (size_t r = 0; r < n; r++) dst[r] = (float)values[r];
+    }
+    else
+    {
+      memcpy(reinterpret_cast<mreal_t*>(result) + i, values, n * sizeof(mreal_t));
+    }
+  }
+
+  if (rows != reinterpret_cast<char*>(buffer)) ::free(rows);
+}
+
+//! @internal
+//!
+//! @brief Accumulate @a value of row @a index to accumulator @a k.
+static inline void mReduceValue(ReduceState* state, size_t k, mreal_t value, mreal_t index)
+{
+  mreal_t& acc = state->values[k];
+
+  switch (state->op)
+  {
+    case MREDUCE_SUM:
+    case MREDUCE_MEAN:
+      acc += value;
+      break;
+    case MREDUCE_MIN:
+      if (value < acc) acc = value;
+      break;
+    case MREDUCE_MAX:
+      if (value > acc) acc = value;
+      break;
+
+    // Accumulator is NaN until the first row that is not NaN, the first row
+    // of equal values is kept. The JIT compiled function does the same by
+    // a mask of these conditions.
+    case MREDUCE_ARGMIN:
+      if (value == value && !(acc <= value)) { acc = value; state->indexes[k] = index; }
+      break;
+    case MREDUCE_ARGMAX:
+      if (value == value && !(acc >= value)) { acc = value; state->indexes[k] = index; }
+      break;
+  }
+}
+
+static void mEvalReduceGeneric(const void* _p, ReduceState* state, void* rows, size_t stride, size_t count)
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_p);
+
+  // Evaluate chunks of rows by the row function, all of them are added to
+  // the first accumulator.
+  mreal_t values[64];
+  char* data = reinterpret_cast<char*>(rows);
+
+  for (size_t i = 0; i < count; i += 64)
+  {
+    size_t n = count - i;
+    if (n > 64) n = 64;
+
+    p->evaluate(p, values, data, stride, n);
+    for (size_t r = 0; r < n; r++) mReduceValue(state, 0, values[r], (mreal_t)(i + r));
+
+    data += n * stride;
+  }
 }
 
 // ============================================================================
@@ -355,8 +686,8 @@ Expression::Expression() :
 
 Expression::~Expression()
 {
-  free();
-  if (_privateData) delete reinterpret_cast<ExpressionPrivate*>(_privateData);
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p) mpReleaseExpression(p);
 }
 
 const char* ErrorText[] =
@@ -396,20 +727,147 @@ static const char* getErrorText(mresult_t mResult) {
     return "Invalid error";
 }
 
+// ============================================================================
+// [MathPresso::Expression - Analyze]
+// ============================================================================
+
+static void Expression_analyze(ExpressionPrivate* p, const ASTElement* element)
+{
+  switch (element->getElementType())
+  {
+    case MELEMENT_VARIABLE:
+    {
+      uint column = (uint)reinterpret_cast<const ASTVariable*>(element)->getOffset() / p->getValueSize();
+      if (p->columnCount <= column) p->columnCount = column + 1;
+      break;
+    }
+    case MELEMENT_OPERATOR:
+    {
+      if (reinterpret_cast<const ASTOperator*>(element)->getOperatorType() == MOPERATOR_ASSIGN)
+        p->hasAssignment = true;
+      break;
+    }
+  }
+
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
+
+  for (i = 0; i < len; i++) Expression_analyze(p, children[i]);
+}
+
 // ============================================================================
 // [MathPresso::Expression - Create / Free]
 // ============================================================================
 
-mresult_t Expression::create(const Context& ectx, const char* expression, int options)
+static void ExpressionPrivate_reset(ExpressionPrivate* p)
 {
-  if (_privateData == NULL) return MRESULT_NO_MEMORY;
+  if (p->evaluate != NULL && !mIsInterpreted(p->evaluate))
+  {
+    // Allocated by JIT memory manager, free it.
+    mpFreeFunction(p->ctx, (void*)p->evaluate);
+  }
 
-  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
-  WorkContext ctx(ectx);
+  if (p->tierEvaluate != NULL && !mIsInterpreted(p->tierEvaluate))
+  {
+    mpFreeFunction(p->ctx, (void*)p->tierEvaluate);
+  }
+
+  if (p->evaluateColumns != NULL &&
+      p->evaluateColumns != mEvalColumnsGeneric)
+  {
+    mpFreeFunction(p->ctx, (void*)p->evaluateColumns);
+  }
+
+  for (uint i = 0; i < _MREDUCE_COUNT; i++)
+  {
+    if (p->evaluateReduce[i] != NULL &&
+        p->evaluateReduce[i] != mEvalReduceGeneric)
+    {
+      mpFreeFunction(p->ctx, (void*)p->evaluateReduce[i]);
+    }
+    p->evaluateReduce[i] = NULL;
+  }
+
+  p->evaluate = NULL;
+  p->evaluateColumns = NULL;
+  p->tierEvaluate = NULL;
+  p->tierCount.init(0);
+  p->tierThreshold = MP_TIERED_THRESHOLD;
+  p->options = MOPTION_NONE;
+  p->columnCount = 0;
+  p->hasAssignment = false;
+  p->diskDirectory.clear();
+
+  // The whole tree is freed at once.
+  p->ast = NULL;
+  p->zone.reset();
+
+  if (p->program)
+  {
+    mpVMFree(p->program);
+    p->program = NULL;
+  }
+
+  // Release context.
+  if (p->ctx)
+  {
+    p->ctx->release();
+    p->ctx = NULL;
+  }
+}
+
+void mpReleaseExpression(ExpressionPrivate* p)
+{
+  if (p->refCount.dec())
+  {
+    ExpressionPrivate_reset(p);
+    delete p;
+  }
+}
+
+mresult_t Expression::create(const Context& ectx, const char* expression, int options, ExpressionCache* cache)
+{
+  return _create(ectx, expression, options, cache, false);
+}
+
+mresult_t Expression::createAsync(const Context& ectx, const char* expression, int options, ExpressionCache* cache)
+{
+  return _create(ectx, expression, options, cache, true);
+}
+
+mresult_t Expression::_create(const Context& ectx, const char* expression, int options, ExpressionCache* cache, bool async, uint memory)
+{
+  if (_privateData == NULL) return MRESULT_NO_MEMORY;
 
   // Destroy previous expression and prepare for error state (if something fails)
   free();
 
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p == NULL) return MRESULT_NO_MEMORY;
+
+  WorkContext ctx(ectx, options);
+  ctx._memory = memory;
+
+  // Verbose expression has its own logs, it's never cached.
+  ExpressionCachePrivate* cp = NULL;
+  if (cache != NULL && (options & MOPTION_VERBOSE) == 0)
+    cp = reinterpret_cast<ExpressionCachePrivate*>(cache->_privateData);
+
+  std::string textKey;
+  std::string treeKey;
+
+  if (cp != NULL)
+  {
+    textKey = mpGetCacheTextKey(ctx, expression);
+    ExpressionPrivate* shared = cp->get(textKey);
+
+    if (shared != NULL)
+    {
+      _share(shared);
+      return MRESULT_OK;
+    }
+  }
+
   // Parse the expression
   ExpressionParser parser(ctx, expression, strlen(expression));
 
@@ -434,6 +892,19 @@ mresult_t Expression::create(const Context& ectx, const char* expression, int op
     optimizer.optimize(ast);
   }
 
+  // The same formula written differently has the same tree.
+  if (cp != NULL)
+  {
+    treeKey = mpGetCacheTreeKey(ctx, ast);
+    ExpressionPrivate* shared = cp->get(treeKey, &textKey);
+
+    if (shared != NULL)
+    {
+      _share(shared);
+      return MRESULT_OK;
+    }
+  }
+
   if (options & MOPTION_VERBOSE)
   {
     astRpn = ast->toString();
@@ -443,9 +914,24 @@ mresult_t Expression::create(const Context& ectx, const char* expression, int op
     ::free((void*)d);
   }
 
+  // Tiered expression starts as bytecode, it's compiled by mEvalTiered(),
+  // deferred expression is compiled by the background thread.
+  bool deferred = async && (options & (MOPTION_NO_JIT | MOPTION_VERBOSE)) == 0;
+  bool tiered = !deferred && (options & (MOPTION_TIERED | MOPTION_NO_JIT | MOPTION_VERBOSE)) == MOPTION_TIERED;
+
+  std::string directory;
+  if (cp != NULL) directory = cp->getDirectory();
+
   // Compile using JIT compiler if enabled
   if (options & MOPTION_NO_JIT)
     _evaluate = NULL;
+  else if (tiered || deferred)
+  {
+    // Code compiled by this or other process is used at once, otherwise
+    // it's stored to the directory when it's compiled.
+    _evaluate = directory.empty() ? NULL : cp->load(ctx, mpGetCacheDiskKey(ctx, ast));
+    if (_evaluate == NULL) p->diskDirectory = directory;
+  }
   else
   {
     if ((options & MOPTION_VERBOSE) != 0)
@@ -455,56 +941,441 @@ mresult_t Expression::create(const Context& ectx, const char* expression, int op
       jitLog = log;
       ::free(log);
     }
+    else if (!directory.empty())
+    {
+      // Code compiled by this or other process is loaded, new code is
+      // stored if it can be loaded by other processes.
+      std::string diskKey = mpGetCacheDiskKey(ctx, ast);
+      _evaluate = cp->load(ctx, diskKey);
+
+      if (_evaluate == NULL)
+      {
+        std::string image;
+        _evaluate = mpCompileFunction(ctx, ast, NULL, &image);
+        if (_evaluate != NULL && !image.empty()) mpStoreDiskCache(directory, diskKey, image);
+      }
+    }
     else
       _evaluate = mpCompileFunction(ctx, ast);
   }
 
-  // Fallback to evaluation if JIT compilation failed or not enabled
+  // Fallback to bytecode if JIT compilation failed or not enabled, the tree
+  // is evaluated directly only if there is not enough memory for bytecode.
   if (_evaluate == NULL)
   {
-    _evaluate = mEvalExpression;
-    p->ast = ast;
-  }
-  else
-  {
-    delete ast;
+    p->program = mpVMCompile(ctx, ast);
+    if (p->program != NULL)
+      _evaluate = mEvalProgram;
+    else
+      _evaluate = ctx.isFloat32() ? mEvalExpressionF32 : mEvalExpression;
+
+    if ((tiered || deferred) && _evaluate == mEvalProgram)
+    {
+      p->tierEvaluate = deferred ? mEvalProgramFinal : mEvalProgram;
+      _evaluate = mEvalTiered;
+    }
   }
 
+  // Keep the tree, the column function is compiled from it on first use.
+  p->ast = ast;
+  p->zone.swap(ctx._zone);
+  p->evaluate = _evaluate;
+  p->options = options;
+  Expression_analyze(p, ast);
+
   p->ctx = ctx._ctx;
   p->ctx->addRef();
 
+  if (deferred && _evaluate == mEvalTiered)
+  {
+    AsyncCompiler* compiler = mpGetAsyncCompiler();
+    if (compiler == NULL || !compiler->post(p))
+      mpCompileDeferred(p);
+  }
+
+  if (cp != NULL)
+    cp->put(textKey, treeKey, p);
+
   // All fine...
   return MRESULT_OK;
 }
 
+void Expression::_share(void* shared)
+{
+  // The shared data are already referenced, release the current ones.
+  mpReleaseExpression(reinterpret_cast<ExpressionPrivate*>(_privateData));
+
+  _privateData = shared;
+  _evaluate = reinterpret_cast<ExpressionPrivate*>(shared)->evaluate;
+
+  errorMessage = getErrorText(MRESULT_OK);
+  errorPos = 0;
+}
+
 void Expression::free()
 {
-  if (_privateData == NULL) return;
   ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
-
-  if (_evaluate != mEvalDummy &&
-      _evaluate != mEvalExpression)
-  {
-    // Allocated by JIT memory manager, free it.
-    mpFreeFunction((void*)_evaluate);
-  }
+  if (p == NULL) return;
 
   // Set evaluate to dummy function so it will not crash when called through
   // Expression::evaluate().
   _evaluate = mEvalDummy;
 
-  if (p->ast)
+  if (p->refCount.get() != 1)
+  {
+    // Shared with a cache or other expressions, continue with a new one.
+    mpReleaseExpression(p);
+    _privateData = new(std::nothrow) ExpressionPrivate();
+  }
+  else
   {
-    delete p->ast;
-    p->ast = NULL;
+    ExpressionPrivate_reset(p);
   }
+}
 
-  // Release context.
-  if (p->ctx)
+void mpCompileDeferred(ExpressionPrivate* p)
+{
+  MEvalFunc fn = Expression_compileTier(p);
+
+  // Evaluated by the bytecode until now, mEvalTiered() forwards to it.
+  if (fn != NULL) p->tierEvaluate = fn;
+}
+
+void Expression::waitCompiled() const
+{
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p == NULL || p->evaluate != mEvalTiered || p->tierEvaluate != mEvalProgramFinal) return;
+
+  AsyncCompiler* compiler = mpGetAsyncCompiler();
+  if (compiler != NULL) compiler->wait(p);
+}
+
+void Expression::setTieredThreshold(size_t rows)
+{
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p != NULL) p->tierThreshold = rows;
+}
+
+bool Expression::isJitCompiled() const
+{
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(_privateData);
+  if (p == NULL || p->ast == NULL) return false;
+
+  return Expression_isCompiled(p);
+}
+
+// ============================================================================
+// [MathPresso::Expression - Columns]
+// ============================================================================
+
+static MEvalColumnsFunc Expression_compileColumns(ExpressionPrivate* p)
+{
+  MEvalColumnsFunc fn = NULL;
+  bool compiled = Expression_isCompiled(p);
+
+  // Columns are read-only, expression that assigns is evaluated row by row.
+  if (compiled && !p->hasAssignment)
   {
-    p->ctx->release();
-    p->ctx = NULL;
+    WorkContext ctx(p->ctx, p->options);
+    fn = mpCompileColumnsFunction(ctx, p->ast);
   }
+
+  // Tiered expression is evaluated row by row (and the rows are counted)
+  // until it's compiled, the column function is compiled after that.
+  if (fn == NULL && !compiled && p->evaluate == mEvalTiered)
+    return mEvalColumnsGeneric;
+
+  if (fn == NULL)
+    fn = mEvalColumnsGeneric;
+
+  // Another thread could compile it in the meantime, use the first one.
+  if (!mpAtomicSetPtrIf((void* volatile*)&p->evaluateColumns, NULL, (void*)fn))
+  {
+    if (fn != mEvalColumnsGeneric) mpFreeFunction(p->ctx, (void*)fn);
+    fn = p->evaluateColumns;
+  }
+
+  return fn;
+}
+
+MEvalColumnsFunc mpGetColumnsFunction(ExpressionPrivate* p)
+{
+  MEvalColumnsFunc fn = p->evaluateColumns;
+  if (fn == NULL) fn = Expression_compileColumns(p);
+  return fn;
+}
+
+static void Expression_evaluateColumns(ExpressionPrivate* p, void* out, const void* const* columns, size_t count, size_t valueSize)
+{
+  if (p == NULL || p->ast == NULL || p->getValueSize() != valueSize)
+  {
+    mEvalColumnsDummy(out, valueSize, count);
+    return;
+  }
+
+  MEvalColumnsFunc fn = mpGetColumnsFunction(p);
+  fn(p, out, columns, count);
+}
+
+void Expression::evaluateColumns(const mreal_t* const* columns, mreal_t* out, size_t count) const
+{
+  Expression_evaluateColumns(reinterpret_cast<ExpressionPrivate*>(_privateData),
+    out, reinterpret_cast<const void* const*>(columns), count, sizeof(mreal_t));
+}
+
+void Expression::evaluateColumns(const float* const* columns, float* out, size_t count) const
+{
+  Expression_evaluateColumns(reinterpret_cast<ExpressionPrivate*>(_privateData),
+    out, reinterpret_cast<const void* const*>(columns), count, sizeof(float));
+}
+
+// ============================================================================
+// [MathPresso::Expression - Reduce]
+// ============================================================================
+
+static inline mreal_t mGetNan()
+{
+  mreal_t inf = HUGE_VAL;
+  return inf - inf;
+}
+
+static MEvalReduceFunc Expression_compileReduce(ExpressionPrivate* p, int op)
+{
+  MEvalReduceFunc fn = NULL;
+  bool compiled = Expression_isCompiled(p);
+
+  if (compiled)
+  {
+    WorkContext ctx(p->ctx, p->options);
+    fn = mpCompileReduceFunction(ctx, p->ast, op);
+  }
+
+  // Like the column function of a tiered expression that isn't compiled yet.
+  if (fn == NULL && !compiled && p->evaluate == mEvalTiered)
+    return mEvalReduceGeneric;
+
+  if (fn == NULL)
+    fn = mEvalReduceGeneric;
+
+  // Another thread could compile it in the meantime, use the first one.
+  if (!mpAtomicSetPtrIf((void* volatile*)&p->evaluateReduce[op], NULL, (void*)fn))
+  {
+    if (fn != mEvalReduceGeneric) mpFreeFunction(p->ctx, (void*)fn);
+    fn = p->evaluateReduce[op];
+  }
+
+  return fn;
+}
+
+static void Expression_initReduce(ReduceState* state, int op)
+{
+  mreal_t value;
+  switch (op)
+  {
+    case MREDUCE_MIN: value = HUGE_VAL; break;
+    case MREDUCE_MAX: value = -HUGE_VAL; break;
+    case MREDUCE_ARGMIN:
+    case MREDUCE_ARGMAX: value = mGetNan(); break;
+    default: value = 0.0; break;
+  }
+
+  for (uint k = 0; k < REDUCE_ACCUMULATORS; k++)
+  {
+    state->values[k] = value;
+    state->indexes[k] = -1.0;
+  }
+  state->op = op;
+}
+
+static mreal_t Expression_finishReduce(const ReduceState* state, size_t count, size_t* index)
+{
+  int op = state->op;
+  mreal_t result;
+  mreal_t resultIndex = -1.0;
+
+  if (op == MREDUCE_SUM || op == MREDUCE_MEAN)
+  {
+    result = (state->values[0] + state->values[1]) + (state->values[2] + state->values[3]);
+    // No rows is 0.0 / 0.0, which is NaN.
+    if (op == MREDUCE_MEAN) result /= (mreal_t)count;
+  }
+  else if (op == MREDUCE_ARGMIN || op == MREDUCE_ARGMAX)
+  {
+    result = state->values[0];
+    resultIndex = state->indexes[0];
+
+    // The first row of equal values is the one with the lowest index.
+    for (uint k = 1; k < REDUCE_ACCUMULATORS; k++)
+    {
+      mreal_t value = state->values[k];
+      mreal_t i = state->indexes[k];
+      if (i < 0.0) continue;
+
+      if (resultIndex < 0.0 ||
+          (op == MREDUCE_ARGMIN ? value < result : value > result) ||
+          (value == result && i < resultIndex))
+      {
+        result = value;
+        resultIndex = i;
+      }
+    }
+  }
+  else
+  {
+    result = state->values[0];
+    for (uint k = 1; k < REDUCE_ACCUMULATORS; k++)
+    {
+      mreal_t value = state->values[k];
+      if (op == MREDUCE_MIN ? value < result : value > result) result = value;
+    }
+  }
+
+  if (index != NULL)
+    *index = (resultIndex < 0.0) ? (size_t)-1 : (size_t)resultIndex;
+  return result;
+}
+
+mreal_t Expression::reduce(void* rows, size_t stride, size_t count, int op, size_t* index) const
+{
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+
+  if (p == NULL || p->ast == NULL || (uint)op >= _MREDUCE_COUNT)
+  {
+    if (index != NULL) *index = (size_t)-1;
+    return 0.0;
+  }
+
+  // Mean is a sum divided by count.
+  int fnIndex = (op == MREDUCE_MEAN) ? MREDUCE_SUM : op;
+
+  MEvalReduceFunc fn = p->evaluateReduce[fnIndex];
+  if (fn == NULL) fn = Expression_compileReduce(p, fnIndex);
+
+  ReduceState state;
+  Expression_initReduce(&state, op);
+
+  fn(p, &state, rows, stride, count);
+  return Expression_finishReduce(&state, count, index);
+}
+
+// ============================================================================
+// [MathPresso::ExpressionSet - Construction / Destruction]
+// ============================================================================
+
+ExpressionSet::ExpressionSet() :
+  _privateData(NULL),
+  _evaluate(mEvalSetDummy),
+  _count(0),
+  errorMessage(getErrorText(MRESULT_OK)),
+  errorPos(0),
+  errorIndex(0)
+{
+  _privateData = new(std::nothrow) ExpressionPrivate();
+}
+
+ExpressionSet::~ExpressionSet()
+{
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p) mpReleaseExpression(p);
+}
+
+// ============================================================================
+// [MathPresso::ExpressionSet - Create / Free]
+// ============================================================================
+
+mresult_t ExpressionSet::create(const Context& ectx, const char* const* expressions, size_t count, int options)
+{
+  free();
+
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p == NULL) return MRESULT_NO_MEMORY;
+
+  WorkContext ctx(ectx, options);
+  Vector<ASTElement*> outputs;
+  mresult_t result = MRESULT_OK;
+
+  errorPos = 0;
+  errorIndex = 0;
+
+  if (count == 0)
+    result = MRESULT_NO_EXPRESSION;
+
+  // Parse all expressions to the same zone, each of them is one child of the
+  // block compiled below.
+  for (size_t i = 0; i < count && result == MRESULT_OK; i++)
+  {
+    ExpressionParser parser(ctx, expressions[i], strlen(expressions[i]));
+
+    ASTElement* ast = NULL;
+    result = parser.parse(&ast);
+
+    if (result == MRESULT_OK && ast == NULL)
+      result = MRESULT_NO_EXPRESSION;
+    if (result == MRESULT_OK && !outputs.append(ast))
+      result = MRESULT_NO_MEMORY;
+
+    if (result != MRESULT_OK)
+    {
+      errorPos = parser.getLastToken().pos;
+      errorIndex = i;
+    }
+  }
+
+  ASTBlock* block = NULL;
+  if (result == MRESULT_OK)
+  {
+    block = new(ctx.getZone()) ASTBlock(ctx.genId());
+    if (block == NULL || !block->setElements(ctx.getZone(), outputs.getData(), outputs.getLength()))
+      result = MRESULT_NO_MEMORY;
+  }
+
+  errorMessage = getErrorText(result);
+  if (result != MRESULT_OK) return result;
+
+  // Common subexpressions are merged across all expressions of the block,
+  // the block itself is never replaced.
+  if ((options & MOPTION_NO_OPTIMIZE) == 0)
+  {
+    ASTElement* ast = block;
+    Optimizer optimizer(ctx);
+    optimizer.optimize(ast);
+    MP_ASSERT(ast == block);
+  }
+
+  if ((options & MOPTION_NO_JIT) == 0)
+    _evaluate = mpCompileSetFunction(ctx, block);
+  else
+    _evaluate = NULL;
+
+  // Fallback to bytecode, see Expression::create().
+  if (_evaluate == NULL)
+  {
+    p->program = mpVMCompileSet(ctx, block);
+    _evaluate = (p->program != NULL) ? mEvalProgram : mEvalSetExpression;
+  }
+
+  p->ast = block;
+  p->zone.swap(ctx._zone);
+  p->evaluate = _evaluate;
+  p->options = options;
+  Expression_analyze(p, block);
+
+  p->ctx = ctx._ctx;
+  p->ctx->addRef();
+
+  _count = count;
+  return MRESULT_OK;
+}
+
+void ExpressionSet::free()
+{
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(_privateData);
+  if (p == NULL) return;
+
+  // The private data are never shared by a cache.
+  _evaluate = mEvalSetDummy;
+  _count = 0;
+  ExpressionPrivate_reset(p);
 }
 
 } // MathPresso namespace
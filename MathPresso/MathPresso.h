@@ -57,7 +57,11 @@ typedef int mresult_t;
 typedef double mreal_t;
 
 //! @brief Prototype of function generated by MathPresso
-typedef void (*MEvalFunc)(const void* priv, mreal_t* retval, void* data);
+//!
+//! Evaluates @a count rows, the first one at @a rows and each next one
+//! @a stride bytes after the previous, and stores one result per row to
+//! @a retval.
+typedef void (*MEvalFunc)(const void* priv, mreal_t* retval, void* rows, size_t stride, size_t count);
 
 //! @brief Needed for compiler to get correct function pointers
 typedef double (*DoubleFuncPtr1)(double);
@@ -95,7 +99,7 @@ enum MRESULT
 
   //! @brief Assignment to non-variable error
   MRESULT_ASSIGNMENT_TO_NON_VARIABLE = 8,
-  //! @brief Assignment inside expression error
+  //! @brief Assignment inside expression error (a branch of @c ?:)
   MRESULT_ASSIGNMENT_INSIDE_EXPRESSION = 9,
 
   //! @brief Not enough function arguments
@@ -136,6 +140,64 @@ enum MOPTION
 
   //! @brief Store AST and JIT log
   MOPTION_VERBOSE = 0x0004,
+
+  //! @brief Variables are single precision floats (32 bit).
+  //!
+  //! Variable at offset @c k*sizeof(float) is a @c float and the compiled
+  //! code calculates in single precision (the interpreter rounds each
+  //! intermediate result to @c float), columns (see
+  //! @ref Expression::evaluateColumns()) are evaluated four rows at a time.
+  //! Results returned by @ref Expression::evaluate() are still @ref mreal_t.
+  MOPTION_FLOAT32 = 0x0008,
+
+  //! @brief Allow optimizations that may change results in the last bits.
+  //!
+  //! Division by a constant is replaced by multiplication by its reciprocal
+  //! (without this option only if the reciprocal is exact, i.e. the constant
+  //! is a power of two).
+  MOPTION_FAST_MATH = 0x0010,
+
+  //! @brief Evaluate by the interpreter first, compile by the JIT compiler
+  //! when enough rows were evaluated.
+  //!
+  //! The expression is compiled by the thread that evaluates the row over
+  //! the threshold (see @ref Expression::setTieredThreshold()), the other
+  //! threads use the interpreter until it's done. Columns and reductions are
+  //! evaluated row by row until then (the rows are counted), their compiled
+  //! functions are used after it. Code in the directory of the cache (see
+  //! @ref ExpressionCache::setDirectory()) is loaded at once, otherwise the
+  //! code is stored there when it's compiled. Ignored together with
+  //! @ref MOPTION_NO_JIT or @ref MOPTION_VERBOSE.
+  MOPTION_TIERED = 0x0020,
+};
+
+// ============================================================================
+// [MathPresso - Reductions]
+// ============================================================================
+
+//! @brief Reduction computed by @ref Expression::reduce().
+enum MREDUCE
+{
+  //! @brief Sum of all results (0.0 if there are no rows).
+  MREDUCE_SUM = 0,
+  //! @brief Smallest result, NaN results are ignored (+inf if there are
+  //! no other results).
+  MREDUCE_MIN = 1,
+  //! @brief Largest result, NaN results are ignored (-inf if there are
+  //! no other results).
+  MREDUCE_MAX = 2,
+  //! @brief Sum of all results divided by count of rows (NaN if there are
+  //! no rows).
+  MREDUCE_MEAN = 3,
+  //! @brief Smallest result and index of the first row where it is, NaN
+  //! results are ignored (NaN and index @c (size_t)-1 if there are no other
+  //! results).
+  MREDUCE_ARGMIN = 4,
+  //! @brief Largest result and index of the first row where it is, see
+  //! @ref MREDUCE_ARGMIN.
+  MREDUCE_ARGMAX = 5,
+
+  _MREDUCE_COUNT = 6
 };
 
 // ============================================================================
@@ -195,6 +257,66 @@ enum MFUNC
   MFUNC_F_ARG8 = (MFUNC_FLOAT_TYPE) + 8
 };
 
+// ============================================================================
+// [MathPresso - Code Arena]
+// ============================================================================
+
+//! @brief Code arena option.
+enum MARENA
+{
+  //! @brief None
+  MARENA_NONE = 0x0000,
+  //! @brief Map blocks by 2 MB pages if the OS allows it, otherwise by
+  //! normal pages
+  MARENA_HUGE_PAGES = 0x0001
+};
+
+//! @brief Executable memory of JIT compiled expressions.
+//!
+//! Functions are packed one after another into large blocks, each starts at
+//! a cache line, so the code of many small expressions takes only a few
+//! pages. Set to a context by @ref Context::setCodeArena(), all code of
+//! expressions created with the context is allocated from it.
+//!
+//! Memory of a single function is never reused. A block is unmapped when
+//! all functions allocated from it are freed and a newer block is used for
+//! new functions. @ref nextGeneration() starts a new block, so the code of
+//! expressions replaced together (for example when a model is reloaded) is
+//! unmapped once all of them are freed.
+struct MATHPRESSO_API CodeArena
+{
+  //! @brief Create a new @ref CodeArena with blocks of @a blockSize bytes
+  //! (0 means 256 kB, or 2 MB with @ref MARENA_HUGE_PAGES), @a flags are
+  //! a combination of @ref MARENA values.
+  CodeArena(size_t blockSize = 0, int flags = MARENA_NONE);
+
+  //! @brief Destroy the @ref CodeArena instance, the memory is kept until
+  //! all contexts that use it are destroyed.
+  ~CodeArena();
+
+  //! @brief Continue by a new block, return the new generation.
+  size_t nextGeneration();
+  //! @brief Get the current generation (starts at 0).
+  size_t getGeneration() const;
+
+  //! @brief Get count of functions not freed yet.
+  size_t getFunctionCount() const;
+  //! @brief Get count of blocks.
+  size_t getBlockCount() const;
+  //! @brief Get count of bytes of all blocks.
+  size_t getReservedBytes() const;
+
+  //! @brief Private data not available to the MathPresso public API.
+  void* _privateData;
+
+private:
+  // DISABLE COPY of CodeArena instance.
+  inline CodeArena(const CodeArena& other);
+  inline CodeArena& operator=(const CodeArena& other);
+};
+
+struct Expression;
+
 // ============================================================================
 // [MathPresso - Context]
 // ============================================================================
@@ -241,15 +363,124 @@ struct MATHPRESSO_API Context
   //! @brief Delete all symbols.
   mresult_t clear();
 
+  //! @brief Allocate code of expressions created with this context from
+  //! @a arena, NULL means the memory shared by all contexts.
+  //!
+  //! The context keeps a reference to the memory of @a arena. Expressions
+  //! created before the call are not affected.
+  mresult_t setCodeArena(CodeArena* arena);
+
+  //! @brief Create a read-only snapshot of this context.
+  //!
+  //! Symbols of the snapshot are in one allocation indexed by a minimal
+  //! perfect hash, a name is found by comparing a single entry without any
+  //! probing. Expressions created with the snapshot reference it like any
+  //! other context. Changing a copy of the snapshot creates an ordinary
+  //! context.
+  Context freeze() const;
+
   //! @brief Assignement operator.
   Context& operator=(const Context& other);
 
+  //! @brief Create @a count expressions from @a sources by @a threadCount
+  //! threads (0 means one per CPU core).
+  //!
+  //! Expression @c i is created from @c sources[i] into @c out[i] like by
+  //! @ref Expression::create(). Threads take the next expression when they
+  //! are done with the previous one, and the JIT compiled code of each
+  //! thread is allocated from different executable memory. Copies of the
+  //! context can be changed by other threads in the meantime, changes copy
+  //! the content shared with this context.
+  //!
+  //! @return @ref MRESULT_OK if all expressions were created, otherwise the
+  //! result of the first one that failed, error of each expression is in
+  //! @c out[i].getErrorMessage().
+  mresult_t compileMany(const char* const* sources, size_t count, Expression* out, int options = MOPTION_NONE, unsigned int threadCount = 0) const;
+
+  // --------------------------------------------------------------------------
+  // [Members]
+  // --------------------------------------------------------------------------
+
+  //! @brief Private data not available to the MathPresso public API.
+  void* _privateData;
+};
+
+// ============================================================================
+// [MathPresso - Expression Cache]
+// ============================================================================
+
+//! @brief Cache of compiled expressions.
+//!
+//! Used by @ref Expression::create(), expressions created from the same
+//! cache entry share the compiled code. Least recently used entries are
+//! dropped when the cache is full. Entry keeps a reference to its context
+//! data, so the data are not freed until the entry is dropped. Cache is
+//! thread-safe, more threads can create expressions using the same cache.
+struct MATHPRESSO_API ExpressionCache
+{
+  // --------------------------------------------------------------------------
+  // [Construction / Destruction]
+  // --------------------------------------------------------------------------
+
+  //! @brief Create a new @ref ExpressionCache with room for @a capacity
+  //! expressions.
+  ExpressionCache(size_t capacity = 1024);
+
+  //! @brief Destroy the @ref ExpressionCache instance, expressions created
+  //! using it are still valid.
+  ~ExpressionCache();
+
+  // --------------------------------------------------------------------------
+  // [Methods]
+  // --------------------------------------------------------------------------
+
+  //! @brief Get maximum count of cached expressions.
+  size_t getCapacity() const;
+  //! @brief Set maximum count of cached expressions.
+  void setCapacity(size_t capacity);
+
+  //! @brief Get count of cached expressions.
+  size_t getSize() const;
+
+  //! @brief Get count of expressions that were found in the cache.
+  size_t getHitCount() const;
+  //! @brief Get count of expressions that were compiled.
+  size_t getMissCount() const;
+
+  //! @brief Drop all cached expressions.
+  void clear();
+
+  //! @brief Set directory of compiled code shared by processes, NULL or an
+  //! empty string (default) disables it.
+  //!
+  //! Code compiled by the JIT compiler is stored to the directory (one file
+  //! per expression) and loaded instead of compiling it again, by this or
+  //! any other process. Files are validated when they are loaded, the key
+  //! of each file has the optimized tree, options, the CPU features, the
+  //! build of the library and the version of the file format. Only code of
+  //! 64-bit processes that doesn't call any function (e.g. @c pow() or custom
+  //! functions) is stored, its addresses are different in each process. The
+  //! directory must exist.
+  //!
+  //! @note The loaded code is executed, the directory must be private to the
+  //! user. On POSIX systems a directory or file that isn't owned by the
+  //! effective user or that is writable by the group or others is ignored.
+  void setDirectory(const char* path);
+
+  //! @brief Get count of expressions loaded from the directory.
+  size_t getLoadCount() const;
+
   // --------------------------------------------------------------------------
   // [Members]
   // --------------------------------------------------------------------------
 
   //! @brief Private data not available to the MathPresso public API.
   void* _privateData;
+
+private:
+  // DISABLE COPY of ExpressionCache instance.
+  inline ExpressionCache(const ExpressionCache& other);
+  inline ExpressionCache& operator=(const ExpressionCache& other);
 };
 
 // ============================================================================
@@ -280,8 +511,36 @@ struct MATHPRESSO_API Expression
   //! @param variableCount Count of variables in @a variableName array.
   //! @param options MathPresso options (flags), see @ref MOPTION.
   //!
+  //! @param cache Cache of compiled expressions to use, can be NULL.
+  //!
   //! @return MathPresso result (see @c MRESULT).
-  mresult_t create(const Context& ectx, const char* expression, int options = MOPTION_NONE);
+  //!
+  //! If @a cache is used and it already contains the same expression (same
+  //! text or the same tree after optimization, the same content of @a ectx
+  //! and the same @a options), the compiled code is shared with it instead
+  //! of compiling it again. Expressions created with @ref MOPTION_VERBOSE
+  //! are never cached.
+  mresult_t create(const Context& ectx, const char* expression, int options = MOPTION_NONE, ExpressionCache* cache = NULL);
+
+  //! @brief Compile a given @a expression by a background thread.
+  //!
+  //! The expression is parsed, optimized and compiled into bytecode like by
+  //! @ref create(), errors are returned the same way, and it can be
+  //! evaluated right after this call returns. The JIT compiler runs on a
+  //! thread shared by all expressions, evaluation continues by the compiled
+  //! function once it's done.
+  //!
+  //! Expressions created with @ref MOPTION_VERBOSE are compiled by the
+  //! calling thread, because the JIT log is ready when this call returns.
+  //! Code in the directory of @a cache (see
+  //! @ref ExpressionCache::setDirectory()) is loaded without waiting for the
+  //! background thread, code compiled by it is stored there.
+  mresult_t createAsync(const Context& ectx, const char* expression, int options = MOPTION_NONE, ExpressionCache* cache = NULL);
+
+  //! @brief Wait until the expression created by @ref createAsync() is
+  //! compiled, return immediately if it's not compiled by the background
+  //! thread.
+  void waitCompiled() const;
 
   //! @brief Free expression.
   void free();
@@ -292,10 +551,70 @@ struct MATHPRESSO_API Expression
   inline mreal_t evaluate(void* data) const
   {
     mreal_t result;
-    _evaluate(_privateData, &result, data);
+    _evaluate(_privateData, &result, data, 0, 1);
     return result;
   }
 
+  //! @brief Evaluate expression for @a count rows of variables.
+  //!
+  //! The first row is at @a rows and each next row is @a stride bytes after
+  //! the previous one, result of row @c i is stored to @c out[i]. The loop
+  //! over rows is part of the compiled function, so constants are loaded
+  //! only once per call and not once per row.
+  inline void evaluateBatch(void* rows, size_t stride, mreal_t* out, size_t count) const
+  {
+    _evaluate(_privateData, out, rows, stride, count);
+  }
+
+  //! @brief Evaluate expression for @a count rows stored by columns.
+  //!
+  //! Variable at offset @c k*sizeof(mreal_t) (see @ref Context::addVariable())
+  //! is read from @c columns[k], columns not used by the expression can be
+  //! NULL. Result of row @c i is stored to @c out[i].
+  //!
+  //! The JIT compiled function evaluates two rows by a single instruction,
+  //! it's compiled when this method is called for the first time. Columns
+  //! are never modified, expression that assigns to a variable is evaluated
+  //! row by row on a temporary copy of each row.
+  //!
+  //! Expression created with @ref MOPTION_FLOAT32 must be evaluated by the
+  //! @c float overload, otherwise all results are zero.
+  void evaluateColumns(const mreal_t* const* columns, mreal_t* out, size_t count) const;
+
+  //! @brief Evaluate expression created with @ref MOPTION_FLOAT32 for
+  //! @a count rows stored by columns of floats.
+  //!
+  //! Variable at offset @c k*sizeof(float) is read from @c columns[k], the
+  //! JIT compiled function evaluates four rows by a single instruction.
+  //! Expression created without @ref MOPTION_FLOAT32 can't be evaluated by
+  //! this overload, all results are zero.
+  void evaluateColumns(const float* const* columns, float* out, size_t count) const;
+
+  //! @brief Evaluate expression for @a count rows of variables and reduce
+  //! the results to a single value by @a op (see @ref MREDUCE).
+  //!
+  //! Rows are the same as rows of @ref evaluateBatch(), but the results are
+  //! never stored. The JIT compiled function keeps four independent
+  //! accumulators in registers, they are combined when all rows are done,
+  //! so the sum can differ from a sum in row order in the last bits. The
+  //! function is compiled when it's used for the first time.
+  //!
+  //! If @a index is not NULL, index of the row with the result of
+  //! @ref MREDUCE_ARGMIN or @ref MREDUCE_ARGMAX is stored to it, the other
+  //! reductions store @c (size_t)-1.
+  mreal_t reduce(void* rows, size_t stride, size_t count, int op, size_t* index = NULL) const;
+
+  //! @brief Set count of rows evaluated by the interpreter before the
+  //! expression created with @ref MOPTION_TIERED is compiled (default
+  //! 4096).
+  //!
+  //! The count is shared by all expressions created by the same
+  //! @ref ExpressionCache entry.
+  void setTieredThreshold(size_t rows);
+
+  //! @brief Get whether the expression is evaluated by JIT compiled code.
+  bool isJitCompiled() const;
+
   //! @brief
   inline std::string getRPN() const { return astRpn; }
   //! @brief
@@ -332,11 +651,181 @@ protected:
   int errorPos;
 
 private:
+  friend struct CompileManyJob;
+  friend struct ParallelEvaluator;
+
+  //! @brief Use private data @a shared (already referenced) of a cached
+  //! expression.
+  void _share(void* shared);
+
+  //! @brief Implementation of @ref create() and @ref createAsync(), JIT
+  //! compiled code is allocated from executable memory @a memory (0 is
+  //! shared by all threads).
+  mresult_t _create(const Context& ectx, const char* expression, int options, ExpressionCache* cache, bool async, unsigned int memory = 0);
+
   // DISABLE COPY of Expression instance.
   inline Expression(const Expression& other);
   inline Expression& operator=(const Expression& other);
 };
 
+// ============================================================================
+// [MathPresso - Expression Set]
+// ============================================================================
+
+//! @brief Several expressions compiled into one function.
+//!
+//! All expressions use the same @ref Context and are evaluated for the same
+//! row by one call, variables read by more expressions are loaded only once
+//! and common subexpressions are computed only once for all of them.
+//! Expressions are evaluated in order, variable assigned by one of them has
+//! the assigned value in the next ones.
+struct MATHPRESSO_API ExpressionSet
+{
+  // --------------------------------------------------------------------------
+  // [Construction / Destruction]
+  // --------------------------------------------------------------------------
+
+  //! @brief Create a new @ref ExpressionSet instance.
+  ExpressionSet();
+
+  //! @brief Destroy the @ref ExpressionSet instance.
+  ~ExpressionSet();
+
+  // --------------------------------------------------------------------------
+  // [Methods]
+  // --------------------------------------------------------------------------
+
+  //! @brief Compile @a count @a expressions into one function.
+  //!
+  //! @param options MathPresso options (flags), see @ref MOPTION
+  //! (@ref MOPTION_VERBOSE is ignored).
+  //!
+  //! @return MathPresso result (see @c MRESULT), if an expression can't be
+  //! compiled, its index is returned by @ref getErrorIndex().
+  mresult_t create(const Context& ectx, const char* const* expressions, size_t count, int options = MOPTION_NONE);
+
+  //! @brief Free the set.
+  void free();
+
+  //! @brief Get count of expressions (results of each row).
+  inline size_t getCount() const { return _count; }
+
+  //! @brief Evaluate all expressions for one row of variables, result of
+  //! expression @c i is stored to @c out[i].
+  inline void evaluate(void* data, mreal_t* out) const
+  {
+    _evaluate(_privateData, out, data, 0, 1);
+  }
+
+  //! @brief Evaluate all expressions for @a count rows of variables (see
+  //! @ref Expression::evaluateBatch()), result of expression @c i for row
+  //! @c r is stored to @c out[r*getCount()+i].
+  inline void evaluateBatch(void* rows, size_t stride, mreal_t* out, size_t count) const
+  {
+    _evaluate(_privateData, out, rows, stride, count);
+  }
+
+  //! @brief
+  inline const char* getErrorMessage() { return errorMessage; }
+  //! @brief
+  inline int getErrorPos() const { return errorPos; }
+  //! @brief Get index of the expression that failed to compile.
+  inline size_t getErrorIndex() const { return errorIndex; }
+
+  // --------------------------------------------------------------------------
+  // [Members]
+  // --------------------------------------------------------------------------
+
+protected:
+  //! @brief Private data not available to the MathPresso public API.
+  void* _privateData;
+
+  //! @brief Compiled expressions.
+  MEvalFunc _evaluate;
+  //! @brief Count of expressions.
+  size_t _count;
+
+  //! @brief Error message
+  const char* errorMessage;
+  //! @brief Error position
+  int errorPos;
+  //! @brief Index of the expression with error
+  size_t errorIndex;
+
+private:
+  // DISABLE COPY of ExpressionSet instance.
+  inline ExpressionSet(const ExpressionSet& other);
+  inline ExpressionSet& operator=(const ExpressionSet& other);
+};
+
+// ============================================================================
+// [MathPresso - Parallel Evaluator]
+// ============================================================================
+
+//! @brief Parallel evaluator option.
+enum MPARALLEL
+{
+  //! @brief None
+  MPARALLEL_NONE = 0x0000,
+  //! @brief Pin each worker thread to one CPU
+  MPARALLEL_PIN_THREADS = 0x0001
+};
+
+//! @brief Evaluates expressions for many rows by a pool of threads.
+//!
+//! Rows are split into chunks that fit into the cache, each thread starts
+//! with its own share of chunks and steals from the others when it runs out
+//! of them. Result of row @c i is always stored to @c out[i], so the output
+//! doesn't depend on which thread evaluated the row. The calling thread
+//! evaluates chunks as well and every method returns when all rows are done.
+//!
+//! The threads are created by the constructor and reused by all calls, one
+//! evaluator can be used by more threads, their calls are serialized.
+struct MATHPRESSO_API ParallelEvaluator
+{
+  // --------------------------------------------------------------------------
+  // [Construction / Destruction]
+  // --------------------------------------------------------------------------
+
+  //! @brief Create a new @ref ParallelEvaluator instance.
+  //!
+  //! @param threadCount Count of threads including the calling one, zero
+  //! means count of CPUs.
+  //! @param flags Parallel evaluator options, see @ref MPARALLEL.
+  ParallelEvaluator(unsigned int threadCount = 0, int flags = MPARALLEL_NONE);
+
+  //! @brief Destroy the @ref ParallelEvaluator instance, stops all threads.
+  ~ParallelEvaluator();
+
+  // --------------------------------------------------------------------------
+  // [Methods]
+  // --------------------------------------------------------------------------
+
+  //! @brief Get count of threads including the calling one.
+  unsigned int getThreadCount() const;
+
+  //! @brief Parallel version of @ref Expression::evaluateBatch().
+  void evaluateBatch(const Expression& e, void* rows, size_t stride, mreal_t* out, size_t count);
+
+  //! @brief Parallel version of @ref Expression::evaluateColumns().
+  void evaluateColumns(const Expression& e, const mreal_t* const* columns, mreal_t* out, size_t count);
+
+  //! @brief Parallel version of @ref Expression::evaluateColumns() (floats).
+  void evaluateColumns(const Expression& e, const float* const* columns, float* out, size_t count);
+
+  // --------------------------------------------------------------------------
+  // [Members]
+  // --------------------------------------------------------------------------
+
+  //! @brief Private data not available to the MathPresso public API.
+  void* _privateData;
+
+private:
+  // DISABLE COPY of ParallelEvaluator instance.
+  inline ParallelEvaluator(const ParallelEvaluator& other);
+  inline ParallelEvaluator& operator=(const ParallelEvaluator& other);
+};
+
 } // MathPresso namespace
 
 #endif // _MATHPRESSO_H
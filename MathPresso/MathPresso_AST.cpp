@@ -37,11 +37,8 @@ namespace MathPresso {
 ASTElement::ASTElement(uint elementId, uint elementType) :
   _parent(NULL),
   _elementId(elementId),
-  _elementType(elementType)
-{
-}
-
-ASTElement::~ASTElement()
+  _elementType(elementType),
+  _useCount(1)
 {
 }
 
@@ -67,50 +64,55 @@ bool ASTElement::replaceChild(ASTElement* child, ASTElement* element)
 // [MathPresso::ASTBlock]
 // ============================================================================
 
-ASTBlock::ASTBlock(uint elementId) : ASTElement(elementId, MELEMENT_BLOCK)
+ASTBlock::ASTBlock(uint elementId) :
+  ASTElement(elementId, MELEMENT_BLOCK),
+  _elements(NULL),
+  _length(0)
 {
 }
 
-ASTBlock::~ASTBlock()
-{
-  for (size_t i = 0; i < _elements.getLength(); i++)
-    delete _elements[i];
-}
-
 bool ASTBlock::isConstant() const
 {
   return false;
 }
 
 ASTElement** ASTBlock::getChildrenElements() const
-{
-  return const_cast<ASTElement**>(_elements.getData());
-}
-
-Vector<ASTElement *> & ASTBlock::getChildrenVector()
 {
   return _elements;
 }
 
 size_t ASTBlock::getChildrenCount() const
 {
-  return _elements.getLength();
+  return _length;
 }
 
 mreal_t ASTBlock::evaluate(void* data) const
 {
   mreal_t result = 0;
-  for (size_t i = 0; i < _elements.getLength(); i++)
+  for (size_t i = 0; i < _length; i++)
   {
     result = _elements[i]->evaluate(data);
   }
   return result;
 }
 
+bool ASTBlock::setElements(Zone* zone, ASTElement* const* elements, size_t length)
+{
+  ASTElement** copy = zone->dup(elements, length);
+  if (copy == NULL) return false;
+
+  _elements = copy;
+  _length = length;
+
+  for (size_t i = 0; i < length; i++)
+    copy[i]->getParent() = this;
+  return true;
+}
+
 std::string ASTBlock::toString() const
 {
   std::string str = "{ ";
-  for (size_t i = 0; i < _elements.getLength(); i++)
+  for (size_t i = 0; i < _length; i++)
   {
     if (i != 0) str += " ; ";
     str += _elements[i]->toString();
@@ -129,12 +131,6 @@ ASTNode::ASTNode(uint elementId, uint elementType) :
 {
 }
 
-ASTNode::~ASTNode()
-{
-  if (_left) delete _left;
-  if (_right) delete _right;
-}
-
 bool ASTNode::isConstant() const
 {
   return getLeft()->isConstant() && getRight()->isConstant();
@@ -167,10 +163,6 @@ ASTConstant::ASTConstant(uint elementId, mreal_t value) :
 {
 }
 
-ASTConstant::~ASTConstant()
-{
-}
-
 bool ASTConstant::isConstant() const
 {
   return true;
@@ -205,13 +197,10 @@ std::string ASTConstant::toString() const
 // [MathPresso::ASTVariable]
 // ============================================================================
 
-ASTVariable::ASTVariable(uint elementId, const Variable* variable) :
+ASTVariable::ASTVariable(uint elementId, const Variable* variable, bool isFloat32) :
   ASTElement(elementId, MELEMENT_VARIABLE),
-  _variable(variable)
-{
-}
-
-ASTVariable::~ASTVariable()
+  _variable(variable),
+  _isFloat32(isFloat32)
 {
 }
 
@@ -237,7 +226,10 @@ bool ASTVariable::replaceChild(ASTElement* child, ASTElement* element)
 
 mreal_t ASTVariable::evaluate(void* data) const
 {
-  return reinterpret_cast<mreal_t*>((char*)data + getOffset())[0];
+  if (_isFloat32)
+    return reinterpret_cast<float*>((char*)data + getOffset())[0];
+  else
+    return reinterpret_cast<mreal_t*>((char*)data + getOffset())[0];
 }
 
 std::string ASTVariable::toString() const
@@ -255,10 +247,6 @@ ASTOperator::ASTOperator(uint elementId, uint operatorType) :
 {
 }
 
-ASTOperator::~ASTOperator()
-{
-}
-
 mreal_t ASTOperator::evaluate(void* data) const
 {
   mreal_t result;
@@ -269,8 +257,7 @@ mreal_t ASTOperator::evaluate(void* data) const
     {
       MP_ASSERT(_left->getElementType() == MELEMENT_VARIABLE);
       result = _right->evaluate(data);
-      reinterpret_cast<mreal_t*>((char*)data +
-        reinterpret_cast<ASTVariable*>(_left)->getOffset())[0] = result;
+      reinterpret_cast<ASTVariable*>(_left)->store(data, result);
       break;
     }
     case MOPERATOR_PLUS:
@@ -298,6 +285,30 @@ mreal_t ASTOperator::evaluate(void* data) const
       mreal_t vr = _right->evaluate(data);
       result = pow(vl, vr);
       break;
+    }
+    case MOPERATOR_EQ:
+    case MOPERATOR_NE:
+    case MOPERATOR_LT:
+    case MOPERATOR_LE:
+    case MOPERATOR_GT:
+    case MOPERATOR_GE:
+    {
+      mreal_t vl = _left->evaluate(data);
+      mreal_t vr = _right->evaluate(data);
+      bool cond;
+
+      switch (getOperatorType())
+      {
+        case MOPERATOR_EQ: cond = vl == vr; break;
+        case MOPERATOR_NE: cond = vl != vr; break;
+        case MOPERATOR_LT: cond = vl <  vr; break;
+        case MOPERATOR_LE: cond = vl <= vr; break;
+        case MOPERATOR_GT: cond = vl >  vr; break;
+        default          : cond = vl >= vr; break;
+      }
+
+      result = cond ? 1.0 : 0.0;
+      break;
     }
 	default:
       MP_ASSERT_NOT_REACHED();
@@ -325,26 +336,38 @@ bool ASTOperator::replaceChild(ASTElement* child, ASTElement* element)
 
 std::string ASTOperator::toString() const
 {
-  char c;
+  const char* c;
   switch (getOperatorType())
   {
     case MOPERATOR_ASSIGN:
-      c='='; break;
+      c="="; break;
     case MOPERATOR_PLUS:
-      c='+'; break;
+      c="+"; break;
     case MOPERATOR_MINUS:
-      c='-'; break;
+      c="-"; break;
     case MOPERATOR_MUL:
-      c='*'; break;
+      c="*"; break;
     case MOPERATOR_DIV:
-      c='/'; break;
+      c="/"; break;
     case MOPERATOR_MOD:
-      c='%'; break;
+      c="%"; break;
     case MOPERATOR_POW:
-      c='^'; break;
+      c="^"; break;
+    case MOPERATOR_EQ:
+      c="=="; break;
+    case MOPERATOR_NE:
+      c="!="; break;
+    case MOPERATOR_LT:
+      c="<"; break;
+    case MOPERATOR_LE:
+      c="<="; break;
+    case MOPERATOR_GT:
+      c=">"; break;
+    case MOPERATOR_GE:
+      c=">="; break;
 	default:
       MP_ASSERT_NOT_REACHED();
-      c='?';
+      c="?";
   }
 
   return _left->toString() + ' ' + _right->toString() + ' ' + c;
@@ -356,18 +379,15 @@ std::string ASTOperator::toString() const
 
 ASTCall::ASTCall(uint elementId, Function* function) :
   ASTElement(elementId, MELEMENT_CALL),
-  _function(function)
-{
-}
-
-ASTCall::~ASTCall()
+  _function(function),
+  _arguments(NULL),
+  _argumentsCount(0)
 {
-  mpDeleteAll(_arguments);
 }
 
 bool ASTCall::isConstant() const
 {
-  size_t i, len = _arguments.getLength();
+  size_t i, len = _argumentsCount;
 
   for (i = 0; i < len; i++)
   {
@@ -380,19 +400,19 @@ bool ASTCall::isConstant() const
 
 ASTElement** ASTCall::getChildrenElements() const
 {
-  return const_cast<ASTElement**>(_arguments.getData());
+  return _arguments;
 }
 
 size_t ASTCall::getChildrenCount() const
 {
-  return _arguments.getLength();
+  return _argumentsCount;
 }
 
 mreal_t ASTCall::evaluate(void* data) const
 {
   mreal_t result = 0.0f;
   mreal_t t[10];
-  size_t i, len = _arguments.getLength();
+  size_t i, len = _argumentsCount;
 
   for (i = 0; i < len; i++)
   {
@@ -418,11 +438,24 @@ mreal_t ASTCall::evaluate(void* data) const
   return result;
 }
 
+bool ASTCall::setArguments(Zone* zone, ASTElement* const* arguments, size_t length)
+{
+  ASTElement** copy = zone->dup(arguments, length);
+  if (copy == NULL && length != 0) return false;
+
+  _arguments = copy;
+  _argumentsCount = length;
+
+  for (size_t i = 0; i < length; i++)
+    copy[i]->getParent() = this;
+  return true;
+}
+
 std::string ASTCall::toString() const
 {
   std::string str = Hash<Function>::dataToKey(getFunction());
   str += "(";
-  for (size_t i = 0; i < _arguments.getLength(); i++)
+  for (size_t i = 0; i < _argumentsCount; i++)
   {
     if (i != 0) str += " , ";
     str += _arguments[i]->toString();
@@ -438,13 +471,9 @@ std::string ASTCall::toString() const
 ASTTransform::ASTTransform(uint elementId) :
   ASTElement(elementId, MELEMENT_TRANSFORM),
   _child(NULL),
-  _transformType(MTRANSFORM_NONE)
-{
-}
-
-ASTTransform::~ASTTransform()
+  _transformType(MTRANSFORM_NONE),
+  _exponent(0)
 {
-  if (_child) delete _child;
 }
 
 bool ASTTransform::isConstant() const
@@ -482,6 +511,27 @@ mreal_t ASTTransform::evaluate(void* data) const
       return value;
     case MTRANSFORM_NEGATE:
       return -value;
+    case MTRANSFORM_SQRT:
+      return sqrt(value);
+    case MTRANSFORM_RECIPROCAL:
+      return 1.0 / value;
+    case MTRANSFORM_RSQRT:
+      return 1.0 / sqrt(value);
+    case MTRANSFORM_POWI:
+    {
+      // Same multiplications as the JIT compiler and the bytecode.
+      int exponent = getExponent();
+      uint n = (uint)(exponent < 0 ? -exponent : exponent);
+      uint bit = mpGetHighestBit(n);
+      mreal_t result = value;
+
+      while (bit-- > 0)
+      {
+        result *= result;
+        if (n & (1U << bit)) result *= value;
+      }
+      return exponent < 0 ? 1.0 / result : result;
+    }
     default:
       MP_ASSERT_NOT_REACHED();
       return 0.0f;
@@ -496,10 +546,55 @@ std::string ASTTransform::toString() const
       return getChild()->toString() + std::string(" dummy transform");
     case MTRANSFORM_NEGATE:
       return getChild()->toString() + std::string(" negation");
+    case MTRANSFORM_SQRT:
+      return getChild()->toString() + std::string(" sqrt");
+    case MTRANSFORM_RECIPROCAL:
+      return getChild()->toString() + std::string(" reciprocal");
+    case MTRANSFORM_RSQRT:
+      return getChild()->toString() + std::string(" rsqrt");
+    case MTRANSFORM_POWI:
+      return getChild()->toString() + std::string(" powi ") + std::to_string(getExponent());
     default:
       MP_ASSERT_NOT_REACHED();
       return std::string(" unknown transform");
   }
 }
 
+// ============================================================================
+// [MathPresso::ASTCondition]
+// ============================================================================
+
+ASTCondition::ASTCondition(uint elementId) :
+  ASTElement(elementId, MELEMENT_CONDITION),
+  _condition(NULL),
+  _then(NULL),
+  _else(NULL)
+{
+}
+
+bool ASTCondition::isConstant() const
+{
+  return _condition->isConstant() && _then->isConstant() && _else->isConstant();
+}
+
+ASTElement** ASTCondition::getChildrenElements() const
+{
+  return const_cast<ASTElement**>(_elements);
+}
+
+size_t ASTCondition::getChildrenCount() const
+{
+  return 3;
+}
+
+mreal_t ASTCondition::evaluate(void* data) const
+{
+  return _condition->evaluate(data) != 0 ? _then->evaluate(data) : _else->evaluate(data);
+}
+
+std::string ASTCondition::toString() const
+{
+  return _condition->toString() + ' ' + _then->toString() + ' ' + _else->toString() + " ?:";
+}
+
 } // MathPresso namespace
@@ -48,7 +48,8 @@ enum MELEMENT_TYPE
   MELEMENT_VARIABLE,
   MELEMENT_OPERATOR,
   MELEMENT_CALL,
-  MELEMENT_TRANSFORM
+  MELEMENT_TRANSFORM,
+  MELEMENT_CONDITION
 };
 
 //! @internal
@@ -64,16 +65,47 @@ enum MOPERATOR_TYPE
   MOPERATOR_DIV,
   MOPERATOR_MOD,
   MOPERATOR_POW,
-  MOPERATOR_UMINUS
+  MOPERATOR_UMINUS,
+
+  // Comparisons, the result is 1 if true, otherwise 0.
+
+  MOPERATOR_EQ,
+  MOPERATOR_NE,
+  MOPERATOR_LT,
+  MOPERATOR_LE,
+  MOPERATOR_GT,
+  MOPERATOR_GE,
+
+  //! @brief c ? a : b, used only by the parser (see @ref ASTCondition).
+  MOPERATOR_CONDITION
 };
 
+//! @internal
+//!
+//! @brief Get whether @a operatorType is a comparison.
+static inline bool mpIsComparison(uint operatorType)
+{
+  return operatorType >= MOPERATOR_EQ && operatorType <= MOPERATOR_GE;
+}
+
 //! @internal
 //!
 //! @brief Transform type.
 enum MTRANSFORM_TYPE
 {
   MTRANSFORM_NONE,
-  MTRANSFORM_NEGATE
+  MTRANSFORM_NEGATE,
+
+  // Replacements of x^c, see Optimizer::doPower().
+
+  //! @brief sqrt(x), x^0.5.
+  MTRANSFORM_SQRT,
+  //! @brief 1/x, x^-1.
+  MTRANSFORM_RECIPROCAL,
+  //! @brief 1/sqrt(x), x^-0.5.
+  MTRANSFORM_RSQRT,
+  //! @brief x^n, n is a small integer (see ASTTransform::getExponent()).
+  MTRANSFORM_POWI
 };
 
 //! @internal
@@ -92,6 +124,7 @@ enum MFUNCTION_TYPE
   MFUNCTION_CEIL,
   MFUNCTION_FLOOR,
   MFUNCTION_ROUND,
+  MFUNCTION_TRUNC,
 
   // Abs.
   MFUNCTION_ABS,
@@ -147,10 +180,16 @@ protected:
   uint _elementType;
   //! @brief Element id, unique per @ref Expression.
   uint _elementId;
+  //! @brief Count of parents referencing this element.
+  uint _useCount;
 
 public:
   ASTElement(uint elementId, uint elementType);
-  virtual ~ASTElement() = 0;
+
+  //! @brief Allocate the element from @a zone, returns NULL if out of memory.
+  inline void* operator new(size_t size, Zone* zone) noexcept { return zone->alloc(size); }
+  //! @brief Called only if a constructor throws, memory is owned by the zone.
+  inline void operator delete(void*, Zone*) noexcept {}
 
   //! @brief Get whether this element is constant expression.
   //!
@@ -178,8 +217,17 @@ public:
   //! @brief Get the element type.
   inline uint getElementType() const { return _elementType; }
 
+  //! @brief Get count of parents referencing this element, it's more than
+  //! one if the element is a common subexpression shared by the optimizer.
+  inline uint& getUseCount() { return _useCount; }
+
   //! @brief Convert element to string using reverse polish notation
   virtual std::string toString() const = 0;
+
+protected:
+  //! @brief Elements are never destroyed, their memory is released with the
+  //! @ref Zone they were allocated from.
+  inline ~ASTElement() {}
 };
 
 // ============================================================================
@@ -189,18 +237,20 @@ public:
 class MATHPRESSO_HIDDEN ASTBlock : public ASTElement
 {
 protected:
-  Vector<ASTElement*> _elements;
+  ASTElement** _elements;
+  size_t _length;
 
 public:
   ASTBlock(uint elementId);
-  virtual ~ASTBlock();
 
   virtual bool isConstant() const;
   virtual ASTElement** getChildrenElements() const;
-  virtual Vector<ASTElement *> & getChildrenVector();
   virtual size_t getChildrenCount() const;
   virtual mreal_t evaluate(void* data) const;
 
+  //! @brief Set block statements to a copy of @a elements allocated by @a zone.
+  bool setElements(Zone* zone, ASTElement* const* elements, size_t length);
+
   virtual std::string toString() const override;
 };
 
@@ -226,7 +276,6 @@ protected:
 
 public:
   ASTNode(uint elementId, uint elementType);
-  virtual ~ASTNode();
 
   virtual bool isConstant() const;
   virtual ASTElement** getChildrenElements() const;
@@ -252,7 +301,6 @@ protected:
 
 public:
   ASTConstant(uint elementId, mreal_t val);
-  virtual ~ASTConstant();
 
   virtual bool isConstant() const;
   virtual ASTElement** getChildrenElements() const;
@@ -274,10 +322,11 @@ class MATHPRESSO_HIDDEN ASTVariable : public ASTElement
 {
 protected:
   const Variable* _variable;
+  //! @brief Whether the variable is @c float instead of @ref mreal_t.
+  bool _isFloat32;
 
 public:
-  ASTVariable(uint elementId, const Variable* variable);
-  virtual ~ASTVariable();
+  ASTVariable(uint elementId, const Variable* variable, bool isFloat32 = false);
 
   virtual bool isConstant() const;
   virtual ASTElement** getChildrenElements() const;
@@ -287,6 +336,16 @@ public:
 
   inline const Variable* getVariable() const { return _variable; }
   inline int getOffset() const { return _variable->v.offset; }
+  inline bool isFloat32() const { return _isFloat32; }
+
+  //! @brief Store @a value to the variable in @a data.
+  inline void store(void* data, mreal_t value) const
+  {
+    if (_isFloat32)
+      reinterpret_cast<float*>((char*)data + getOffset())[0] = (float)value;
+    else
+      reinterpret_cast<mreal_t*>((char*)data + getOffset())[0] = value;
+  }
 
   virtual std::string toString() const override;
 };
@@ -303,7 +362,6 @@ protected:
 public:
 
   ASTOperator(uint elementId, uint operatorType);
-  virtual ~ASTOperator();
 
   virtual mreal_t evaluate(void* data) const;
 
@@ -323,11 +381,11 @@ class MATHPRESSO_HIDDEN ASTCall : public ASTElement
 {
 protected:
   Function* _function;
-  Vector<ASTElement*> _arguments;
+  ASTElement** _arguments;
+  size_t _argumentsCount;
 
 public:
   ASTCall(uint elementId, Function* function);
-  virtual ~ASTCall();
 
   virtual bool isConstant() const;
   virtual ASTElement** getChildrenElements() const;
@@ -336,10 +394,11 @@ public:
 
   inline Function* getFunction() const { return _function; }
 
-  inline Vector<ASTElement*>& getArguments() { return _arguments; }
-  inline const Vector<ASTElement*>& getArguments() const { return _arguments; }
+  inline ASTElement** getArguments() const { return _arguments; }
+  inline size_t getArgumentsCount() const { return _argumentsCount; }
 
-  inline bool swapArguments(Vector<ASTElement*>& other) { return _arguments.swap(other); }
+  //! @brief Set arguments to a copy of @a arguments allocated by @a zone.
+  bool setArguments(Zone* zone, ASTElement* const* arguments, size_t length);
 
   virtual std::string toString() const override;
 };
@@ -353,10 +412,10 @@ class MATHPRESSO_HIDDEN ASTTransform : public ASTElement
 protected:
   ASTElement* _child;
   uint _transformType;
+  int _exponent;
 
 public:
   ASTTransform(uint elementId);
-  virtual ~ASTTransform();
 
   virtual bool isConstant() const;
   virtual ASTElement** getChildrenElements() const;
@@ -372,6 +431,54 @@ public:
   inline uint getTransformType() const { return _transformType; }
   inline void setTransformType(uint transformType) { _transformType = transformType; }
 
+  //! @brief Get exponent of @ref MTRANSFORM_POWI.
+  inline int getExponent() const { return _exponent; }
+  inline void setExponent(int exponent) { _exponent = exponent; }
+
+  virtual std::string toString() const override;
+};
+
+// ============================================================================
+// [MathPresso::ASTCondition]
+// ============================================================================
+
+//! @brief Condition @c c ? @c a : @c b, @c a if @c c is not zero.
+//!
+//! Compiled code evaluates both branches and selects one of them, branches
+//! can't assign variables (see @ref MRESULT_ASSIGNMENT_INSIDE_EXPRESSION).
+class MATHPRESSO_HIDDEN ASTCondition : public ASTElement
+{
+protected:
+  union
+  {
+    struct
+    {
+      ASTElement* _condition;
+      ASTElement* _then;
+      ASTElement* _else;
+    };
+    struct
+    {
+      ASTElement* _elements[3];
+    };
+  };
+
+public:
+  ASTCondition(uint elementId);
+
+  virtual bool isConstant() const;
+  virtual ASTElement** getChildrenElements() const;
+  virtual size_t getChildrenCount() const;
+  virtual mreal_t evaluate(void* data) const;
+
+  inline ASTElement* getCondition() const { return _condition; }
+  inline ASTElement* getThen() const { return _then; }
+  inline ASTElement* getElse() const { return _else; }
+
+  inline void setCondition(ASTElement* element) { _condition = element; element->getParent() = this; }
+  inline void setThen(ASTElement* element) { _then = element; element->getParent() = this; }
+  inline void setElse(ASTElement* element) { _else = element; element->getParent() = this; }
+
   virtual std::string toString() const override;
 };
 
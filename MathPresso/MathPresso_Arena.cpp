@@ -0,0 +1,348 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// [Dependencies]
+#include "MathPresso.h"
+#include "MathPresso_Arena_p.h"
+#include "MathPresso_Util_p.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace MathPresso {
+
+// ============================================================================
+// [MathPresso::CodeArena - Helpers]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Functions start at a cache line, so a small function never shares
+//! its first cache line with the end of the previous one.
+enum { MP_ARENA_ALIGNMENT = 64 };
+
+//! @internal
+//!
+//! @brief Default size of a block.
+enum { MP_ARENA_BLOCK_SIZE = 256 * 1024 };
+
+//! @internal
+//!
+//! @brief Size of a huge page, one iTLB entry covers the whole block.
+enum { MP_ARENA_HUGE_PAGE = 2 * 1024 * 1024 };
+
+static size_t mpGetPageSize()
+{
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  long size = sysconf(_SC_PAGESIZE);
+  return size > 0 ? (size_t)size : 4096;
+#endif
+}
+
+static inline size_t mpAlignUp(size_t x, size_t alignment)
+{
+  return (x + alignment - 1) & ~(alignment - 1);
+}
+
+//! @internal
+//!
+//! @brief Map @a size bytes of readable, writable and executable memory,
+//! by huge pages if @a huge is true and the OS allows it.
+static char* mpMapCode(size_t size, bool huge)
+{
+#if defined(_WIN32)
+  // Large pages need SeLockMemoryPrivilege, normal pages are used without it.
+  if (huge)
+  {
+    SIZE_T large = GetLargePageMinimum();
+    if (large != 0 && size % large == 0)
+    {
+      void* p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_EXECUTE_READWRITE);
+      if (p != NULL) return reinterpret_cast<char*>(p);
+    }
+  }
+
+  return reinterpret_cast<char*>(VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+#else
+  const int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+#if defined(MAP_HUGETLB)
+  // Pages reserved by the administrator (hugetlbfs).
+  if (huge)
+  {
+    void* p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return reinterpret_cast<char*>(p);
+  }
+#endif // MAP_HUGETLB
+
+  if (!huge)
+  {
+    void* p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p != MAP_FAILED ? reinterpret_cast<char*>(p) : NULL;
+  }
+
+  // Transparent huge pages, the block must be aligned to the huge page.
+  size_t mappedSize = size + MP_ARENA_HUGE_PAGE;
+  void* p = mmap(NULL, mappedSize, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+
+  char* mapped = reinterpret_cast<char*>(p);
+  char* aligned = reinterpret_cast<char*>(mpAlignUp((size_t)mapped, MP_ARENA_HUGE_PAGE));
+
+  if (aligned != mapped) munmap(mapped, (size_t)(aligned - mapped));
+  if (aligned + size != mapped + mappedSize) munmap(aligned + size, (size_t)(mapped + mappedSize - (aligned + size)));
+
+#if defined(MADV_HUGEPAGE)
+  madvise(aligned, size, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+
+  return aligned;
+#endif // _WIN32
+}
+
+static void mpUnmapCode(char* data, size_t size)
+{
+#if defined(_WIN32)
+  (void)size;
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, size);
+#endif // _WIN32
+}
+
+// ============================================================================
+// [MathPresso::CodeArenaPrivate]
+// ============================================================================
+
+CodeArenaPrivate::CodeArenaPrivate(size_t blockSize, int flags) :
+  flags(flags),
+  current(NULL),
+  generation(0),
+  functionCount(0),
+  reservedBytes(0)
+{
+  refCount.init(1);
+
+  size_t pageSize = (flags & MARENA_HUGE_PAGES) ? (size_t)MP_ARENA_HUGE_PAGE : mpGetPageSize();
+  if (blockSize == 0) blockSize = MP_ARENA_BLOCK_SIZE;
+  this->blockSize = mpAlignUp(blockSize, pageSize);
+}
+
+CodeArenaPrivate::~CodeArenaPrivate()
+{
+  // All functions were freed by the expressions, their contexts reference
+  // the arena.
+  size_t i, len = blocks.getLength();
+  for (i = 0; i < len; i++)
+  {
+    mpUnmapCode(blocks[i]->data, blocks[i]->size);
+    delete blocks[i];
+  }
+}
+
+void* CodeArenaPrivate::alloc(size_t size)
+{
+  size = mpAlignUp(size, MP_ARENA_ALIGNMENT);
+  std::lock_guard<std::mutex> guard(lock);
+
+  CodeArenaBlock* block = current;
+  if (block == NULL || block->size - block->offset < size)
+  {
+    if (size > blockSize)
+    {
+      // Large function has a block of its own, the current block continues
+      // to be used by the next functions.
+      block = newBlock(size);
+    }
+    else
+    {
+      if (current != NULL && current->live == 0) deleteBlock(current);
+      current = block = newBlock(blockSize);
+    }
+
+    if (block == NULL) return NULL;
+  }
+
+  void* p = block->data + block->offset;
+  block->offset += size;
+  block->live++;
+
+  functionCount++;
+  return p;
+}
+
+bool CodeArenaPrivate::free(void* p)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  size_t i = findBlock(p);
+  if (i == blocks.getLength()) return false;
+
+  CodeArenaBlock* block = blocks[i];
+  functionCount--;
+
+  // Block of an older generation is unmapped with its last function.
+  if (--block->live == 0 && block != current) deleteBlock(block);
+  return true;
+}
+
+size_t CodeArenaPrivate::nextGeneration()
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (current != NULL && current->live == 0) deleteBlock(current);
+  current = NULL;
+
+  return ++generation;
+}
+
+CodeArenaBlock* CodeArenaPrivate::newBlock(size_t size)
+{
+  bool huge = (flags & MARENA_HUGE_PAGES) != 0;
+  size = mpAlignUp(size, huge ? (size_t)MP_ARENA_HUGE_PAGE : mpGetPageSize());
+
+  CodeArenaBlock* block = new(std::nothrow) CodeArenaBlock();
+  if (block == NULL) return NULL;
+
+  block->data = mpMapCode(size, huge);
+  block->size = size;
+  block->offset = 0;
+  block->live = 0;
+
+  // Keep blocks sorted by address, so the block of a function is found by
+  // binary search.
+  size_t i = 0, len = blocks.getLength();
+  while (i < len && blocks[i]->data < block->data) i++;
+
+  if (block->data == NULL || !blocks.insert(i, block))
+  {
+    if (block->data != NULL) mpUnmapCode(block->data, size);
+    delete block;
+    return NULL;
+  }
+
+  reservedBytes += size;
+  return block;
+}
+
+void CodeArenaPrivate::deleteBlock(CodeArenaBlock* block)
+{
+  size_t i = findBlock(block->data);
+  MP_ASSERT(i != blocks.getLength());
+
+  blocks.removeAt(i);
+  reservedBytes -= block->size;
+
+  mpUnmapCode(block->data, block->size);
+  delete block;
+}
+
+size_t CodeArenaPrivate::findBlock(const void* p) const
+{
+  const char* address = reinterpret_cast<const char*>(p);
+  size_t lo = 0, hi = blocks.getLength();
+
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    const CodeArenaBlock* block = blocks[mid];
+
+    if (address < block->data)
+      hi = mid;
+    else if (address >= block->data + block->size)
+      lo = mid + 1;
+    else
+      return mid;
+  }
+
+  return blocks.getLength();
+}
+
+// ============================================================================
+// [MathPresso::CodeArena]
+// ============================================================================
+
+CodeArena::CodeArena(size_t blockSize, int flags)
+{
+  _privateData = new(std::nothrow) CodeArenaPrivate(blockSize, flags);
+}
+
+CodeArena::~CodeArena()
+{
+  CodeArenaPrivate* d = reinterpret_cast<CodeArenaPrivate*>(_privateData);
+  if (d) d->release();
+}
+
+size_t CodeArena::nextGeneration()
+{
+  CodeArenaPrivate* d = reinterpret_cast<CodeArenaPrivate*>(_privateData);
+  return d ? d->nextGeneration() : 0;
+}
+
+size_t CodeArena::getGeneration() const
+{
+  CodeArenaPrivate* d = reinterpret_cast<CodeArenaPrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->generation;
+}
+
+size_t CodeArena::getFunctionCount() const
+{
+  CodeArenaPrivate* d = reinterpret_cast<CodeArenaPrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->functionCount;
+}
+
+size_t CodeArena::getBlockCount() const
+{
+  CodeArenaPrivate* d = reinterpret_cast<CodeArenaPrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->blocks.getLength();
+}
+
+size_t CodeArena::getReservedBytes() const
+{
+  CodeArenaPrivate* d = reinterpret_cast<CodeArenaPrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->reservedBytes;
+}
+
+} // MathPresso namespace
@@ -0,0 +1,117 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _MATHPRESSO_ARENA_P_H
+#define _MATHPRESSO_ARENA_P_H
+
+#include "MathPresso.h"
+#include "MathPresso_Util_p.h"
+
+#include <mutex>
+
+namespace MathPresso {
+
+// ============================================================================
+// [MathPresso::CodeArenaBlock]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Executable memory mapped at once, functions are allocated from it
+//! one after another.
+struct MATHPRESSO_HIDDEN CodeArenaBlock
+{
+  //! @brief Address of the memory.
+  char* data;
+  //! @brief Size of the memory.
+  size_t size;
+  //! @brief Offset of the next function.
+  size_t offset;
+  //! @brief Count of functions not freed yet.
+  size_t live;
+};
+
+// ============================================================================
+// [MathPresso::CodeArenaPrivate]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Private data of @ref CodeArena, referenced by the arena and by
+//! contexts that use it.
+struct MATHPRESSO_HIDDEN CodeArenaPrivate
+{
+  CodeArenaPrivate(size_t blockSize, int flags);
+  ~CodeArenaPrivate();
+
+  inline void addRef() { refCount.inc(); }
+  inline void release() { if (refCount.dec()) delete this; }
+
+  //! @brief Allocate @a size bytes aligned to a cache line, NULL if there
+  //! is not enough memory.
+  void* alloc(size_t size);
+  //! @brief Free function at @a p, unmap its block if it was the last one of
+  //! an older generation. Return false if @a p is not in this arena.
+  bool free(void* p);
+
+  //! @brief Start a new generation, return it.
+  size_t nextGeneration();
+
+  //! @brief Map a new block of at least @a size bytes.
+  CodeArenaBlock* newBlock(size_t size);
+  //! @brief Unmap @a block and remove it from @ref blocks.
+  void deleteBlock(CodeArenaBlock* block);
+  //! @brief Index of the block that contains @a p or @ref blocks length.
+  size_t findBlock(const void* p) const;
+
+  Atomic refCount;
+
+  //! @brief Size of a new block, multiple of the page size.
+  size_t blockSize;
+  //! @brief Options, see @ref MARENA.
+  int flags;
+
+  //! @brief Protects the members below.
+  mutable std::mutex lock;
+
+  //! @brief All blocks sorted by address.
+  Vector<CodeArenaBlock*> blocks;
+  //! @brief Block functions of the current generation are allocated from,
+  //! NULL after a new generation was started.
+  CodeArenaBlock* current;
+  //! @brief Current generation.
+  size_t generation;
+  //! @brief Count of functions not freed yet.
+  size_t functionCount;
+  //! @brief Sum of sizes of all blocks.
+  size_t reservedBytes;
+
+private:
+  MP_DISABLE_COPY(CodeArenaPrivate)
+};
+
+} // MathPresso namespace
+
+#endif // _MATHPRESSO_ARENA_P_H
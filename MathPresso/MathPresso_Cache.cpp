@@ -0,0 +1,712 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// [Dependencies]
+#include "MathPresso.h"
+#include "MathPresso_AST_p.h"
+#include "MathPresso_Cache_p.h"
+#include "MathPresso_Context_p.h"
+#include "MathPresso_JIT_p.h"
+#include "MathPresso_Util_p.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace MathPresso {
+
+// ============================================================================
+// [MathPresso::ExpressionCachePrivate - Construction / Destruction]
+// ============================================================================
+
+ExpressionCachePrivate::ExpressionCachePrivate(size_t capacity) :
+  first(NULL),
+  last(NULL),
+  size(0),
+  capacity(capacity),
+  hits(0),
+  misses(0),
+  loads(0)
+{
+}
+
+ExpressionCachePrivate::~ExpressionCachePrivate()
+{
+  clear();
+}
+
+// ============================================================================
+// [MathPresso::ExpressionCachePrivate - Methods]
+// ============================================================================
+
+ExpressionPrivate* ExpressionCachePrivate::get(const std::string& key, const std::string* alias)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  ExpressionCacheEntry** pEntry = entries.get(key.c_str(), key.length());
+  if (pEntry == NULL) return NULL;
+
+  ExpressionCacheEntry* entry = *pEntry;
+
+  // Move to the front of the LRU list.
+  unlink(entry);
+  link(entry);
+
+  if (alias != NULL && !entries.contains(alias->c_str(), alias->length()))
+  {
+    if (entries.put(alias->c_str(), alias->length(), entry))
+      entry->keys.push_back(*alias);
+  }
+
+  hits++;
+  entry->p->addRef();
+  return entry->p;
+}
+
+void ExpressionCachePrivate::put(const std::string& textKey, const std::string& treeKey, ExpressionPrivate* p)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  misses++;
+
+  // Other thread could compile the same expression meanwhile, keep the first.
+  if (capacity == 0 || entries.contains(treeKey.c_str(), treeKey.length()))
+    return;
+
+  ExpressionCacheEntry* entry = new(std::nothrow) ExpressionCacheEntry();
+  if (entry == NULL) return;
+
+  if (!entries.put(treeKey.c_str(), treeKey.length(), entry))
+  {
+    delete entry;
+    return;
+  }
+
+  entry->p = p;
+  entry->keys.push_back(treeKey);
+
+  if (!entries.contains(textKey.c_str(), textKey.length()) &&
+      entries.put(textKey.c_str(), textKey.length(), entry))
+  {
+    entry->keys.push_back(textKey);
+  }
+
+  p->addRef();
+  link(entry);
+  size++;
+
+  evict(capacity);
+}
+
+void ExpressionCachePrivate::setCapacity(size_t capacity)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  this->capacity = capacity;
+  evict(capacity);
+}
+
+void ExpressionCachePrivate::clear()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  evict(0);
+}
+
+void ExpressionCachePrivate::link(ExpressionCacheEntry* entry)
+{
+  entry->prev = NULL;
+  entry->next = first;
+
+  if (first != NULL)
+    first->prev = entry;
+  else
+    last = entry;
+
+  first = entry;
+}
+
+void ExpressionCachePrivate::unlink(ExpressionCacheEntry* entry)
+{
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    first = entry->next;
+
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    last = entry->prev;
+}
+
+void ExpressionCachePrivate::evict(size_t maxSize)
+{
+  while (size > maxSize)
+  {
+    ExpressionCacheEntry* entry = last;
+    unlink(entry);
+
+    for (size_t i = 0; i < entry->keys.size(); i++)
+      entries.remove(entry->keys[i].c_str(), entry->keys[i].length());
+
+    // Expressions created from the entry keep their reference.
+    mpReleaseExpression(entry->p);
+    delete entry;
+
+    size--;
+  }
+}
+
+// ============================================================================
+// [MathPresso::ExpressionCachePrivate - Directory]
+// ============================================================================
+
+static const char mpDiskCacheMagic[8] = { 'M', 'P', 'J', 'I', 'T', 'C', 0, 0 };
+
+//! @internal
+//!
+//! @brief FNV-1a hash of @a size bytes at @a data, continues from @a hash.
+static uint64_t mpHashBytes(uint64_t hash, const void* data, size_t size)
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static const uint64_t MP_HASH_INIT = 0xCBF29CE484222325ULL;
+
+static std::string mpGetDiskCachePath(const std::string& directory, const std::string& key)
+{
+  // Different keys can have the same file name, the key is validated when
+  // the file is loaded.
+  char buf[32];
+  snprintf(buf, sizeof(buf), "/%016llx.mpc",
+    (unsigned long long)mpHashBytes(MP_HASH_INIT, key.data(), key.length()));
+  return directory + buf;
+}
+
+static uint32_t mpGetDiskCacheChecksum(const char* key, size_t keySize, const char* code, size_t codeSize)
+{
+  uint64_t hash = mpHashBytes(MP_HASH_INIT, key, keySize);
+  hash = mpHashBytes(hash, code, codeSize);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+//! @internal
+//!
+//! @brief Read-only view of a whole file, mapped if the OS supports it.
+struct DiskCacheFile
+{
+  const char* data;
+  size_t size;
+};
+
+#if !defined(_WIN32)
+//! @internal
+//!
+//! @brief Whether a file or directory with status @a st can be trusted, it
+//! must be owned by the effective user and nobody else may write to it.
+static bool mpIsPrivateStat(const struct stat& st)
+{
+  return st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+#endif // !_WIN32
+
+//! @internal
+//!
+//! @brief Whether @a directory can be trusted, code of other users is never
+//! loaded and never stored where other users could replace it.
+static bool mpIsPrivateDirectory(const std::string& directory)
+{
+#if defined(_WIN32)
+  (void)directory;
+  return true;
+#else
+  struct stat st;
+  return stat(directory.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && mpIsPrivateStat(st);
+#endif // _WIN32
+}
+
+static bool mpOpenDiskCacheFile(DiskCacheFile& file, const char* path)
+{
+#if defined(_WIN32)
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return false;
+
+  bool ok = false;
+  long size;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+  {
+    char* data = reinterpret_cast<char*>(::malloc((size_t)size));
+    if (data != NULL && fread(data, 1, (size_t)size, f) == (size_t)size)
+    {
+      file.data = data;
+      file.size = (size_t)size;
+      ok = true;
+    }
+    else
+    {
+      ::free(data);
+    }
+  }
+
+  fclose(f);
+  return ok;
+#else
+  // Symbolic links are not followed, the file itself must be private.
+  int fd = open(path, O_RDONLY | O_NOFOLLOW);
+  if (fd == -1) return false;
+
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && mpIsPrivateStat(st) && st.st_size > 0)
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) return false;
+
+  file.data = reinterpret_cast<const char*>(data);
+  file.size = (size_t)st.st_size;
+  return true;
+#endif // _WIN32
+}
+
+static void mpCloseDiskCacheFile(DiskCacheFile& file)
+{
+#if defined(_WIN32)
+  ::free(const_cast<char*>(file.data));
+#else
+  munmap(const_cast<char*>(file.data), file.size);
+#endif // _WIN32
+}
+
+std::string ExpressionCachePrivate::getDirectory() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return directory;
+}
+
+MEvalFunc ExpressionCachePrivate::load(WorkContext& ctx, const std::string& key)
+{
+  std::string directory = getDirectory();
+  if (!mpIsPrivateDirectory(directory)) return NULL;
+
+  std::string path = mpGetDiskCachePath(directory, key);
+
+  DiskCacheFile file;
+  if (!mpOpenDiskCacheFile(file, path.c_str())) return NULL;
+
+  // The file is used only if everything matches, otherwise the code is
+  // compiled again and the file is replaced.
+  MEvalFunc fn = NULL;
+  DiskCacheHeader header;
+
+  if (file.size >= sizeof(DiskCacheHeader))
+  {
+    memcpy(&header, file.data, sizeof(DiskCacheHeader));
+
+    // Sizes are validated before they are used to address the file.
+    if (memcmp(header.magic, mpDiskCacheMagic, sizeof(mpDiskCacheMagic)) == 0 &&
+        header.version == MP_DISK_CACHE_VERSION &&
+        header.keySize == key.length() &&
+        header.codeSize != 0 &&
+        file.size - sizeof(DiskCacheHeader) >= (size_t)header.keySize &&
+        file.size - sizeof(DiskCacheHeader) - (size_t)header.keySize == (size_t)header.codeSize)
+    {
+      const char* fileKey = file.data + sizeof(DiskCacheHeader);
+      const char* code = fileKey + header.keySize;
+
+      if (memcmp(fileKey, key.data(), key.length()) == 0 &&
+          header.checksum == mpGetDiskCacheChecksum(fileKey, header.keySize, code, header.codeSize))
+      {
+        fn = mpLoadFunction(ctx, code, header.codeSize);
+      }
+    }
+  }
+
+  mpCloseDiskCacheFile(file);
+
+  if (fn != NULL)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    loads++;
+  }
+  return fn;
+}
+
+void mpStoreDiskCache(const std::string& directory, const std::string& key, const std::string& image)
+{
+  if (!mpIsPrivateDirectory(directory)) return;
+
+  std::string path = mpGetDiskCachePath(directory, key);
+
+  DiskCacheHeader header;
+  memcpy(header.magic, mpDiskCacheMagic, sizeof(mpDiskCacheMagic));
+  header.version = MP_DISK_CACHE_VERSION;
+  header.keySize = (uint32_t)key.length();
+  header.codeSize = (uint32_t)image.length();
+  header.checksum = mpGetDiskCacheChecksum(key.data(), key.length(), image.data(), image.length());
+
+  // Written to a temporary file first and renamed, other processes never
+  // see a partially written file.
+  char suffix[64];
+#if defined(_WIN32)
+  snprintf(suffix, sizeof(suffix), ".%d.%p.tmp", (int)_getpid(), (void*)&header);
+#else
+  snprintf(suffix, sizeof(suffix), ".%d.%p.tmp", (int)getpid(), (void*)&header);
+#endif // _WIN32
+  std::string tmpPath = path + suffix;
+
+#if defined(_WIN32)
+  FILE* f = fopen(tmpPath.c_str(), "wb");
+#else
+  // Created only by this call and readable only by this user.
+  FILE* f = NULL;
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd != -1 && (f = fdopen(fd, "wb")) == NULL) close(fd);
+#endif // _WIN32
+  if (f == NULL) return;
+
+  bool ok = fwrite(&header, sizeof(DiskCacheHeader), 1, f) == 1 &&
+            fwrite(key.data(), 1, key.length(), f) == key.length() &&
+            fwrite(image.data(), 1, image.length(), f) == image.length();
+  ok &= fclose(f) == 0;
+
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+    remove(tmpPath.c_str());
+}
+
+// ============================================================================
+// [MathPresso::Cache - Keys]
+// ============================================================================
+
+static inline bool mpIsWordChar(char c)
+{
+  return (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
+
+static void mpAppendContextKey(std::string& key, char type, WorkContext& ctx)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%c%lu:%d:", type, (unsigned long)ctx._ctx->id, ctx._options);
+  key.append(buf);
+}
+
+std::string mpGetCacheTextKey(WorkContext& ctx, const char* text)
+{
+  std::string key;
+  mpAppendContextKey(key, 'T', ctx);
+
+  // Whitespace is removed, except a single space that separates two words
+  // or two characters of an operator.
+  bool space = false;
+  for (const char* p = text; *p; p++)
+  {
+    char c = *p;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    {
+      space = true;
+      continue;
+    }
+
+    // "x < = y" is not "x <= y".
+    if (space && !key.empty())
+    {
+      char last = key[key.length() - 1];
+      if ((mpIsWordChar(c) && mpIsWordChar(last)) ||
+          (c == '=' && (last == '=' || last == '!' || last == '<' || last == '>')))
+        key.push_back(' ');
+    }
+
+    key.push_back(c);
+    space = false;
+  }
+
+  return key;
+}
+
+//! @internal
+//!
+//! @brief Get whether @a element assigns to a variable, operands that read
+//! the variable are then evaluated in a different order when swapped.
+static bool mpHasAssignment(ASTElement* element)
+{
+  if (element->getElementType() == MELEMENT_OPERATOR &&
+      reinterpret_cast<ASTOperator*>(element)->getOperatorType() == MOPERATOR_ASSIGN)
+    return true;
+
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
+
+  for (i = 0; i < len; i++)
+  {
+    if (mpHasAssignment(children[i])) return true;
+  }
+  return false;
+}
+
+static std::string mpGetTreeKey(ASTElement* element, bool portable)
+{
+  char buf[64];
+
+  switch (element->getElementType())
+  {
+    case MELEMENT_BLOCK:
+    {
+      ASTElement** children = element->getChildrenElements();
+      size_t count = element->getChildrenCount();
+
+      std::string key("{");
+      for (size_t i = 0; i < count; i++)
+      {
+        if (i != 0) key.push_back(';');
+        key.append(mpGetTreeKey(children[i], portable));
+      }
+      key.push_back('}');
+      return key;
+    }
+
+    case MELEMENT_CONSTANT:
+    {
+      // Bits of the value, the text would lose precision.
+      mreal_t value = reinterpret_cast<ASTConstant*>(element)->getValue();
+      unsigned char bytes[sizeof(mreal_t)];
+      memcpy(bytes, &value, sizeof(mreal_t));
+
+      std::string key("c");
+      for (size_t i = 0; i < sizeof(mreal_t); i++)
+      {
+        snprintf(buf, sizeof(buf), "%02x", bytes[i]);
+        key.append(buf);
+      }
+      return key;
+    }
+
+    case MELEMENT_VARIABLE:
+    {
+      snprintf(buf, sizeof(buf), "v%d", reinterpret_cast<ASTVariable*>(element)->getOffset());
+      return std::string(buf);
+    }
+
+    case MELEMENT_OPERATOR:
+    {
+      ASTOperator* node = reinterpret_cast<ASTOperator*>(element);
+      uint op = node->getOperatorType();
+
+      std::string left = mpGetTreeKey(node->getLeft(), portable);
+      std::string right = mpGetTreeKey(node->getRight(), portable);
+
+      // a + b, a * b, a == b and a != b are the same as b + a, b * a,
+      // b == a and b != a, unless one of them assigns (x*(x=y) reads x
+      // before the assignment and (x=y)*x after it).
+      if ((op == MOPERATOR_PLUS || op == MOPERATOR_MUL ||
+           op == MOPERATOR_EQ || op == MOPERATOR_NE) && right < left &&
+          !mpHasAssignment(node->getLeft()) && !mpHasAssignment(node->getRight()))
+        left.swap(right);
+
+      snprintf(buf, sizeof(buf), "(%u ", op);
+      return std::string(buf) + left + " " + right + ")";
+    }
+
+    case MELEMENT_CALL:
+    {
+      ASTCall* call = reinterpret_cast<ASTCall*>(element);
+      Function* fn = call->getFunction();
+      ASTElement** arguments = call->getArguments();
+
+      std::vector<std::string> args;
+      bool assigns = false;
+      for (size_t i = 0; i < call->getArgumentsCount(); i++)
+      {
+        args.push_back(mpGetTreeKey(arguments[i], portable));
+        assigns |= mpHasAssignment(arguments[i]);
+      }
+
+      // min() and max() are not commutative if one argument is NaN.
+      if (fn->getFunctionId() == MFUNCTION_AVG && !assigns)
+        std::sort(args.begin(), args.end());
+
+      // Address of a function is valid only in this process, the portable
+      // key has the id of a built-in function instead.
+      if (portable && fn->getFunctionId() != -1)
+        snprintf(buf, sizeof(buf), "f:%d[", fn->getFunctionId());
+      else
+        snprintf(buf, sizeof(buf), "f%p:%d[", fn->getPtr(), fn->getFunctionId());
+
+      std::string key(buf);
+      for (size_t i = 0; i < args.size(); i++)
+      {
+        if (i != 0) key.push_back(',');
+        key.append(args[i]);
+      }
+      key.push_back(']');
+      return key;
+    }
+
+    case MELEMENT_TRANSFORM:
+    {
+      ASTTransform* transform = reinterpret_cast<ASTTransform*>(element);
+
+      snprintf(buf, sizeof(buf), "(t%u:%d ", transform->getTransformType(), transform->getExponent());
+      return std::string(buf) + mpGetTreeKey(transform->getChild(), portable) + ")";
+    }
+
+    case MELEMENT_CONDITION:
+    {
+      ASTCondition* condition = reinterpret_cast<ASTCondition*>(element);
+
+      return std::string("(? ") + mpGetTreeKey(condition->getCondition(), portable) + " " +
+        mpGetTreeKey(condition->getThen(), portable) + " " + mpGetTreeKey(condition->getElse(), portable) + ")";
+    }
+
+    default:
+      MP_ASSERT_NOT_REACHED();
+      return std::string();
+  }
+}
+
+std::string mpGetCacheTreeKey(WorkContext& ctx, ASTElement* ast)
+{
+  std::string key;
+  mpAppendContextKey(key, 'A', ctx);
+  key.append(mpGetTreeKey(ast, false));
+  return key;
+}
+
+std::string mpGetCacheDiskKey(WorkContext& ctx, ASTElement* ast)
+{
+  // Context id is valid only in this process, the tree has everything the
+  // code depends on (constants are folded and variables are offsets). Code
+  // generated by a different build of the library is never loaded.
+  char buf[64];
+  snprintf(buf, sizeof(buf), "D%u:%08x:%d:", (uint)MP_DISK_CACHE_VERSION, (uint)mpGetJitFeatures(), ctx._options);
+
+  std::string key(buf);
+  key.append(mpGetJitBuildId());
+  key.push_back(':');
+  key.append(mpGetTreeKey(ast, true));
+  return key;
+}
+
+// ============================================================================
+// [MathPresso::ExpressionCache - Construction / Destruction]
+// ============================================================================
+
+ExpressionCache::ExpressionCache(size_t capacity)
+{
+  _privateData = new(std::nothrow) ExpressionCachePrivate(capacity);
+}
+
+ExpressionCache::~ExpressionCache()
+{
+  if (_privateData) delete reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+}
+
+// ============================================================================
+// [MathPresso::ExpressionCache - Methods]
+// ============================================================================
+
+size_t ExpressionCache::getCapacity() const
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->capacity;
+}
+
+void ExpressionCache::setCapacity(size_t capacity)
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d) d->setCapacity(capacity);
+}
+
+size_t ExpressionCache::getSize() const
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->size;
+}
+
+size_t ExpressionCache::getHitCount() const
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->hits;
+}
+
+size_t ExpressionCache::getMissCount() const
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->misses;
+}
+
+void ExpressionCache::clear()
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d) d->clear();
+}
+
+void ExpressionCache::setDirectory(const char* path)
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d == NULL) return;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  d->directory = (path != NULL) ? path : "";
+
+  // "dir/" and "dir" are the same directory.
+  while (d->directory.length() > 1 && d->directory[d->directory.length() - 1] == '/')
+    d->directory.erase(d->directory.length() - 1);
+}
+
+size_t ExpressionCache::getLoadCount() const
+{
+  ExpressionCachePrivate* d = reinterpret_cast<ExpressionCachePrivate*>(_privateData);
+  if (d == NULL) return 0;
+
+  std::lock_guard<std::mutex> guard(d->lock);
+  return d->loads;
+}
+
+} // MathPresso namespace
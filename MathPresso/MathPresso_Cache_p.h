@@ -0,0 +1,186 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _MATHPRESSO_CACHE_P_H
+#define _MATHPRESSO_CACHE_P_H
+
+#include "MathPresso.h"
+#include "MathPresso_Context_p.h"
+#include "MathPresso_Util_p.h"
+
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace MathPresso {
+
+// ============================================================================
+// [Forward Declarations]
+// ============================================================================
+
+class ASTElement;
+
+// ============================================================================
+// [MathPresso::DiskCache]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Version of files stored to the cache directory, it must be
+//! incremented when the generated code or the file format changes.
+enum { MP_DISK_CACHE_VERSION = 2 };
+
+//! @internal
+//!
+//! @brief Header of a file in the cache directory, followed by the key and
+//! the machine code.
+struct DiskCacheHeader
+{
+  //! @brief "MPJITC\0\0".
+  char magic[8];
+  //! @brief @ref MP_DISK_CACHE_VERSION.
+  uint32_t version;
+  //! @brief Size of the key in bytes.
+  uint32_t keySize;
+  //! @brief Size of the code in bytes.
+  uint32_t codeSize;
+  //! @brief Hash of the key and the code, a partially written or damaged
+  //! file is never loaded.
+  uint32_t checksum;
+};
+
+// ============================================================================
+// [MathPresso::ExpressionCacheEntry]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Cached expression, linked in the least recently used order.
+struct MATHPRESSO_HIDDEN ExpressionCacheEntry
+{
+  //! @brief Shared expression data (referenced by the entry).
+  ExpressionPrivate* p;
+
+  ExpressionCacheEntry* prev;
+  ExpressionCacheEntry* next;
+
+  //! @brief All keys mapped to this entry (source texts and the tree).
+  std::vector<std::string> keys;
+};
+
+// ============================================================================
+// [MathPresso::ExpressionCachePrivate]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Private data of @ref ExpressionCache.
+struct MATHPRESSO_HIDDEN ExpressionCachePrivate
+{
+  ExpressionCachePrivate(size_t capacity);
+  ~ExpressionCachePrivate();
+
+  //! @brief Get a referenced expression stored under @a key or NULL. If
+  //! found and @a alias is given, it's mapped to the same expression.
+  ExpressionPrivate* get(const std::string& key, const std::string* alias = NULL);
+
+  //! @brief Store expression @a p compiled from @a textKey and @a treeKey.
+  void put(const std::string& textKey, const std::string& treeKey, ExpressionPrivate* p);
+
+  void setCapacity(size_t capacity);
+  void clear();
+
+  //! @brief Get a copy of @ref directory (empty if not used).
+  std::string getDirectory() const;
+
+  //! @brief Load a row function stored under @a key from the directory to
+  //! the executable memory of @a ctx, return NULL if there is no valid file.
+  MEvalFunc load(WorkContext& ctx, const std::string& key);
+
+  // Following methods must be called with the lock held.
+  void link(ExpressionCacheEntry* entry);
+  void unlink(ExpressionCacheEntry* entry);
+  void evict(size_t maxSize);
+
+  mutable std::mutex lock;
+
+  Hash<ExpressionCacheEntry*> entries;
+
+  //! @brief Most recently used entry.
+  ExpressionCacheEntry* first;
+  //! @brief Least recently used entry.
+  ExpressionCacheEntry* last;
+
+  size_t size;
+  size_t capacity;
+
+  size_t hits;
+  size_t misses;
+
+  //! @brief Directory of compiled code shared by processes, see
+  //! @ref ExpressionCache::setDirectory().
+  std::string directory;
+  //! @brief Count of functions loaded from the directory.
+  size_t loads;
+
+private:
+  MP_DISABLE_COPY(ExpressionCachePrivate)
+};
+
+// ============================================================================
+// [MathPresso::Cache - Keys]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Get a cache key of the source @a text (whitespace is normalized).
+MATHPRESSO_HIDDEN std::string mpGetCacheTextKey(WorkContext& ctx, const char* text);
+
+//! @internal
+//!
+//! @brief Get a cache key of the optimized tree @a ast, operands of
+//! commutative operators are sorted.
+MATHPRESSO_HIDDEN std::string mpGetCacheTreeKey(WorkContext& ctx, ASTElement* ast);
+
+//! @internal
+//!
+//! @brief Get a key of file with code compiled from @a ast in the cache
+//! directory, it doesn't depend on the process (there are no addresses),
+//! but on the CPU features, the build of the library (see
+//! @ref mpGetJitBuildId()) and @ref MP_DISK_CACHE_VERSION.
+MATHPRESSO_HIDDEN std::string mpGetCacheDiskKey(WorkContext& ctx, ASTElement* ast);
+
+//! @internal
+//!
+//! @brief Store machine code @a image of a row function under @a key to
+//! the cache @a directory, it doesn't need the cache, so code compiled after
+//! the expression was created is stored even if the cache doesn't exist.
+MATHPRESSO_HIDDEN void mpStoreDiskCache(const std::string& directory, const std::string& key, const std::string& image);
+
+} // MathPresso namespace
+
+#endif // _MATHPRESSO_CACHE_P_H
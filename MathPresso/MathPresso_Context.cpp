@@ -26,6 +26,7 @@
 // [Dependencies]
 #include "MathPresso.h"
 #include "MathPresso_AST_p.h"
+#include "MathPresso_Arena_p.h"
 #include "MathPresso_Context_p.h"
 #include "MathPresso_Parser_p.h"
 #include "MathPresso_Tokenizer_p.h"
@@ -37,13 +38,23 @@ namespace MathPresso {
 // [MathPresso::ContextPrivate]
 // ============================================================================
 
-ContextPrivate::ContextPrivate()
+//! @internal
+//!
+//! @brief Source of @ref ContextPrivate::id.
+static Atomic mpContextIdCounter = { 0 };
+
+ContextPrivate::ContextPrivate() :
+  frozen(NULL),
+  arena(NULL)
 {
   refCount.init(1);
+  updateId();
 }
 
 ContextPrivate::~ContextPrivate()
 {
+  if (frozen) ::free(frozen);
+  if (arena) arena->release();
 }
 
 ContextPrivate* ContextPrivate::copy() const
@@ -51,21 +62,72 @@ ContextPrivate* ContextPrivate::copy() const
   ContextPrivate* ctx = new(std::nothrow) ContextPrivate();
   if (ctx == NULL) return NULL;
 
-  if (!ctx->variables.mergeWith(variables)) { delete ctx; return NULL; }
-  if (!ctx->functions.mergeWith(functions)) { delete ctx; return NULL; }
+  if (frozen)
+  {
+    if (!frozen->variables.copyTo(ctx->variables)) { delete ctx; return NULL; }
+    if (!frozen->functions.copyTo(ctx->functions)) { delete ctx; return NULL; }
+  }
+  else
+  {
+    if (!ctx->variables.mergeWith(variables)) { delete ctx; return NULL; }
+    if (!ctx->functions.mergeWith(functions)) { delete ctx; return NULL; }
+  }
+
+  ctx->arena = arena;
+  if (arena) arena->addRef();
   return ctx;
 }
 
+void ContextPrivate::updateId()
+{
+  id = mpContextIdCounter.inc();
+}
+
+// ============================================================================
+// [MathPresso::FrozenSymbols]
+// ============================================================================
+
+FrozenSymbols* mpFreezeSymbols(const Hash<Variable>& variables, const Hash<Function>& functions)
+{
+  size_t size = mpAlign8(sizeof(FrozenSymbols)) +
+                FrozenHash<Variable>::getSize(variables) +
+                FrozenHash<Function>::getSize(functions);
+
+  FrozenSymbols* symbols = reinterpret_cast<FrozenSymbols*>(::malloc(size));
+  if (symbols == NULL) return NULL;
+
+  char* mem = reinterpret_cast<char*>(symbols) + mpAlign8(sizeof(FrozenSymbols));
+  if (!symbols->variables.init(variables, mem) ||
+      !symbols->functions.init(functions, mem))
+  {
+    ::free(symbols);
+    return NULL;
+  }
+
+  MP_ASSERT(mem == reinterpret_cast<char*>(symbols) + size);
+  return symbols;
+}
+
 // ============================================================================
 // [MathPresso::WorkContext]
 // ============================================================================
 
-WorkContext::WorkContext(const Context& ctx) :
-  _id(0)
+WorkContext::WorkContext(const Context& ctx, int options) :
+  _options(options),
+  _id(0),
+  _memory(0)
 {
   _ctx = reinterpret_cast<ContextPrivate*>(ctx._privateData);
 }
 
+WorkContext::WorkContext(ContextPrivate* ctx, int options) :
+  _ctx(ctx),
+  _options(options),
+  _id(0),
+  _memory(0)
+{
+}
+
 WorkContext::~WorkContext()
 {
 }
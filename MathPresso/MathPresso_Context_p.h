@@ -32,6 +32,8 @@
 namespace MathPresso {
 
 class ASTElement;
+struct CodeArenaPrivate;
+struct VMProgram;
 
 // ============================================================================
 // [MathPresso::MFunc]
@@ -106,6 +108,26 @@ struct Variable
   };
 };
 
+// ============================================================================
+// [MathPresso::FrozenSymbols]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Symbols of a context created by @ref Context::freeze(), the tables
+//! and their nodes and keys follow in the same allocation.
+struct FrozenSymbols
+{
+  FrozenHash<Variable> variables;
+  FrozenHash<Function> functions;
+};
+
+//! @internal
+//!
+//! @brief Create @ref FrozenSymbols of @a variables and @a functions, NULL
+//! if out of memory or the perfect hash can't be built. Free by ::free().
+MATHPRESSO_HIDDEN FrozenSymbols* mpFreezeSymbols(const Hash<Variable>& variables, const Hash<Function>& functions);
+
 // ============================================================================
 // [MathPresso::ContextPrivate]
 // ============================================================================
@@ -117,15 +139,44 @@ struct MATHPRESSO_HIDDEN ContextPrivate
 
   inline void addRef() { refCount.inc(); }
   inline void release() { if (refCount.dec()) delete this; }
-  inline bool isDetached() { return refCount.get() == 1; }
+  //! @brief Whether the context can be changed in place, frozen contexts
+  //! never are, they are copied.
+  inline bool isDetached() { return frozen == NULL && refCount.get() == 1; }
+
+  inline Variable* findVariable(const char* name, size_t nlen, unsigned int hash) const
+  {
+    return frozen ? frozen->variables.get(name, nlen, hash) : variables.get(name, nlen, hash);
+  }
+
+  inline Function* findFunction(const char* name, size_t nlen, unsigned int hash) const
+  {
+    return frozen ? frozen->functions.get(name, nlen, hash) : functions.get(name, nlen, hash);
+  }
 
   ContextPrivate* copy() const;
 
+  //! @brief Assign a new @ref id, must be called after each change.
+  void updateId();
+
   Atomic refCount;
 
+  //! @brief Id unique to the content of this context, it's never reused by
+  //! other contexts or after a change (used as a key by ExpressionCache).
+  size_t id;
+
+  //! @brief Variables, empty if the context is frozen.
   Hash<Variable> variables;
+  //! @brief Functions, empty if the context is frozen.
   Hash<Function> functions;
 
+  //! @brief Symbols of a context created by @ref Context::freeze() (owned),
+  //! NULL otherwise.
+  FrozenSymbols* frozen;
+
+  //! @brief Executable memory of compiled expressions (referenced), NULL if
+  //! the memory shared by all contexts is used (see @ref CodeArena).
+  CodeArenaPrivate* arena;
+
 private:
   // DISABLE COPY of ContextPrivate instance.
   ContextPrivate(const ContextPrivate& other);
@@ -136,24 +187,145 @@ private:
 // [MathPresso::ExpressionPrivate]
 // ============================================================================
 
+//! @internal
+//!
+//! @brief Prototype of function that evaluates an expression over columns
+//! of variables (see @ref Expression::evaluateColumns()).
+//!
+//! Columns and results are @c float if the expression was created with
+//! @ref MOPTION_FLOAT32, otherwise @ref mreal_t.
+typedef void (*MEvalColumnsFunc)(const void* priv, void* retval, const void* const* columns, size_t count);
+
+//! @internal
+//!
+//! @brief Count of independent accumulators of the reduce function.
+enum { REDUCE_ACCUMULATORS = 4 };
+
+//! @internal
+//!
+//! @brief Accumulators of @ref Expression::reduce().
+//!
+//! The reduce function loads the accumulators from the state and stores them
+//! back when it returns, the JIT compiled function adds row @c i to the
+//! accumulator @c i%REDUCE_ACCUMULATORS (except the last few rows, they are
+//! added to the first one), the generic one always to the first one.
+struct ReduceState
+{
+  //! @brief Accumulated values.
+  mreal_t values[REDUCE_ACCUMULATORS];
+  //! @brief Row index of each value (only @ref MREDUCE_ARGMIN and
+  //! @ref MREDUCE_ARGMAX), -1.0 if there is no row yet.
+  mreal_t indexes[REDUCE_ACCUMULATORS];
+  //! @brief Reduction, see @ref MREDUCE.
+  int op;
+};
+
+//! @internal
+//!
+//! @brief Prototype of function that evaluates @a count rows of variables
+//! (see @ref MEvalFunc) and accumulates the results to @a state.
+typedef void (*MEvalReduceFunc)(const void* priv, ReduceState* state, void* rows, size_t stride, size_t count);
+
+//! @internal
+//!
+//! @brief Default count of rows evaluated by the interpreter before an
+//! expression created with @ref MOPTION_TIERED is compiled.
+enum { MP_TIERED_THRESHOLD = 4096 };
+
 struct ExpressionPrivate
 {
   inline ExpressionPrivate() :
     ast(NULL),
-    ctx(NULL)
+    ctx(NULL),
+    program(NULL),
+    evaluate(NULL),
+    evaluateColumns(NULL),
+    options(MOPTION_NONE),
+    columnCount(0),
+    hasAssignment(false),
+    tierThreshold(MP_TIERED_THRESHOLD),
+    tierEvaluate(NULL)
   {
+    refCount.init(1);
+    tierCount.init(0);
+    for (uint i = 0; i < _MREDUCE_COUNT; i++) evaluateReduce[i] = NULL;
   }
 
   inline ~ExpressionPrivate()
   {
     MP_ASSERT(ast == NULL);
+    MP_ASSERT(zone._chunks == NULL);
     MP_ASSERT(ctx == NULL);
+    MP_ASSERT(program == NULL);
   }
 
+  inline void addRef() { refCount.inc(); }
+
+  //! @brief Reference count, more expressions share the same private data
+  //! if they were created by the same @ref ExpressionCache entry.
+  Atomic refCount;
+
   ASTElement* ast;
+  //! @brief Memory of @ref ast.
+  Zone zone;
   ContextPrivate* ctx;
+
+  //! @brief Bytecode evaluated when the expression is not JIT compiled.
+  VMProgram* program;
+
+  //! @brief Row function, same as @c Expression::_evaluate.
+  MEvalFunc evaluate;
+  //! @brief Column function, compiled on first use.
+  MEvalColumnsFunc volatile evaluateColumns;
+  //! @brief Reduce functions indexed by @ref MREDUCE, compiled on first use
+  //! (@ref MREDUCE_MEAN uses the function of @ref MREDUCE_SUM).
+  MEvalReduceFunc volatile evaluateReduce[_MREDUCE_COUNT];
+
+  //! @brief Options the expression was created with, see @ref MOPTION.
+  int options;
+
+  //! @brief Get size of a variable and of a column value (in bytes).
+  inline uint getValueSize() const
+  {
+    return (options & MOPTION_FLOAT32) ? (uint)sizeof(float) : (uint)sizeof(mreal_t);
+  }
+
+  //! @brief Count of columns used by the expression (highest variable
+  //! offset divided by @ref getValueSize() plus one).
+  uint columnCount;
+  //! @brief Whether the expression assigns to some variable.
+  bool hasAssignment;
+
+  //! @brief Count of rows evaluated by the interpreter (@ref MOPTION_TIERED).
+  Atomic tierCount;
+  //! @brief Count of rows after which the expression is compiled.
+  size_t tierThreshold;
+  //! @brief Function called by the tiered row function, the bytecode until
+  //! the expression is compiled.
+  MEvalFunc volatile tierEvaluate;
+  //! @brief Cache directory the code compiled by the tier-up or by the
+  //! background thread is stored to (empty if none).
+  std::string diskDirectory;
 };
 
+//! @internal
+//!
+//! @brief Release @a p, free the compiled functions and the tree if it's the
+//! last reference.
+MATHPRESSO_HIDDEN void mpReleaseExpression(ExpressionPrivate* p);
+
+//! @internal
+//!
+//! @brief Get the column function of @a p, compile it if it's not compiled
+//! yet. The expression must be created.
+MATHPRESSO_HIDDEN MEvalColumnsFunc mpGetColumnsFunction(ExpressionPrivate* p);
+
+//! @internal
+//!
+//! @brief Compile @a p created by @ref Expression::createAsync() and
+//! forward its tiered row function to the compiled function.
+MATHPRESSO_HIDDEN void mpCompileDeferred(ExpressionPrivate* p);
+
 // ============================================================================
 // [MathPresso::WorkContext]
 // ============================================================================
@@ -163,17 +335,45 @@ struct ExpressionPrivate
 //! @brief Simple class that is used to generate element IDs.
 struct WorkContext
 {
-  WorkContext(const Context& ctx);
+  WorkContext(const Context& ctx, int options = MOPTION_NONE);
+  WorkContext(ContextPrivate* ctx, int options = MOPTION_NONE);
   ~WorkContext();
 
   //! @brief Get next id.
   inline uint genId() { return _id++; }
 
+  //! @brief Get zone used to allocate AST elements.
+  inline Zone* getZone() { return &_zone; }
+
+  //! @brief Get whether variables and calculations are single precision.
+  inline bool isFloat32() const { return (_options & MOPTION_FLOAT32) != 0; }
+
+  //! @brief Get whether results may change by optimizations (see
+  //! @ref MOPTION_FAST_MATH).
+  inline bool isFastMath() const { return (_options & MOPTION_FAST_MATH) != 0; }
+
+  //! @brief Round constant @a value to the precision of calculations.
+  inline mreal_t toPrecision(mreal_t value) const
+  {
+    return isFloat32() ? (mreal_t)(float)value : value;
+  }
+
   //! @brief Context data.
   ContextPrivate* _ctx;
 
+  //! @brief Options of the compiled expression, see @ref MOPTION.
+  int _options;
+
   //! @brief Current counter position.
   uint _id;
+
+  //! @brief Executable memory of the JIT compiled code, 0 is shared by all
+  //! threads (see @ref Context::compileMany()).
+  uint _memory;
+
+  //! @brief Zone of the AST, freed with the context unless it's moved to
+  //! the compiled expression.
+  Zone _zone;
 };
 
 } // MathPresso namespace
@@ -48,6 +48,7 @@ struct DotBuilder
   void doOperator(ASTOperator* element);
   void doCall(ASTCall* element);
   void doTransform(ASTTransform* element);
+  void doCondition(ASTCondition* element);
 
   WorkContext& _ctx;
   StringBuilder _sb;
@@ -92,6 +93,9 @@ void DotBuilder::doElement(ASTElement* element)
     case MELEMENT_TRANSFORM:
       doTransform(reinterpret_cast<ASTTransform*>(element));
       break;
+    case MELEMENT_CONDITION:
+      doCondition(reinterpret_cast<ASTCondition*>(element));
+      break;
     default:
       MP_ASSERT_NOT_REACHED();
   }
@@ -99,8 +103,8 @@ void DotBuilder::doElement(ASTElement* element)
 
 void DotBuilder::doBlock(ASTBlock* element)
 {
-  Vector<ASTElement*>& children = element->getChildrenVector();
-  size_t i, len = children.getLength();
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
 
   _sb.appendFormat("  N_%u [label=\"", element->getElementId());
   for (i = 0; i < len; i++) _sb.appendFormat("<F%u> |", (uint)i);
@@ -148,6 +152,12 @@ void DotBuilder::doOperator(ASTOperator* element)
     case MOPERATOR_DIV   : opString = "/"; break;
     case MOPERATOR_MOD   : opString = "%"; break;
     case MOPERATOR_POW   : opString = "^"; break;
+    case MOPERATOR_EQ    : opString = "=="; break;
+    case MOPERATOR_NE    : opString = "!="; break;
+    case MOPERATOR_LT    : opString = "\\<"; break;
+    case MOPERATOR_LE    : opString = "\\<="; break;
+    case MOPERATOR_GT    : opString = "\\>"; break;
+    case MOPERATOR_GE    : opString = "\\>="; break;
     default:
       MP_ASSERT_NOT_REACHED();
   }
@@ -162,8 +172,8 @@ void DotBuilder::doOperator(ASTOperator* element)
 
 void DotBuilder::doCall(ASTCall* element)
 {
-  const Vector<ASTElement*>& arguments = element->getArguments();
-  size_t i, len = arguments.getLength();
+  ASTElement** arguments = element->getArguments();
+  size_t i, len = element->getArgumentsCount();
   size_t celter = len / 2;
 
   _sb.appendFormat("  N_%u [label=\"", element->getElementId());
@@ -197,17 +207,39 @@ void DotBuilder::doTransform(ASTTransform* element)
 
   switch (transformType)
   {
-    case MTRANSFORM_NONE  : opString = ""; break;
-    case MTRANSFORM_NEGATE: opString = "-"; break;
+    case MTRANSFORM_NONE      : opString = ""; break;
+    case MTRANSFORM_NEGATE    : opString = "-"; break;
+    case MTRANSFORM_SQRT      : opString = "sqrt"; break;
+    case MTRANSFORM_RECIPROCAL: opString = "1/"; break;
+    case MTRANSFORM_RSQRT     : opString = "1/sqrt"; break;
+    case MTRANSFORM_POWI      : opString = "^"; break;
     default:
       MP_ASSERT_NOT_REACHED();
   }
 
-  _sb.appendFormat("  N_%u [label=\"<F0>%s\"];\n", element->getElementId(), opString);
+  if (transformType == MTRANSFORM_POWI)
+    _sb.appendFormat("  N_%u [label=\"<F0>%s%d\"];\n", element->getElementId(), opString, element->getExponent());
+  else
+    _sb.appendFormat("  N_%u [label=\"<F0>%s\"];\n", element->getElementId(), opString);
   _sb.appendFormat("  N_%u -> N_%u:F0;\n", element->getElementId(), child->getElementId());
   doElement(child);
 }
 
+void DotBuilder::doCondition(ASTCondition* element)
+{
+  ASTElement* children[3] = { element->getCondition(), element->getThen(), element->getElse() };
+
+  _sb.appendFormat("  N_%u [label=\"<C>|<F0>?:|<T>|<E>\"];\n", element->getElementId());
+  _sb.appendFormat("  N_%u:C -> N_%u:F0;\n", element->getElementId(), children[0]->getElementId());
+  _sb.appendFormat("  N_%u:T -> N_%u:F0;\n", element->getElementId(), children[1]->getElementId());
+  _sb.appendFormat("  N_%u:E -> N_%u:F0;\n", element->getElementId(), children[2]->getElementId());
+
+  for (uint i = 0; i < 3; i++)
+  {
+    doElement(children[i]);
+  }
+}
+
 MATHPRESSO_HIDDEN char* mpCreateDot(WorkContext& ctx, ASTElement* tree)
 {
   DotBuilder builder(ctx);
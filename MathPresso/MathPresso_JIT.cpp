@@ -26,10 +26,12 @@
 // [Dependencies]
 #include "MathPresso.h"
 #include "MathPresso_AST_p.h"
+#include "MathPresso_Arena_p.h"
 #include "MathPresso_JIT_p.h"
 #include "MathPresso_Util_p.h"
 
 #include <AsmJit/Compiler.h>
+#include <AsmJit/CpuInfo.h>
 #include <AsmJit/Logger.h>
 #include <AsmJit/MemoryManager.h>
 #include <AsmJit/Util.h>
@@ -126,6 +128,37 @@ struct MATHPRESSO_HIDDEN JitConst
   int64_t value;
 };
 
+// ============================================================================
+// [MathPresso::JitShared]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Result of a common subexpression, computed once per row.
+struct MATHPRESSO_HIDDEN JitShared
+{
+  inline JitShared(ASTElement* element, const JitVar& var) : element(element), var(var) {}
+
+  ASTElement* element;
+  JitVar var;
+};
+
+// ============================================================================
+// [MathPresso::JitAssigned]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Variable kept in a register, either a value assigned to it (stored
+//! to the variable once at the end of the row) or its loaded value.
+struct MATHPRESSO_HIDDEN JitAssigned
+{
+  inline JitAssigned(int offset, const JitVar& var) : offset(offset), var(var) {}
+
+  int offset;
+  JitVar var;
+};
+
 // ============================================================================
 // [MathPresso::JitLogger]
 // ============================================================================
@@ -149,23 +182,340 @@ void JitLogger::logString(const char* buf, sysuint_t len) ASMJIT_NOTHROW
   _sb.appendString(buf, len);
 }
 
+// ============================================================================
+// [MathPresso::JitInstructions]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Instructions used to generate arithmetic, the set depends on
+//! the type of values and whether the JIT compiler works with one or more
+//! values at a time.
+struct MATHPRESSO_HIDDEN JitInstructions
+{
+  uint32_t mov;
+  uint32_t movu;
+  uint32_t add;
+  uint32_t sub;
+  uint32_t mul;
+  uint32_t div;
+  uint32_t min;
+  uint32_t max;
+  uint32_t sqrt;
+  uint32_t round;
+  uint32_t cmp;
+  uint32_t and_;
+  uint32_t andn;
+  uint32_t or_;
+  uint32_t xor_;
+};
+
+static const JitInstructions jitScalarF64 =
+{
+  AsmJit::INST_MOVSD,
+  AsmJit::INST_MOVSD,
+  AsmJit::INST_ADDSD,
+  AsmJit::INST_SUBSD,
+  AsmJit::INST_MULSD,
+  AsmJit::INST_DIVSD,
+  AsmJit::INST_MINSD,
+  AsmJit::INST_MAXSD,
+  AsmJit::INST_SQRTSD,
+  AsmJit::INST_ROUNDSD,
+  AsmJit::INST_CMPSD,
+  AsmJit::INST_ANDPD,
+  AsmJit::INST_ANDNPD,
+  AsmJit::INST_ORPD,
+  AsmJit::INST_XORPD
+};
+
+static const JitInstructions jitPackedF64 =
+{
+  AsmJit::INST_MOVAPD,
+  AsmJit::INST_MOVUPD,
+  AsmJit::INST_ADDPD,
+  AsmJit::INST_SUBPD,
+  AsmJit::INST_MULPD,
+  AsmJit::INST_DIVPD,
+  AsmJit::INST_MINPD,
+  AsmJit::INST_MAXPD,
+  AsmJit::INST_SQRTPD,
+  AsmJit::INST_ROUNDPD,
+  AsmJit::INST_CMPPD,
+  AsmJit::INST_ANDPD,
+  AsmJit::INST_ANDNPD,
+  AsmJit::INST_ORPD,
+  AsmJit::INST_XORPD
+};
+
+static const JitInstructions jitScalarF32 =
+{
+  AsmJit::INST_MOVSS,
+  AsmJit::INST_MOVSS,
+  AsmJit::INST_ADDSS,
+  AsmJit::INST_SUBSS,
+  AsmJit::INST_MULSS,
+  AsmJit::INST_DIVSS,
+  AsmJit::INST_MINSS,
+  AsmJit::INST_MAXSS,
+  AsmJit::INST_SQRTSS,
+  AsmJit::INST_ROUNDSS,
+  AsmJit::INST_CMPSS,
+  AsmJit::INST_ANDPS,
+  AsmJit::INST_ANDNPS,
+  AsmJit::INST_ORPS,
+  AsmJit::INST_XORPS
+};
+
+static const JitInstructions jitPackedF32 =
+{
+  AsmJit::INST_MOVAPS,
+  AsmJit::INST_MOVUPS,
+  AsmJit::INST_ADDPS,
+  AsmJit::INST_SUBPS,
+  AsmJit::INST_MULPS,
+  AsmJit::INST_DIVPS,
+  AsmJit::INST_MINPS,
+  AsmJit::INST_MAXPS,
+  AsmJit::INST_SQRTPS,
+  AsmJit::INST_ROUNDPS,
+  AsmJit::INST_CMPPS,
+  AsmJit::INST_ANDPS,
+  AsmJit::INST_ANDNPS,
+  AsmJit::INST_ORPS,
+  AsmJit::INST_XORPS
+};
+
+static inline const JitInstructions* mpGetJitInstructions(bool isFloat32, bool packed)
+{
+  if (isFloat32)
+    return packed ? &jitPackedF32 : &jitScalarF32;
+  else
+    return packed ? &jitPackedF64 : &jitScalarF64;
+}
+
+// ============================================================================
+// [MathPresso::JitMemory]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Count of executable memory managers, the first one is the global
+//! AsmJit memory manager.
+enum { JIT_MEMORY_COUNT = 16 };
+
+//! @internal
+//!
+//! @brief Memory managers created on first use, each has its own lock.
+static AsmJit::MemoryManager* volatile jitMemory[JIT_MEMORY_COUNT];
+
+//! @internal
+//!
+//! @brief Get executable memory @a index (see @ref WorkContext::_memory),
+//! threads that compile in parallel don't wait for each other's lock.
+static AsmJit::MemoryManager* mpGetJitMemory(uint index)
+{
+  if (index == 0) return AsmJit::MemoryManager::getGlobal();
+
+  index = 1 + (index - 1) % (JIT_MEMORY_COUNT - 1);
+  AsmJit::MemoryManager* memory = jitMemory[index];
+
+  if (memory == NULL)
+  {
+    memory = new(std::nothrow) AsmJit::VirtualMemoryManager();
+    if (memory == NULL) return AsmJit::MemoryManager::getGlobal();
+
+    // Another thread could create it in the meantime, use the first one.
+    if (!mpAtomicSetPtrIf((void* volatile*)&jitMemory[index], NULL, (void*)memory))
+    {
+      delete memory;
+      memory = jitMemory[index];
+    }
+  }
+
+  return memory;
+}
+
+//! @internal
+//!
+//! @brief Allocate @a size bytes of executable memory for code compiled
+//! with @a ctx, from its code arena if it has one.
+static void* mpAllocCode(WorkContext& ctx, size_t size)
+{
+  CodeArenaPrivate* arena = ctx._ctx->arena;
+  if (arena != NULL) return arena->alloc(size);
+
+  return mpGetJitMemory(ctx._memory)->alloc(size, AsmJit::MEMORY_ALLOC_FREEABLE);
+}
+
+// ============================================================================
+// [MathPresso::JitFeatures]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Get features of the host CPU, detected once per process.
+uint32_t mpGetJitFeatures()
+{
+  static const uint32_t features = AsmJit::getCpuInfo()->features;
+  return features;
+}
+
+//! @internal
+//!
+//! @brief Get time when the code generator (this file) was compiled.
+const char* mpGetJitBuildId()
+{
+  return __DATE__ " " __TIME__;
+}
+
+//! @internal
+//!
+//! @brief Rounding control immediates of ROUNDSD/ROUNDPD (SSE4.1), all of
+//! them suppress the precision exception.
+enum JIT_ROUND
+{
+  JIT_ROUND_NEAREST = 0x08,
+  JIT_ROUND_FLOOR = 0x09,
+  JIT_ROUND_CEIL = 0x0A,
+  JIT_ROUND_TRUNC = 0x0B
+};
+
+//! @internal
+//!
+//! @brief Predicate immediates of CMPSD/CMPPD, the result is all ones where
+//! the predicate is true. NaN compares false except by JIT_CMP_NLE.
+enum JIT_CMP
+{
+  JIT_CMP_EQ = 0,
+  JIT_CMP_LT = 1,
+  JIT_CMP_LE = 2,
+  JIT_CMP_NEQ = 4,
+  JIT_CMP_NLE = 6
+};
+
+// ============================================================================
+// [MathPresso::JitKernels]
+// ============================================================================
+
+// Coefficients of the inlined exp(), log(), sin() and cos(), the same
+// approximations as FDLIBM uses after the argument reduction. Constant term
+// first.
+
+//! @internal
+//!
+//! @brief exp(): R(r*r) in exp(r) = 1 + 2r / (2 - (r - r*r*R(r*r))).
+static const double jitExpP[] =
+{
+   1.66666666666666019037e-01,
+  -2.77777777770155933842e-03,
+   6.61375632143793436117e-05,
+  -1.65339022054652515390e-06,
+   4.13813679705723846039e-08
+};
+
+//! @internal
+//!
+//! @brief log(): odd (Lg1, Lg3, ...) and even (Lg2, Lg4, ...) terms of the
+//! series of log((1+s)/(1-s)), both in powers of s^4.
+static const double jitLogOdd[] =
+{
+  6.666666666666735130e-01,
+  2.857142874366239149e-01,
+  1.818357216161805012e-01,
+  1.479819860511658591e-01
+};
+
+static const double jitLogEven[] =
+{
+  3.999999999940941908e-01,
+  2.222219843214978396e-01,
+  1.531383769920937332e-01
+};
+
+//! @internal
+//!
+//! @brief sin(): S(r*r) in sin(r) = r + r^3 * S(r*r).
+static const double jitSinS[] =
+{
+  -1.66666666666666324348e-01,
+   8.33333333332248946124e-03,
+  -1.98412698298579493134e-04,
+   2.75573137070700676789e-06,
+  -2.50507602534068634195e-08,
+   1.58969099521155010221e-10
+};
+
+//! @internal
+//!
+//! @brief cos(): C(r*r) in cos(r) = 1 - r*r/2 + r^4 * C(r*r).
+static const double jitCosC[] =
+{
+   4.16666666666666019037e-02,
+  -1.38888888888741095749e-03,
+   2.48015872894767294178e-05,
+  -2.75573143513906633035e-07,
+   2.08757232129817482790e-09,
+  -1.13596475577881948265e-11
+};
+
+//! @internal
+//!
+//! @brief ln(2) split so that n * JIT_LN2_HI is exact for any exponent n.
+#define JIT_LN2_HI 6.93147180369123816490e-01
+#define JIT_LN2_LO 1.90821492927058770002e-10
+
+//! @internal
+//!
+//! @brief pi/2 split into three parts of 33 bits and the rest, n * JIT_PIO2_1
+//! is exact for |n| < 2^20. All four are needed when x is close to a multiple
+//! of pi/2 and most bits of the reduced argument cancel.
+#define JIT_PIO2_1 1.57079632673412561417e+00
+#define JIT_PIO2_2 6.07710050630396597660e-11
+#define JIT_PIO2_3 2.02226624871116645580e-21
+#define JIT_PIO2_3T 8.47842766036889956997e-32
+
+//! @internal
+//!
+//! @brief Largest |x| reduced by sin() and cos() kernels (about 2^20 * pi/2),
+//! the C library is called for larger arguments.
+#define JIT_SINCOS_LIMIT 1647099.0
+
 // ============================================================================
 // [MathPresso::JitCompiler]
 // ============================================================================
 
+//! @internal
+//!
+//! @brief Kind of function generated by @ref JitCompiler.
+enum JIT_MODE
+{
+  //! @brief Loop over rows of variables (see @ref MEvalFunc).
+  JIT_MODE_ROWS = 0,
+  //! @brief Loop over columns of variables (see @ref MEvalColumnsFunc).
+  JIT_MODE_COLUMNS = 1,
+  //! @brief Loop over rows of variables that accumulates the results (see
+  //! @ref MEvalReduceFunc).
+  JIT_MODE_REDUCE = 2
+};
+
 struct MATHPRESSO_HIDDEN JitCompiler
 {
-  JitCompiler(WorkContext& ctx, AsmJit::Compiler* c);
+  JitCompiler(WorkContext& ctx, AsmJit::Compiler* c, uint mode, int reduceOp = MREDUCE_SUM);
   ~JitCompiler();
 
   // Function Generator.
 
   void beginFunction();
+  void beginTail();
   void endFunction();
-  MEvalFunc make();
+  void* make(std::string* image = NULL);
 
   // Variable Management.
 
+  AsmJit::XMMVar newXmm();
+  AsmJit::XMMVar getLane(const AsmJit::XMMVar& src, uint lane);
+  AsmJit::XMMVar packLanes(const AsmJit::XMMVar* values);
   JitVar copyVar(const JitVar& other);
   JitVar writableVar(const JitVar& other);
   JitVar registerVar(const JitVar& other);
@@ -175,6 +525,10 @@ struct MATHPRESSO_HIDDEN JitCompiler
   // Compiler.
 
   void doTree(ASTElement* tree);
+  void doOutputs(ASTBlock* outputs);
+  void storeResult(const JitVar& result, uint index);
+  void storeAssigned();
+  void accumulate(const AsmJit::XMMVar& value);
   JitVar doElement(ASTElement* element);
   JitVar doBlock(ASTBlock* element);
   JitVar doConstant(ASTConstant* element);
@@ -182,25 +536,94 @@ struct MATHPRESSO_HIDDEN JitCompiler
   JitVar doOperator(ASTOperator* element);
   JitVar doCall(ASTCall* element);
   JitVar doTransform(ASTTransform* element);
+  JitVar doCondition(ASTCondition* element);
+  JitVar doCompare(ASTOperator* element);
+  JitVar doMask(ASTElement* element);
   JitVar callCustom(void *ptr, ASTElement* const *arguments, uint len);
+  JitVar callFunction(void *ptr, const AsmJit::XMMVar* vars, uint len);
+
+  // Kernels.
+
+  JitVar doExp(const JitVar& arg);
+  JitVar doLog(const JitVar& arg);
+  JitVar doSinCos(const JitVar& arg, bool isCos, void* fallback);
+  JitVar doRound(const JitVar& arg, uint mode);
+  void emitPolynomial(const AsmJit::XMMVar& dst, const AsmJit::XMMVar& x, const double* coeff, uint count);
 
   // Constants.
 
-  JitVar getConstantI64(int64_t value);
-  JitVar getConstantF64(double value);
+  JitVar getConstantBits(int64_t value);
+  JitVar getConstantReal(double value);
+  JitVar getSignMask(bool inverted);
+
+  // Columns.
+
+  AsmJit::GPVar getColumn(uint index);
+
+  // Prolog.
+
+  AsmJit::Emittable* beginProlog();
+  void endProlog(AsmJit::Emittable* old);
 
   // Members.
 
   WorkContext& ctx;
   AsmJit::Compiler* c;
 
+  //! @brief Function mode, see @ref JIT_MODE.
+  uint mode;
+  //! @brief Whether values are single precision (see @ref MOPTION_FLOAT32).
+  bool isFloat32;
+  //! @brief Size of one value in bytes (4 or 8).
+  uint valueSize;
+  //! @brief Index scale of one value (2 or 3).
+  uint valueShift;
+  //! @brief Count of values processed by one instruction (1, 2 or 4).
+  uint width;
+  //! @brief Instructions that match the current @ref width.
+  const JitInstructions* inst;
+  //! @brief Host CPU features (AsmJit::CPU_FEATURE_...).
+  uint32_t features;
+
   AsmJit::GPVar resultAddress;
   AsmJit::GPVar variablesAddress;
+  AsmJit::GPVar variablesStride;
+  AsmJit::GPVar columnsAddress;
+  AsmJit::GPVar rowIndex;
+  AsmJit::GPVar rowsRemaining;
   AsmJit::GPVar dataAddress;
 
+  //! @brief Last emittable of the function prolog (code that runs once,
+  //! before the loop over rows).
   AsmJit::Emittable* bodyEmittable;
   AsmJit::PodVector<JitConst> constVariables;
 
+  //! @brief Results of common subexpressions computed so far.
+  AsmJit::PodVector<JitShared> sharedVariables;
+  //! @brief Variables assigned so far, in the order of the first assignment.
+  AsmJit::PodVector<JitAssigned> assignedVariables;
+  //! @brief Variables loaded to registers (only if there is more results).
+  AsmJit::PodVector<JitAssigned> loadedVariables;
+  //! @brief Count of results of each row (see @ref doOutputs()).
+  uint resultCount;
+  //! @brief Whether the code calls a function by its absolute address.
+  bool hasCalls;
+
+  //! @brief Column pointers loaded in the prolog, indexed by column.
+  AsmJit::PodVector<AsmJit::GPVar> columnVariables;
+  AsmJit::PodVector<uint> columnIndexes;
+
+  //! @brief Reduction of the reduce function, see @ref MREDUCE.
+  int reduceOp;
+  //! @brief Accumulator of the next row.
+  uint accumulator;
+  //! @brief Accumulators of the reduce function (always double precision).
+  AsmJit::XMMVar accValues[REDUCE_ACCUMULATORS];
+  AsmJit::XMMVar accIndexes[REDUCE_ACCUMULATORS];
+
+  AsmJit::Label loopLabel;
+  AsmJit::Label exitLabel;
+
   AsmJit::Label dataLabel;
   AsmJit::Buffer dataBuffer;
 };
@@ -223,9 +646,26 @@ union I64FPUnion
   double f64;
 };
 
-JitCompiler::JitCompiler(WorkContext& ctx, AsmJit::Compiler* c) :
+//! @internal
+//!
+//! @brief Count of constants that are kept in registers for the whole loop
+//! over rows, the others are used directly from memory.
+enum { JIT_MAX_HOISTED_CONSTANTS = 6 };
+
+JitCompiler::JitCompiler(WorkContext& ctx, AsmJit::Compiler* c, uint mode, int reduceOp) :
   ctx(ctx),
-  c(c)
+  c(c),
+  mode(mode),
+  isFloat32(ctx.isFloat32()),
+  valueSize(isFloat32 ? 4 : 8),
+  valueShift(isFloat32 ? 2 : 3),
+  width(mode == JIT_MODE_COLUMNS ? 16 / valueSize : 1),
+  inst(mpGetJitInstructions(isFloat32, mode == JIT_MODE_COLUMNS)),
+  features(mpGetJitFeatures()),
+  resultCount(1),
+  hasCalls(false),
+  reduceOp(reduceOp),
+  accumulator(0)
 {
 }
 
@@ -235,41 +675,280 @@ JitCompiler::~JitCompiler()
 
 void JitCompiler::beginFunction()
 {
-  // Declare function.
-  c->newFunction(
-    AsmJit::CALL_CONV_DEFAULT,
-    AsmJit::FunctionBuilder3<AsmJit::Void, const void*, mreal_t*, mreal_t*>());
-  c->getFunction()->setHint(AsmJit::FUNCTION_HINT_NAKED, true);
+  if (mode != JIT_MODE_COLUMNS)
+  {
+    // Declare function (see MEvalFunc and MEvalReduceFunc).
+    c->newFunction(
+      AsmJit::CALL_CONV_DEFAULT,
+      AsmJit::FunctionBuilder5<AsmJit::Void, const void*, void*, void*, sysuint_t, sysuint_t>());
+    c->getFunction()->setHint(AsmJit::FUNCTION_HINT_NAKED, true);
+
+    resultAddress = c->argGP(1);
+    variablesAddress = c->argGP(2);
+    variablesStride = c->argGP(3);
+    rowsRemaining = c->argGP(4);
+
+    c->setPriority(variablesAddress, 1);
+  }
+  else
+  {
+    // Declare function (see MEvalColumnsFunc).
+    c->newFunction(
+      AsmJit::CALL_CONV_DEFAULT,
+      AsmJit::FunctionBuilder4<AsmJit::Void, const void*, void*, const void* const*, sysuint_t>());
+    c->getFunction()->setHint(AsmJit::FUNCTION_HINT_NAKED, true);
+
+    resultAddress = c->argGP(1);
+    columnsAddress = c->argGP(2);
+    rowsRemaining = c->argGP(3);
+    rowIndex = c->newGP(AsmJit::VARIABLE_TYPE_GPN, "row");
+
+    c->setPriority(rowIndex, 1);
+  }
 
-  resultAddress = c->argGP(1);
-  variablesAddress = c->argGP(2);
   dataAddress = c->newGP(AsmJit::VARIABLE_TYPE_GPQ, "data");
-
-  c->setPriority(variablesAddress, 1);
   c->setPriority(dataAddress, 2);
 
+  // Everything inserted after bodyEmittable (data address, hoisted constants
+  // and column pointers) runs once per call, before the loop.
   bodyEmittable = c->getCurrentEmittable();
 
   // Data and constants.
   dataLabel = c->newLabel();
+
+  // Loop over rows, the body is generated by doTree().
+  loopLabel = c->newLabel();
+  exitLabel = c->newLabel();
+
+  if (mode == JIT_MODE_ROWS)
+  {
+    c->test(rowsRemaining, rowsRemaining);
+    c->jz(exitLabel);
+    c->bind(loopLabel);
+  }
+  else if (mode == JIT_MODE_COLUMNS)
+  {
+    // Rows are processed by 'width' at a time, the remaining rows are
+    // processed by the tail generated after beginTail().
+    c->xor_(rowIndex, rowIndex);
+    c->sub(rowsRemaining, AsmJit::imm(width - 1));
+    c->jbe(exitLabel);
+
+    c->bind(loopLabel);
+    c->cmp(rowIndex, rowsRemaining);
+    c->jae(exitLabel);
+  }
+  else
+  {
+    // Accumulators are loaded from ReduceState once and stay in registers.
+    rowIndex = c->newGP(AsmJit::VARIABLE_TYPE_GPN, "row");
+    c->xor_(rowIndex, rowIndex);
+
+    bool hasIndexes = (reduceOp == MREDUCE_ARGMIN || reduceOp == MREDUCE_ARGMAX);
+    for (uint k = 0; k < REDUCE_ACCUMULATORS; k++)
+    {
+      accValues[k] = c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D);
+      c->movsd(accValues[k], ptr(resultAddress, (sysint_t)MATHPRESSO_OFFSET(ReduceState, values[k])));
+
+      if (hasIndexes)
+      {
+        accIndexes[k] = c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D);
+        c->movsd(accIndexes[k], ptr(resultAddress, (sysint_t)MATHPRESSO_OFFSET(ReduceState, indexes[k])));
+      }
+    }
+
+    // Rows are processed by REDUCE_ACCUMULATORS at a time, one row per
+    // accumulator, so the accumulators don't wait for each other. The
+    // remaining rows are processed by the tail generated after beginTail().
+    c->sub(rowsRemaining, AsmJit::imm(REDUCE_ACCUMULATORS - 1));
+    c->jbe(exitLabel);
+
+    c->bind(loopLabel);
+    c->cmp(rowIndex, rowsRemaining);
+    c->jae(exitLabel);
+  }
+}
+
+void JitCompiler::beginTail()
+{
+  MP_ASSERT(mode != JIT_MODE_ROWS);
+
+  if (mode == JIT_MODE_COLUMNS)
+  {
+    // Close the packed loop.
+    c->add(rowIndex, AsmJit::imm(width));
+    c->jmp(loopLabel);
+    c->bind(exitLabel);
+
+    // There is at most 'width - 1' rows left, process one of them at a time.
+    c->add(rowsRemaining, AsmJit::imm(width - 1));
+
+    width = 1;
+    inst = mpGetJitInstructions(isFloat32, false);
+  }
+  else
+  {
+    // Close the unrolled loop, doTree() advanced to the next row already.
+    c->jmp(loopLabel);
+    c->bind(exitLabel);
+
+    // The remaining rows are added to the first accumulator.
+    c->add(rowsRemaining, AsmJit::imm(REDUCE_ACCUMULATORS - 1));
+    accumulator = 0;
+  }
+
+  // Common subexpressions computed by the packed loop are not valid here.
+  sharedVariables.clear();
+
+  loopLabel = c->newLabel();
+  exitLabel = c->newLabel();
+
+  c->bind(loopLabel);
+  c->cmp(rowIndex, rowsRemaining);
+  c->jae(exitLabel);
 }
 
 void JitCompiler::endFunction()
 {
+  // Advance to the next row.
+  if (mode == JIT_MODE_ROWS)
+  {
+    c->add(variablesAddress, variablesStride);
+    c->add(resultAddress, AsmJit::imm(resultCount * sizeof(mreal_t)));
+    c->dec(rowsRemaining);
+    c->jnz(loopLabel);
+  }
+  else if (mode == JIT_MODE_COLUMNS)
+  {
+    c->inc(rowIndex);
+    c->jmp(loopLabel);
+  }
+  else
+  {
+    c->jmp(loopLabel);
+  }
+  c->bind(exitLabel);
+
+  if (mode == JIT_MODE_REDUCE)
+  {
+    bool hasIndexes = (reduceOp == MREDUCE_ARGMIN || reduceOp == MREDUCE_ARGMAX);
+    for (uint k = 0; k < REDUCE_ACCUMULATORS; k++)
+    {
+      c->movsd(ptr(resultAddress, (sysint_t)MATHPRESSO_OFFSET(ReduceState, values[k])), accValues[k]);
+      if (hasIndexes)
+        c->movsd(ptr(resultAddress, (sysint_t)MATHPRESSO_OFFSET(ReduceState, indexes[k])), accIndexes[k]);
+    }
+  }
+
   c->endFunction();
+
+  // Packed instructions need constants aligned to 16 bytes.
+  if (mode == JIT_MODE_COLUMNS) c->align(16);
+
   c->bind(dataLabel);
   c->embed(dataBuffer.getData(), dataBuffer.getOffset());
 }
 
-MEvalFunc JitCompiler::make()
+void* JitCompiler::make(std::string* image)
+{
+  // The same as AsmJit::Compiler::make(), but with our executable memory.
+  AsmJit::Assembler a;
+  a.setLogger(c->getLogger());
+  c->serialize(a);
+
+  size_t size = a.getCodeSize();
+  if (c->getError() != 0 || a.getError() != 0 || size == 0) return NULL;
+
+  void* p = mpAllocCode(ctx, size);
+  if (p == NULL) return NULL;
+
+  a.relocCode(p);
+
+  // Constants are addressed relative to RIP in 64-bit mode, the only other
+  // absolute addresses are functions called by the code. Code without them
+  // can be copied anywhere, it's stored to the image.
+#if defined(ASMJIT_X64)
+  if (image != NULL && !hasCalls)
+    image->assign(reinterpret_cast<const char*>(p), size);
+#endif // ASMJIT_X64
+
+  return p;
+}
+
+AsmJit::XMMVar JitCompiler::newXmm()
 {
-  return AsmJit::function_cast<MEvalFunc>(c->make());
+  // Variables of the column function are shared by the packed loop and the
+  // tail, they must always be spilled as a whole register.
+  if (mode == JIT_MODE_COLUMNS)
+    return c->newXMM(isFloat32 ? AsmJit::VARIABLE_TYPE_XMM_4F : AsmJit::VARIABLE_TYPE_XMM_2D);
+  else
+    return c->newXMM(isFloat32 ? AsmJit::VARIABLE_TYPE_XMM_1F : AsmJit::VARIABLE_TYPE_XMM_1D);
+}
+
+AsmJit::XMMVar JitCompiler::getLane(const AsmJit::XMMVar& src, uint lane)
+{
+  // Double in a scalar variable is already a function argument.
+  if (!isFloat32 && width == 1) return src;
+
+  AsmJit::XMMVar dst(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+
+  if (isFloat32)
+  {
+    if (lane == 0)
+    {
+      c->emit(AsmJit::INST_CVTSS2SD, dst, src);
+    }
+    else
+    {
+      AsmJit::XMMVar t(newXmm());
+      c->emit(AsmJit::INST_MOVAPS, t, src);
+      c->emit(AsmJit::INST_SHUFPS, t, t, AsmJit::imm(lane * 0x55));
+      c->emit(AsmJit::INST_CVTSS2SD, dst, t);
+    }
+  }
+  else
+  {
+    c->emit(AsmJit::INST_MOVAPD, dst, src);
+    if (lane == 1) c->emit(AsmJit::INST_UNPCKHPD, dst, dst);
+  }
+
+  return dst;
+}
+
+AsmJit::XMMVar JitCompiler::packLanes(const AsmJit::XMMVar* values)
+{
+  if (!isFloat32)
+  {
+    if (width == 1) return values[0];
+
+    AsmJit::XMMVar dst(newXmm());
+    c->emit(AsmJit::INST_MOVAPD, dst, values[0]);
+    c->emit(AsmJit::INST_UNPCKLPD, dst, values[1]);
+    return dst;
+  }
+
+  AsmJit::XMMVar dst(newXmm());
+  c->emit(AsmJit::INST_CVTSD2SS, dst, values[0]);
+  if (width == 1) return dst;
+
+  AsmJit::XMMVar t[4];
+  for (uint lane = 1; lane < 4; lane++)
+  {
+    t[lane] = newXmm();
+    c->emit(AsmJit::INST_CVTSD2SS, t[lane], values[lane]);
+  }
+
+  // [v0 v1 v2 v3] from the low lanes.
+  c->emit(AsmJit::INST_UNPCKLPS, dst, t[1]);
+  c->emit(AsmJit::INST_UNPCKLPS, t[2], t[3]);
+  c->emit(AsmJit::INST_MOVLHPS, dst, t[2]);
+  return dst;
 }
 
 JitVar JitCompiler::copyVar(const JitVar& other)
 {
-  JitVar v(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D), JitVar::FLAG_NONE);
-  c->emit(AsmJit::INST_MOVSD, v.getXmm(), other.getOperand());
+  JitVar v(newXmm(), JitVar::FLAG_NONE);
+  c->emit(inst->mov, v.getXmm(), other.getOperand());
   return v;
 }
 
@@ -292,36 +971,220 @@ JitVar JitCompiler::registerVar(const JitVar& other)
 void JitCompiler::doTree(ASTElement* tree)
 {
   JitVar result = registerVar(doElement(tree));
-  c->movsd(ptr(resultAddress), result.getXmm());
+
+  if (mode == JIT_MODE_ROWS)
+  {
+    storeAssigned();
+    storeResult(result, 0);
+  }
+  else if (mode == JIT_MODE_COLUMNS)
+  {
+    c->emit(inst->movu, ptr(resultAddress, rowIndex, valueShift), result.getXmm());
+  }
+  else
+  {
+    storeAssigned();
+
+    // Accumulators are double precision.
+    if (isFloat32)
+    {
+      AsmJit::XMMVar t(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+      c->emit(AsmJit::INST_CVTSS2SD, t, result.getXmm());
+      accumulate(t);
+    }
+    else
+    {
+      accumulate(result.getXmm());
+    }
+
+    // Advance to the next row, common subexpressions of this one are not
+    // valid there.
+    c->add(variablesAddress, variablesStride);
+    c->inc(rowIndex);
+    sharedVariables.clear();
+
+    accumulator = (accumulator + 1) % REDUCE_ACCUMULATORS;
+  }
+}
+
+void JitCompiler::doOutputs(ASTBlock* outputs)
+{
+  MP_ASSERT(mode == JIT_MODE_ROWS);
+
+  // Outputs are evaluated in order, each of them sees variables assigned by
+  // the previous ones and common subexpressions are computed only once.
+  ASTElement** elements = outputs->getChildrenElements();
+  size_t i, len = outputs->getChildrenCount();
+
+  resultCount = (uint)len;
+  for (i = 0; i < len; i++)
+  {
+    storeResult(registerVar(doElement(elements[i])), (uint)i);
+  }
+  storeAssigned();
+}
+
+void JitCompiler::storeResult(const JitVar& result, uint index)
+{
+  AsmJit::Mem dst(ptr(resultAddress, (sysint_t)(index * sizeof(mreal_t))));
+
+  // The row function always returns mreal_t.
+  if (isFloat32)
+  {
+    AsmJit::XMMVar t(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+    c->emit(AsmJit::INST_CVTSS2SD, t, result.getXmm());
+    c->movsd(dst, t);
+  }
+  else
+  {
+    c->movsd(dst, result.getXmm());
+  }
+}
+
+void JitCompiler::accumulate(const AsmJit::XMMVar& value)
+{
+  // The value can be read-only, it's never modified.
+  const JitInstructions* f64 = &jitScalarF64;
+  AsmJit::XMMVar& acc = accValues[accumulator];
+
+  switch (reduceOp)
+  {
+    case MREDUCE_SUM:
+      c->emit(f64->add, acc, value);
+      break;
+
+    // MINSD/MAXSD return the second operand if the first one isn't smaller
+    // (larger) or any of them is NaN, so NaN values are ignored.
+    case MREDUCE_MIN:
+    case MREDUCE_MAX:
+    {
+      AsmJit::XMMVar t(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+      c->emit(f64->mov, t, value);
+      c->emit(reduceOp == MREDUCE_MIN ? f64->min : f64->max, t, acc);
+      c->emit(f64->mov, acc, t);
+      break;
+    }
+
+    // The mask selects value and row index where !(acc <= value) for
+    // ARGMIN (!(value <= acc) for ARGMAX) and value isn't NaN, NaN in
+    // acc means there is no row yet.
+    case MREDUCE_ARGMIN:
+    case MREDUCE_ARGMAX:
+    {
+      AsmJit::XMMVar& accIndex = accIndexes[accumulator];
+      AsmJit::XMMVar mask(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+      AsmJit::XMMVar ordered(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+      AsmJit::XMMVar t(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+      AsmJit::XMMVar index(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D));
+
+      if (reduceOp == MREDUCE_ARGMIN)
+      {
+        c->emit(f64->mov, mask, acc);
+        c->emit(f64->cmp, mask, value, AsmJit::imm(JIT_CMP_NLE));
+      }
+      else
+      {
+        c->emit(f64->mov, mask, value);
+        c->emit(f64->cmp, mask, acc, AsmJit::imm(JIT_CMP_NLE));
+      }
+      c->emit(f64->mov, ordered, value);
+      c->emit(f64->cmp, ordered, value, AsmJit::imm(JIT_CMP_EQ));
+      c->emit(f64->and_, mask, ordered);
+
+      // acc = (value & mask) | (acc & ~mask).
+      c->emit(f64->mov, t, mask);
+      c->emit(f64->andn, t, acc);
+      c->emit(f64->mov, acc, value);
+      c->emit(f64->and_, acc, mask);
+      c->emit(f64->or_, acc, t);
+
+      // accIndex = (row & mask) | (accIndex & ~mask).
+      c->emit(AsmJit::INST_CVTSI2SD, index, rowIndex);
+      c->emit(f64->and_, index, mask);
+      c->emit(f64->andn, mask, accIndex);
+      c->emit(f64->or_, mask, index);
+      c->emit(f64->mov, accIndex, mask);
+      break;
+    }
+
+    default:
+      MP_ASSERT_NOT_REACHED();
+      break;
+  }
+}
+
+void JitCompiler::storeAssigned()
+{
+  // Only the last value of each variable is stored, there is no other way
+  // to read variables while the row is evaluated.
+  size_t i, length = assignedVariables.getLength();
+  for (i = 0; i < length; i++)
+  {
+    const JitAssigned& assigned = assignedVariables[i];
+    c->emit(inst->mov, ptr(variablesAddress, (sysint_t)assigned.offset), assigned.var.getOperand());
+  }
+  assignedVariables.clear();
 }
 
 JitVar JitCompiler::doElement(ASTElement* element)
 {
+  bool isShared = element->getUseCount() > 1;
+
+  // Common subexpression is computed only by its first use.
+  if (isShared)
+  {
+    size_t i, length = sharedVariables.getLength();
+    for (i = 0; i < length; i++)
+    {
+      if (sharedVariables[i].element == element) return sharedVariables[i].var;
+    }
+  }
+
+  JitVar result;
   switch (element->getElementType())
   {
     case MELEMENT_BLOCK:
-      return doBlock(reinterpret_cast<ASTBlock*>(element));
+      result = doBlock(reinterpret_cast<ASTBlock*>(element));
+      break;
     case MELEMENT_CONSTANT:
-      return doConstant(reinterpret_cast<ASTConstant*>(element));
+      result = doConstant(reinterpret_cast<ASTConstant*>(element));
+      break;
     case MELEMENT_VARIABLE:
-      return doVariable(reinterpret_cast<ASTVariable*>(element));
+      result = doVariable(reinterpret_cast<ASTVariable*>(element));
+      break;
     case MELEMENT_OPERATOR:
-      return doOperator(reinterpret_cast<ASTOperator*>(element));
+      result = doOperator(reinterpret_cast<ASTOperator*>(element));
+      break;
     case MELEMENT_CALL:
-      return doCall(reinterpret_cast<ASTCall*>(element));
+      result = doCall(reinterpret_cast<ASTCall*>(element));
+      break;
     case MELEMENT_TRANSFORM:
-      return doTransform(reinterpret_cast<ASTTransform*>(element));
+      result = doTransform(reinterpret_cast<ASTTransform*>(element));
+      break;
+    case MELEMENT_CONDITION:
+      result = doCondition(reinterpret_cast<ASTCondition*>(element));
+      break;
     default:
       MP_ASSERT_NOT_REACHED();
-      return JitVar();
+      break;
+  }
+
+  // Keep the value in a register, it's read-only so the other uses copy it
+  // before it's modified.
+  if (isShared)
+  {
+    result = JitVar(registerVar(result).getOperand(), JitVar::FLAG_RO);
+    sharedVariables.append(JitShared(element, result));
   }
+
+  return result;
 }
 
 JitVar JitCompiler::doBlock(ASTBlock* element)
 {
   JitVar result;
-  Vector<ASTElement *> & elements = element->getChildrenVector();
-  size_t i, len = elements.getLength();
+  ASTElement** elements = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
   for (i = 0; i < len; i++)
   {
     result = doElement(elements[i]);
@@ -332,12 +1195,44 @@ JitVar JitCompiler::doBlock(ASTBlock* element)
 
 JitVar JitCompiler::doConstant(ASTConstant* element)
 {
-  return getConstantF64(element->getValue());
+  return getConstantReal(element->getValue());
 }
 
 JitVar JitCompiler::doVariable(ASTVariable* element)
 {
-  return JitVar(ptr(variablesAddress, (sysint_t)element->getOffset()), JitVar::FLAG_RO);
+  if (mode != JIT_MODE_COLUMNS)
+  {
+    // Value assigned before is still in a register.
+    size_t i, length = assignedVariables.getLength();
+    for (i = 0; i < length; i++)
+    {
+      if (assignedVariables[i].offset == element->getOffset()) return assignedVariables[i].var;
+    }
+
+    JitVar var(ptr(variablesAddress, (sysint_t)element->getOffset()), JitVar::FLAG_RO);
+    if (resultCount == 1)
+      return var;
+
+    // Variable read by more outputs is loaded only once.
+    length = loadedVariables.getLength();
+    for (i = 0; i < length; i++)
+    {
+      if (loadedVariables[i].offset == element->getOffset()) return loadedVariables[i].var;
+    }
+
+    var = JitVar(copyVar(var).getOperand(), JitVar::FLAG_RO);
+    loadedVariables.append(JitAssigned(element->getOffset(), var));
+    return var;
+  }
+
+  AsmJit::Mem src(ptr(getColumn((uint)element->getOffset() / valueSize), rowIndex, valueShift));
+  if (width == 1)
+    return JitVar(src, JitVar::FLAG_RO);
+
+  // Columns aren't aligned, packed instructions can't use them directly.
+  JitVar var(newXmm(), JitVar::FLAG_NONE);
+  c->emit(inst->movu, var.getXmm(), src);
+  return var;
 }
 
 JitVar JitCompiler::callCustom(void *ptr, ASTElement* const *arguments, uint len)
@@ -356,11 +1251,20 @@ JitVar JitCompiler::callCustom(void *ptr, ASTElement* const *arguments, uint len
     }
     else
     {
-      vars[i] = c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D);
-      c->emit(AsmJit::INST_MOVSD, vars[i], tmp.getOperand());
+      vars[i] = newXmm();
+      c->emit(inst->mov, vars[i], tmp.getOperand());
     }
   }
 
+  return callFunction(ptr, vars, len);
+}
+
+JitVar JitCompiler::callFunction(void *ptr, const AsmJit::XMMVar* vars, uint len)
+{
+  MP_ASSERT(len <= 8);
+
+  hasCalls = true;
+
   // Use function builder to build a function prototype.
   AsmJit::FunctionBuilderX builder;
   for (uint i = 0; i < len; i++)
@@ -369,17 +1273,28 @@ JitVar JitCompiler::callCustom(void *ptr, ASTElement* const *arguments, uint len
   }
   builder.setReturnValue<mreal_t>();
 
-  // Create ECall emittable (function call context).
-  AsmJit::ECall* ctx = c->call(ptr);
-  ctx->setPrototype(AsmJit::CALL_CONV_DEFAULT, builder);
+  // The function is scalar and takes doubles, call it once per value and
+  // pack the results.
+  AsmJit::XMMVar results[4];
 
-  // Assign arguments.
-  for (uint i = 0; i < len; i++) ctx->setArgument((uint)i, vars[i]);
+  for (uint lane = 0; lane < width; lane++)
+  {
+    AsmJit::XMMVar args[8];
+    for (uint i = 0; i < len; i++) args[i] = getLane(vars[i], lane);
 
-  // Fetch return value.
-  JitVar result(c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D), JitVar::FLAG_NONE);
-  ctx->setReturn(result.getXmm());
-  return result;
+    // Create ECall emittable (function call context).
+    AsmJit::ECall* ctx = c->call(ptr);
+    ctx->setPrototype(AsmJit::CALL_CONV_DEFAULT, builder);
+
+    // Assign arguments.
+    for (uint i = 0; i < len; i++) ctx->setArgument((uint)i, args[i]);
+
+    // Fetch return value.
+    results[lane] = c->newXMM(AsmJit::VARIABLE_TYPE_XMM_1D);
+    ctx->setReturn(results[lane]);
+  }
+
+  return JitVar(packLanes(results), JitVar::FLAG_NONE);
 }
 
 JitVar JitCompiler::doOperator(ASTOperator* element)
@@ -396,10 +1311,33 @@ JitVar JitCompiler::doOperator(ASTOperator* element)
     ASTVariable* varNode = reinterpret_cast<ASTVariable*>(left);
     MP_ASSERT(varNode->getElementType() == MELEMENT_VARIABLE);
 
-    vr = registerVar(doElement(right));
-    c->emit(AsmJit::INST_MOVSD, ptr(variablesAddress, (sysint_t)varNode->getOffset()), vr.getOperand());
+    // Columns are read-only, expressions with assignment are never compiled
+    // into the column function.
+    MP_ASSERT(mode != JIT_MODE_COLUMNS);
+
+    // The value is stored by storeAssigned(), until then the variable is
+    // read from the register, which must not be modified.
+    vr = JitVar(registerVar(doElement(right)).getOperand(), JitVar::FLAG_RO);
+
+    size_t i, length = assignedVariables.getLength();
+    for (i = 0; i < length; i++)
+    {
+      if (assignedVariables[i].offset == varNode->getOffset()) break;
+    }
+
+    if (i < length)
+      assignedVariables[i].var = vr;
+    else
+      assignedVariables.append(JitAssigned(varNode->getOffset(), vr));
     return vr;
   }
+  if (mpIsComparison(operatorType))
+  {
+    // Mask of all ones is 1.0 after AND, all zeros is 0.0.
+    JitVar mask(doCompare(element));
+    c->emit(inst->and_, mask.getXmm(), registerVar(getConstantReal(1.0)).getOperand());
+    return mask;
+  }
   if (operatorType == MOPERATOR_POW)
   {
     ASTElement *arguments[2] = { left, right };
@@ -407,8 +1345,25 @@ JitVar JitCompiler::doOperator(ASTOperator* element)
   }
   if (operatorType == MOPERATOR_MOD)
   {
-    ASTElement *arguments[2] = { left, right };
-    return callCustom((void *)(DoubleFuncPtr2)fmod, arguments, 2);
+    // fmod() is exact, x - trunc(x/y)*y only if x/y is small.
+    if (!ctx.isFastMath())
+    {
+      ASTElement *arguments[2] = { left, right };
+      return callCustom((void *)(DoubleFuncPtr2)fmod, arguments, 2);
+    }
+
+    vl = doElement(left);
+    vr = doElement(right);
+
+    JitVar q(copyVar(vl));
+    c->emit(inst->div, q.getXmm(), vr.getOperand());
+
+    JitVar n(doRound(q, JIT_ROUND_TRUNC));
+    c->emit(inst->mul, n.getXmm(), vr.getOperand());
+
+    JitVar r(copyVar(vl));
+    c->emit(inst->sub, r.getXmm(), n.getXmm());
+    return r;
   }
 
   if (left->getElementType() == MELEMENT_VARIABLE && right->getElementType() == MELEMENT_VARIABLE &&
@@ -444,16 +1399,16 @@ JitVar JitCompiler::doOperator(ASTOperator* element)
   switch (operatorType)
   {
     case MOPERATOR_PLUS:
-      c->emit(AsmJit::INST_ADDSD, vl.getOperand(), vr.getOperand());
+      c->emit(inst->add, vl.getOperand(), vr.getOperand());
       return vl;
     case MOPERATOR_MINUS:
-      c->emit(AsmJit::INST_SUBSD, vl.getOperand(), vr.getOperand());
+      c->emit(inst->sub, vl.getOperand(), vr.getOperand());
       return vl;
     case MOPERATOR_MUL:
-      c->emit(AsmJit::INST_MULSD, vl.getOperand(), vr.getOperand());
+      c->emit(inst->mul, vl.getOperand(), vr.getOperand());
       return vl;
     case MOPERATOR_DIV:
-      c->emit(AsmJit::INST_DIVSD, vl.getOperand(), vr.getOperand());
+      c->emit(inst->div, vl.getOperand(), vr.getOperand());
       return vl;
     // case MOPERATOR_MOD:
     default:
@@ -464,8 +1419,8 @@ JitVar JitCompiler::doOperator(ASTOperator* element)
 
 JitVar JitCompiler::doCall(ASTCall* element)
 {
-  const Vector<ASTElement*>& arguments = element->getArguments();
-  size_t i, len = arguments.getLength();
+  ASTElement** arguments = element->getArguments();
+  size_t i, len = element->getArgumentsCount();
   
   Function* fn = element->getFunction();
   int funcId = fn->getFunctionId();
@@ -488,14 +1443,14 @@ JitVar JitCompiler::doCall(ASTCall* element)
       switch (funcId)
       {
         case MFUNCTION_MIN:
-          c->emit(AsmJit::INST_MINSD, vl.getOperand(), vr.getOperand());
+          c->emit(inst->min, vl.getOperand(), vr.getOperand());
           break;
         case MFUNCTION_MAX:
-          c->emit(AsmJit::INST_MAXSD, vl.getOperand(), vr.getOperand());
+          c->emit(inst->max, vl.getOperand(), vr.getOperand());
           break;
         case MFUNCTION_AVG:
-          c->emit(AsmJit::INST_ADDSD, vl.getOperand(), vr.getOperand());
-          c->emit(AsmJit::INST_MULSD, vl.getOperand(), getConstantF64(0.5f).getOperand());
+          c->emit(inst->add, vl.getOperand(), vr.getOperand());
+          c->emit(inst->mul, vl.getOperand(), getConstantReal(0.5).getOperand());
           break;
       }
       return vl;
@@ -512,19 +1467,98 @@ JitVar JitCompiler::doCall(ASTCall* element)
       switch (funcId)
       {
         case MFUNCTION_ABS:
-          c->emit(AsmJit::INST_ANDPD, vl.getOperand(), registerVar(getConstantI64(0x7FFFFFFFFFFFFFFF)).getOperand());
+          c->emit(inst->and_, vl.getOperand(), registerVar(getSignMask(true)).getOperand());
           break;
         case MFUNCTION_SQRT:
-          c->emit(AsmJit::INST_SQRTSD, vl.getOperand(), vl.getOperand());
+          c->emit(inst->sqrt, vl.getOperand(), vl.getOperand());
           break;
       }
 
       return vl;
     }
 
+    case MFUNCTION_FLOOR:
+    case MFUNCTION_CEIL:
+    case MFUNCTION_TRUNC:
+    {
+      MP_ASSERT(len == 1);
+      JitVar vl(doElement(arguments[0]));
+
+      switch (funcId)
+      {
+        case MFUNCTION_FLOOR:
+          return doRound(vl, JIT_ROUND_FLOOR);
+        case MFUNCTION_CEIL:
+          return doRound(vl, JIT_ROUND_CEIL);
+        default:
+          return doRound(vl, JIT_ROUND_TRUNC);
+      }
+    }
+
+    case MFUNCTION_ROUND:
+    {
+      // Halfway cases are rounded away from zero, trunc(x) + copysign(1, x)
+      // where |x - trunc(x)| >= 0.5. The difference is exact, so it's right
+      // for 0.49999999999999994 and odd integers above 2^52 (or 2^23) too,
+      // where x + 0.5 would be rounded. NaN and inf compare false.
+      MP_ASSERT(len == 1);
+      JitVar vl(registerVar(doElement(arguments[0])));
+      JitVar vr(doRound(vl, JIT_ROUND_TRUNC));
+
+      AsmJit::XMMVar d(newXmm());
+      AsmJit::XMMVar mask(newXmm());
+
+      c->emit(inst->mov, d, vl.getOperand());
+      c->emit(inst->sub, d, vr.getOperand());
+      c->emit(inst->and_, d, registerVar(getSignMask(true)).getOperand());
+
+      c->emit(inst->mov, mask, getConstantReal(0.5).getOperand());
+      c->emit(inst->cmp, mask, d, AsmJit::imm(JIT_CMP_LE));
+
+      c->emit(inst->mov, d, vl.getOperand());
+      c->emit(inst->and_, d, registerVar(getSignMask(false)).getOperand());
+      c->emit(inst->or_, d, registerVar(getConstantReal(1.0)).getOperand());
+      c->emit(inst->and_, mask, d);
+      c->emit(inst->add, vr.getXmm(), mask);
+      return vr;
+    }
+
+    case MFUNCTION_EXP:
+    case MFUNCTION_LOG:
+    case MFUNCTION_LOG10:
+    case MFUNCTION_SIN:
+    case MFUNCTION_COS:
+    {
+      // Kernels are double precision only, single precision calls the C
+      // library.
+      if (isFloat32) goto _Call;
+
+      MP_ASSERT(len == 1);
+      JitVar vl(doElement(arguments[0]));
+
+      switch (funcId)
+      {
+        case MFUNCTION_EXP:
+          return doExp(vl);
+        case MFUNCTION_LOG:
+          return doLog(vl);
+        case MFUNCTION_LOG10:
+        {
+          JitVar vr(doLog(vl));
+          c->emit(inst->mul, vr.getOperand(), getConstantReal(4.34294481903251827651e-01).getOperand());
+          return vr;
+        }
+        case MFUNCTION_SIN:
+          return doSinCos(vl, false, fn->getPtr());
+        default:
+          return doSinCos(vl, true, fn->getPtr());
+      }
+    }
+
     // Function call.
     default:
-      return callCustom(element->getFunction()->getPtr(), arguments.getData(), len);
+_Call:
+      return callCustom(element->getFunction()->getPtr(), arguments, len);
   }
 }
 
@@ -533,6 +1567,26 @@ JitVar JitCompiler::doTransform(ASTTransform* element)
   uint transformType = element->getTransformType();
   JitVar var = doElement(element->getChild());
 
+  if (transformType == MTRANSFORM_POWI)
+  {
+    // x^n by the binary method from the highest bit, x is kept.
+    int exponent = element->getExponent();
+    uint n = (uint)(exponent < 0 ? -exponent : exponent);
+    uint bit = mpGetHighestBit(n);
+
+    JitVar x(registerVar(var));
+    var = copyVar(x);
+
+    while (bit-- > 0)
+    {
+      c->emit(inst->mul, var.getOperand(), var.getOperand());
+      if (n & (1U << bit)) c->emit(inst->mul, var.getOperand(), x.getOperand());
+    }
+
+    if (exponent > 0) return var;
+    transformType = MTRANSFORM_RECIPROCAL;
+  }
+
   if (transformType != MTRANSFORM_NONE) var = writableVar(var);
 
   switch (transformType)
@@ -541,9 +1595,22 @@ JitVar JitCompiler::doTransform(ASTTransform* element)
       break;
     case MTRANSFORM_NEGATE:
     {
-      AsmJit::XMMVar t(c->newXMM());
-      c->emit(AsmJit::INST_MOVSD, t, getConstantI64(0x8000000000000000).getOperand());
-      c->emit(AsmJit::INST_XORPD, var.getOperand(), t);
+      c->emit(inst->xor_, var.getOperand(), registerVar(getSignMask(false)).getOperand());
+      break;
+    }
+    case MTRANSFORM_SQRT:
+    case MTRANSFORM_RSQRT:
+    case MTRANSFORM_RECIPROCAL:
+    {
+      if (transformType != MTRANSFORM_RECIPROCAL)
+        c->emit(inst->sqrt, var.getOperand(), var.getOperand());
+
+      if (transformType != MTRANSFORM_SQRT)
+      {
+        JitVar one(copyVar(getConstantReal(1.0)));
+        c->emit(inst->div, one.getOperand(), var.getOperand());
+        var = one;
+      }
       break;
     }
   }
@@ -551,16 +1618,473 @@ JitVar JitCompiler::doTransform(ASTTransform* element)
   return var;
 }
 
-JitVar JitCompiler::getConstantI64(int64_t value)
+JitVar JitCompiler::doCondition(ASTCondition* element)
+{
+  // Branchless, both branches are evaluated and the mask of the condition
+  // selects between them, (a & mask) | (b & ~mask).
+  JitVar mask(doMask(element->getCondition()));
+  ASTElement* elseElement = element->getElse();
+
+  JitVar result(copyVar(doElement(element->getThen())));
+  c->emit(inst->and_, result.getXmm(), mask.getXmm());
+
+  // c ? a : 0 is only a & mask (not -0, its sign bit is set).
+  if (elseElement->getElementType() == MELEMENT_CONSTANT)
+  {
+    I64FPUnion u;
+    u.f64 = reinterpret_cast<ASTConstant*>(elseElement)->getValue();
+    if (u.i64 == 0) return result;
+  }
+
+  JitVar b(registerVar(doElement(elseElement)));
+  c->emit(inst->andn, mask.getXmm(), b.getOperand());
+  c->emit(inst->or_, result.getXmm(), mask.getXmm());
+  return result;
+}
+
+JitVar JitCompiler::doCompare(ASTOperator* element)
+{
+  uint operatorType = element->getOperatorType();
+
+  JitVar vl(doElement(element->getLeft()));
+  JitVar vr(doElement(element->getRight()));
+
+  // a > b is b < a, a >= b is b <= a.
+  if (operatorType == MOPERATOR_GT || operatorType == MOPERATOR_GE) vl.swapWith(vr);
+
+  uint predicate;
+  switch (operatorType)
+  {
+    case MOPERATOR_EQ: predicate = JIT_CMP_EQ; break;
+    case MOPERATOR_NE: predicate = JIT_CMP_NEQ; break;
+    case MOPERATOR_LT:
+    case MOPERATOR_GT: predicate = JIT_CMP_LT; break;
+    default          : predicate = JIT_CMP_LE; break;
+  }
+
+  JitVar mask(copyVar(vl));
+  c->emit(inst->cmp, mask.getXmm(), vr.getOperand(), AsmJit::imm(predicate));
+  return mask;
+}
+
+JitVar JitCompiler::doMask(ASTElement* element)
+{
+  // Comparison is used as a mask directly, unless it's a common subexpression
+  // computed (as 0 or 1) for other uses too.
+  if (element->getElementType() == MELEMENT_OPERATOR && element->getUseCount() == 1 &&
+      mpIsComparison(reinterpret_cast<ASTOperator*>(element)->getOperatorType()))
+  {
+    return doCompare(reinterpret_cast<ASTOperator*>(element));
+  }
+
+  // Any other value is true if it's not zero (NaN is true as well).
+  JitVar mask(copyVar(doElement(element)));
+  c->emit(inst->cmp, mask.getXmm(), getConstantReal(0.0).getOperand(), AsmJit::imm(JIT_CMP_NEQ));
+  return mask;
+}
+
+// Kernels evaluate a function in all lanes without calling the C library.
+// They use only SSE2: scalar variables are processed by packed integer and
+// bitwise instructions as well, their second lane is ignored. The error of
+// each kernel was measured against the C library over the whole range of
+// double.
+
+//! @brief Inline exp(), error at most 1 ulp.
+//!
+//! x = n * ln(2) + r, |r| <= ln(2)/2, exp(x) = 2^n * exp(r).
+JitVar JitCompiler::doExp(const JitVar& arg)
+{
+  AsmJit::XMMVar x(newXmm());
+  AsmJit::XMMVar n(newXmm());
+  AsmJit::XMMVar k(newXmm());
+  AsmJit::XMMVar hi(newXmm());
+  AsmJit::XMMVar r(newXmm());
+  AsmJit::XMMVar z(newXmm());
+  AsmJit::XMMVar y(newXmm());
+  AsmJit::XMMVar t(newXmm());
+
+  // Result is 0 or infinity outside of [-746, 710]. NaN is kept, it's the
+  // second operand of MAX and MIN.
+  c->emit(inst->mov, t, getConstantReal(-746.0).getOperand());
+  c->emit(inst->max, t, arg.getOperand());
+  c->emit(inst->mov, x, getConstantReal(710.0).getOperand());
+  c->emit(inst->min, x, t);
+
+  // n = round(x / ln(2)), k = n as integer.
+  c->emit(inst->mov, n, x);
+  c->emit(inst->mul, n, getConstantReal(1.44269504088896338700e+00).getOperand());
+  c->emit(AsmJit::INST_CVTPD2DQ, k, n);
+  c->emit(AsmJit::INST_CVTDQ2PD, n, k);
+
+  // r = hi - lo, hi = x - n * JIT_LN2_HI, lo = n * JIT_LN2_LO (in n).
+  c->emit(inst->mov, hi, x);
+  c->emit(inst->mov, t, n);
+  c->emit(inst->mul, t, getConstantReal(JIT_LN2_HI).getOperand());
+  c->emit(inst->sub, hi, t);
+  c->emit(inst->mul, n, getConstantReal(JIT_LN2_LO).getOperand());
+  c->emit(inst->mov, r, hi);
+  c->emit(inst->sub, r, n);
+
+  // t = r - r^2 * P(r^2).
+  c->emit(inst->mov, z, r);
+  c->emit(inst->mul, z, r);
+  emitPolynomial(y, z, jitExpP, MP_ARRAY_SIZE(jitExpP));
+  c->emit(inst->mul, y, z);
+  c->emit(inst->mov, t, r);
+  c->emit(inst->sub, t, y);
+
+  // y = exp(r) = 1 - ((lo - r * t / (2 - t)) - hi).
+  c->emit(inst->mul, r, t);
+  c->emit(inst->mov, y, getConstantReal(2.0).getOperand());
+  c->emit(inst->sub, y, t);
+  c->emit(inst->div, r, y);
+  c->emit(inst->sub, n, r);
+  c->emit(inst->sub, n, hi);
+  c->emit(inst->mov, y, getConstantReal(1.0).getOperand());
+  c->emit(inst->sub, y, n);
+
+  // y * 2^n1 * 2^n2, n1 = n >> 1, n2 = n - n1, both powers of two are
+  // normal numbers even if 2^n is not. Each integer is moved to the
+  // exponent of its lane.
+  JitVar bias(registerVar(getConstantBits(0x000003FF000003FF)));
+
+  c->emit(AsmJit::INST_PSHUFD, k, k, AsmJit::imm(0x50));
+  c->emit(inst->mov, t, k);
+  c->emit(AsmJit::INST_PSRAD, t, AsmJit::imm(1));
+  c->emit(AsmJit::INST_PSUBD, k, t);
+
+  c->emit(AsmJit::INST_PADDD, t, bias.getOperand());
+  c->emit(AsmJit::INST_PSLLQ, t, AsmJit::imm(52));
+  c->emit(inst->mul, y, t);
+
+  c->emit(AsmJit::INST_PADDD, k, bias.getOperand());
+  c->emit(AsmJit::INST_PSLLQ, k, AsmJit::imm(52));
+  c->emit(inst->mul, y, k);
+
+  return JitVar(y, JitVar::FLAG_NONE);
+}
+
+//! @brief Inline log(), error at most 1 ulp (2 ulp of log10()).
+//!
+//! x = 2^k * m, sqrt(2)/2 <= m < sqrt(2), log(x) = k * ln(2) + log(m).
+JitVar JitCompiler::doLog(const JitVar& arg)
+{
+  JitVar xv(registerVar(arg));
+  const AsmJit::XMMVar& x = xv.getXmm();
+
+  AsmJit::XMMVar mask(newXmm());
+  AsmJit::XMMVar f(newXmm());
+  AsmJit::XMMVar k(newXmm());
+  AsmJit::XMMVar s(newXmm());
+  AsmJit::XMMVar z(newXmm());
+  AsmJit::XMMVar w(newXmm());
+  AsmJit::XMMVar h(newXmm());
+  AsmJit::XMMVar t(newXmm());
+  AsmJit::XMMVar u(newXmm());
+
+  JitVar one(registerVar(getConstantReal(1.0)));
+
+  // Denormals are multiplied by 2^54 to be normalized, mask is 54 for them
+  // and 0 for other values.
+  c->emit(inst->mov, mask, x);
+  c->emit(inst->cmp, mask, getConstantReal(2.2250738585072014e-308).getOperand(), AsmJit::imm(JIT_CMP_LT));
+  c->emit(inst->mov, f, mask);
+  c->emit(inst->andn, f, one.getOperand());
+  c->emit(inst->mov, t, mask);
+  c->emit(inst->and_, t, registerVar(getConstantReal(18014398509481984.0)).getOperand());
+  c->emit(inst->or_, f, t);
+  c->emit(inst->mul, f, x);
+  c->emit(inst->and_, mask, registerVar(getConstantReal(54.0)).getOperand());
+
+  // k = exponent of f - 1023 - mask.
+  c->emit(inst->mov, k, f);
+  c->emit(AsmJit::INST_PSRLQ, k, AsmJit::imm(52));
+  c->emit(AsmJit::INST_PSHUFD, k, k, AsmJit::imm(0x08));
+  c->emit(AsmJit::INST_CVTDQ2PD, k, k);
+  c->emit(inst->sub, k, getConstantReal(1023.0).getOperand());
+  c->emit(inst->sub, k, mask);
+
+  // m = mantissa of f in [1, 2), it's halved and k incremented if it's
+  // above sqrt(2).
+  c->emit(inst->and_, f, registerVar(getConstantBits(0x000FFFFFFFFFFFFF)).getOperand());
+  c->emit(inst->or_, f, one.getOperand());
+  c->emit(inst->mov, mask, getConstantReal(1.41421356237309504880).getOperand());
+  c->emit(inst->cmp, mask, f, AsmJit::imm(JIT_CMP_LT));
+  c->emit(inst->mov, t, mask);
+  c->emit(inst->and_, t, one.getOperand());
+  c->emit(inst->add, k, t);
+  c->emit(inst->mov, t, f);
+  c->emit(inst->mul, t, getConstantReal(0.5).getOperand());
+  c->emit(inst->and_, t, mask);
+  c->emit(inst->sub, f, t);
+
+  // f = m - 1, s = f / (2 + f), z = s^2, w = z^2.
+  c->emit(inst->sub, f, one.getOperand());
+  c->emit(inst->mov, t, getConstantReal(2.0).getOperand());
+  c->emit(inst->add, t, f);
+  c->emit(inst->mov, s, f);
+  c->emit(inst->div, s, t);
+  c->emit(inst->mov, z, s);
+  c->emit(inst->mul, z, s);
+  c->emit(inst->mov, w, z);
+  c->emit(inst->mul, w, z);
+
+  // t = R = z * Lg_odd(w) + w * Lg_even(w).
+  emitPolynomial(u, w, jitLogEven, MP_ARRAY_SIZE(jitLogEven));
+  c->emit(inst->mul, u, w);
+  emitPolynomial(t, w, jitLogOdd, MP_ARRAY_SIZE(jitLogOdd));
+  c->emit(inst->mul, t, z);
+  c->emit(inst->add, t, u);
+
+  // k = k * JIT_LN2_HI - ((h - (s * (h + R) + k * JIT_LN2_LO)) - f),
+  // h = f^2 / 2.
+  c->emit(inst->mov, h, f);
+  c->emit(inst->mul, h, getConstantReal(0.5).getOperand());
+  c->emit(inst->mul, h, f);
+  c->emit(inst->add, t, h);
+  c->emit(inst->mul, t, s);
+  c->emit(inst->mov, u, k);
+  c->emit(inst->mul, u, getConstantReal(JIT_LN2_LO).getOperand());
+  c->emit(inst->add, t, u);
+  c->emit(inst->sub, h, t);
+  c->emit(inst->sub, h, f);
+  c->emit(inst->mul, k, getConstantReal(JIT_LN2_HI).getOperand());
+  c->emit(inst->sub, k, h);
+
+  // The result is valid if 0 < x < infinity, otherwise it's -infinity if
+  // x is zero and sqrt(x) for NaN, +infinity and negative values.
+  c->emit(inst->mov, mask, getConstantReal(0.0).getOperand());
+  c->emit(inst->cmp, mask, x, AsmJit::imm(JIT_CMP_LT));
+  c->emit(inst->mov, t, x);
+  c->emit(inst->cmp, t, getConstantBits(0x7FF0000000000000).getOperand(), AsmJit::imm(JIT_CMP_LT));
+  c->emit(inst->and_, mask, t);
+
+  c->emit(inst->sqrt, s, x);
+  c->emit(inst->mov, t, x);
+  c->emit(inst->cmp, t, getConstantReal(0.0).getOperand(), AsmJit::imm(JIT_CMP_EQ));
+  c->emit(inst->mov, u, t);
+  c->emit(inst->and_, u, registerVar(getConstantBits((int64_t)0xFFF0000000000000)).getOperand());
+  c->emit(inst->andn, t, s);
+  c->emit(inst->or_, t, u);
+
+  c->emit(inst->and_, k, mask);
+  c->emit(inst->andn, mask, t);
+  c->emit(inst->or_, k, mask);
+
+  return JitVar(k, JitVar::FLAG_NONE);
+}
+
+//! @brief Inline sin() or cos(), error at most 2 ulp.
+//!
+//! x = n * pi/2 + r, |r| <= pi/4, the result is +-sin(r) or +-cos(r)
+//! depending on the quadrant n. Arguments above @c JIT_SINCOS_LIMIT and
+//! NaNs are passed to the @a fallback function.
+JitVar JitCompiler::doSinCos(const JitVar& arg, bool isCos, void* fallback)
+{
+  JitVar xv(registerVar(arg));
+  const AsmJit::XMMVar& x = xv.getXmm();
+
+  AsmJit::XMMVar result(newXmm());
+  AsmJit::XMMVar t(newXmm());
+  AsmJit::GPVar lanes(c->newGP(AsmJit::VARIABLE_TYPE_GPD));
+
+  AsmJit::Label slowLabel(c->newLabel());
+  AsmJit::Label doneLabel(c->newLabel());
+
+  c->emit(inst->mov, t, x);
+  c->emit(inst->and_, t, registerVar(getSignMask(true)).getOperand());
+  c->emit(inst->cmp, t, getConstantReal(JIT_SINCOS_LIMIT).getOperand(), AsmJit::imm(JIT_CMP_NLE));
+  c->emit(AsmJit::INST_MOVMSKPD, lanes, t);
+  c->test(lanes, AsmJit::imm(width == 1 ? 1 : 3));
+  c->jnz(slowLabel);
+
+  {
+    AsmJit::XMMVar n(newXmm());
+    AsmJit::XMMVar k(newXmm());
+    AsmJit::XMMVar r(newXmm());
+    AsmJit::XMMVar z(newXmm());
+    AsmJit::XMMVar s(newXmm());
+    AsmJit::XMMVar w(newXmm());
+    AsmJit::XMMVar h(newXmm());
+
+    // n = round(x / (pi/2)), k = n as integer.
+    c->emit(inst->mov, n, x);
+    c->emit(inst->mul, n, getConstantReal(6.36619772367581382433e-01).getOperand());
+    c->emit(AsmJit::INST_CVTPD2DQ, k, n);
+    c->emit(AsmJit::INST_CVTDQ2PD, n, k);
+
+    // r = x - n * JIT_PIO2_1 - n * JIT_PIO2_2 - n * JIT_PIO2_3
+    //       - n * JIT_PIO2_3T, z = r^2.
+    c->emit(inst->mov, r, x);
+    c->emit(inst->mov, t, n);
+    c->emit(inst->mul, t, getConstantReal(JIT_PIO2_1).getOperand());
+    c->emit(inst->sub, r, t);
+    c->emit(inst->mov, t, n);
+    c->emit(inst->mul, t, getConstantReal(JIT_PIO2_2).getOperand());
+    c->emit(inst->sub, r, t);
+    c->emit(inst->mov, t, n);
+    c->emit(inst->mul, t, getConstantReal(JIT_PIO2_3).getOperand());
+    c->emit(inst->sub, r, t);
+    c->emit(inst->mul, n, getConstantReal(JIT_PIO2_3T).getOperand());
+    c->emit(inst->sub, r, n);
+    c->emit(inst->mov, z, r);
+    c->emit(inst->mul, z, r);
+
+    // s = sin(r) = r + r^3 * S(z), it has the sign of r, -0 + +0 would
+    // make sin(-0) +0.
+    emitPolynomial(s, z, jitSinS, MP_ARRAY_SIZE(jitSinS));
+    c->emit(inst->mov, t, z);
+    c->emit(inst->mul, t, r);
+    c->emit(inst->mul, s, t);
+    c->emit(inst->add, s, r);
+    c->emit(inst->mov, t, r);
+    c->emit(inst->and_, t, registerVar(getSignMask(false)).getOperand());
+    c->emit(inst->or_, s, t);
+
+    // w = cos(r) = w + (((1 - w) - h) + z^2 * C(z)), h = z/2, w = 1 - h.
+    emitPolynomial(r, z, jitCosC, MP_ARRAY_SIZE(jitCosC));
+    c->emit(inst->mul, r, z);
+    c->emit(inst->mul, r, z);
+    c->emit(inst->mov, h, z);
+    c->emit(inst->mul, h, getConstantReal(0.5).getOperand());
+    c->emit(inst->mov, w, getConstantReal(1.0).getOperand());
+    c->emit(inst->sub, w, h);
+    c->emit(inst->mov, t, getConstantReal(1.0).getOperand());
+    c->emit(inst->sub, t, w);
+    c->emit(inst->sub, t, h);
+    c->emit(inst->add, t, r);
+    c->emit(inst->add, w, t);
+
+    // Quadrant of sin() is n and of cos() n + 1. Its bit 0 selects cos(r)
+    // instead of sin(r) and bit 1 negates the result. Integers are copied
+    // to both halves of their lane first.
+    JitVar ones(registerVar(getConstantBits(0x0000000100000001)));
+
+    c->emit(AsmJit::INST_PSHUFD, k, k, AsmJit::imm(0x50));
+    if (isCos) c->emit(AsmJit::INST_PADDD, k, ones.getOperand());
+
+    c->emit(inst->mov, t, k);
+    c->emit(AsmJit::INST_PAND, t, ones.getOperand());
+    c->emit(AsmJit::INST_PCMPEQD, t, ones.getOperand());
+    c->emit(inst->mov, result, w);
+    c->emit(inst->and_, result, t);
+    c->emit(inst->andn, t, s);
+    c->emit(inst->or_, result, t);
+
+    c->emit(AsmJit::INST_PSLLQ, k, AsmJit::imm(62));
+    c->emit(inst->and_, k, registerVar(getSignMask(false)).getOperand());
+    c->emit(inst->xor_, result, k);
+    c->jmp(doneLabel);
+  }
+
+  c->bind(slowLabel);
+  c->emit(inst->mov, result, callFunction(fallback, &x, 1).getOperand());
+  c->bind(doneLabel);
+
+  return JitVar(result, JitVar::FLAG_NONE);
+}
+
+JitVar JitCompiler::doRound(const JitVar& arg, uint mode)
+{
+  JitVar result(newXmm(), JitVar::FLAG_NONE);
+
+  if (features & AsmJit::CPU_FEATURE_SSE4_1)
+  {
+    c->emit(inst->round, result.getXmm(), arg.getOperand(), AsmJit::imm(mode));
+    return result;
+  }
+
+  // (|x| + 2^52) - 2^52 is |x| rounded to the nearest integer, minus one if
+  // it's above |x| it's truncated. |x| >= 2^52 (and NaN) is an integer. The
+  // sign of x is copied back, so trunc(-0.5) is -0 like ROUNDSD.
+  JitVar x(registerVar(arg));
+  JitVar magic(getConstantReal(isFloat32 ? 8388608.0 : 4503599627370496.0));
+  JitVar one(registerVar(getConstantReal(1.0)));
+
+  AsmJit::XMMVar a(newXmm());
+  AsmJit::XMMVar t(newXmm());
+
+  c->emit(inst->mov, a, x.getOperand());
+  c->emit(inst->and_, a, registerVar(getSignMask(true)).getOperand());
+
+  AsmJit::XMMVar r(result.getXmm());
+  c->emit(inst->mov, r, a);
+  c->emit(inst->add, r, magic.getOperand());
+  c->emit(inst->sub, r, magic.getOperand());
+
+  c->emit(inst->mov, t, a);
+  c->emit(inst->cmp, t, r, AsmJit::imm(JIT_CMP_LT));
+  c->emit(inst->and_, t, one.getOperand());
+  c->emit(inst->sub, r, t);
+
+  c->emit(inst->mov, t, a);
+  c->emit(inst->cmp, t, magic.getOperand(), AsmJit::imm(JIT_CMP_LT));
+  c->emit(inst->and_, r, t);
+  c->emit(inst->andn, t, a);
+  c->emit(inst->or_, r, t);
+
+  c->emit(inst->mov, t, x.getOperand());
+  c->emit(inst->and_, t, registerVar(getSignMask(false)).getOperand());
+  c->emit(inst->or_, r, t);
+
+  // floor(x) is trunc(x) - 1 where x < trunc(x), ceil(x) is trunc(x) + 1
+  // where trunc(x) < x.
+  if (mode == JIT_ROUND_FLOOR)
+  {
+    c->emit(inst->mov, t, x.getOperand());
+    c->emit(inst->cmp, t, r, AsmJit::imm(JIT_CMP_LT));
+    c->emit(inst->and_, t, one.getOperand());
+    c->emit(inst->sub, r, t);
+  }
+  else if (mode == JIT_ROUND_CEIL)
+  {
+    c->emit(inst->mov, t, r);
+    c->emit(inst->cmp, t, x.getOperand(), AsmJit::imm(JIT_CMP_LT));
+    c->emit(inst->and_, t, one.getOperand());
+    c->emit(inst->add, r, t);
+  }
+  else
+  {
+    MP_ASSERT(mode == JIT_ROUND_TRUNC);
+  }
+
+  return result;
+}
+
+void JitCompiler::emitPolynomial(const AsmJit::XMMVar& dst, const AsmJit::XMMVar& x, const double* coeff, uint count)
+{
+  // Horner's scheme, coeff[0] is the constant term.
+  c->emit(inst->mov, dst, getConstantReal(coeff[count - 1]).getOperand());
+  for (uint i = count - 1; i > 0; i--)
+  {
+    c->emit(inst->mul, dst, x);
+    c->emit(inst->add, dst, getConstantReal(coeff[i - 1]).getOperand());
+  }
+}
+
+AsmJit::Emittable* JitCompiler::beginProlog()
+{
+  return c->setCurrentEmittable(bodyEmittable);
+}
+
+void JitCompiler::endProlog(AsmJit::Emittable* old)
+{
+  // Next prolog instruction goes after the one just emitted.
+  AsmJit::Emittable* last = c->getCurrentEmittable();
+  if (old != bodyEmittable) c->setCurrentEmittable(old);
+  bodyEmittable = last;
+}
+
+JitVar JitCompiler::getConstantBits(int64_t value)
 {
   size_t i = 0;
   size_t length = constVariables.getLength();
 
   if (length == 0)
   {
-    AsmJit::Emittable* old = c->setCurrentEmittable(bodyEmittable);
+    AsmJit::Emittable* old = beginProlog();
     c->lea(dataAddress, ptr(dataLabel));
-    if (old != bodyEmittable) c->setCurrentEmittable(old);
+    endProlog(old);
   }
   else
   {
@@ -569,23 +2093,84 @@ JitVar JitCompiler::getConstantI64(int64_t value)
     } while (++i < length);
   }
 
-  JitVar var(ptr(dataAddress, (sysint_t)i * sizeof(int64_t)), JitVar::FLAG_RO);
+  // The column function stores each constant in all lanes, so it can be
+  // used by packed instructions as well.
+  sysint_t entrySize = (mode == JIT_MODE_COLUMNS) ? 16 : (sysint_t)valueSize;
+  JitVar var(ptr(dataAddress, (sysint_t)i * entrySize), JitVar::FLAG_RO);
+
+  // Load first few constants into registers before the loop, so they are
+  // not reloaded for every row.
+  if (i < JIT_MAX_HOISTED_CONSTANTS)
+  {
+    AsmJit::Emittable* old = beginProlog();
+    AsmJit::XMMVar reg(newXmm());
+    c->emit(mpGetJitInstructions(isFloat32, mode == JIT_MODE_COLUMNS)->mov, reg, var.getOperand());
+    endProlog(old);
+
+    var = JitVar(reg, JitVar::FLAG_RO);
+  }
 
   constVariables.append(JitConst(var, value));
   dataBuffer.ensureSpace();
-  dataBuffer.emitQWord((uint64_t)value);
+
+  for (sysint_t k = 0; k < entrySize; k += valueSize)
+  {
+    if (isFloat32)
+      dataBuffer.emitDWord((uint32_t)value);
+    else
+      dataBuffer.emitQWord((uint64_t)value);
+  }
 
   return var;
 }
 
-JitVar JitCompiler::getConstantF64(double value)
+JitVar JitCompiler::getConstantReal(double value)
+{
+  if (isFloat32)
+  {
+    I32FPUnion u;
+    u.f32 = (float)value;
+    return getConstantBits((int64_t)(uint32_t)u.i32);
+  }
+  else
+  {
+    I64FPUnion u;
+    u.f64 = value;
+    return getConstantBits(u.i64);
+  }
+}
+
+JitVar JitCompiler::getSignMask(bool inverted)
+{
+  // Sign bit to negate a value, all bits except the sign to get an absolute
+  // value.
+  if (isFloat32)
+    return getConstantBits(inverted ? 0x7FFFFFFF : 0x80000000);
+  else
+    return getConstantBits(inverted ? 0x7FFFFFFFFFFFFFFF : (int64_t)0x8000000000000000);
+}
+
+AsmJit::GPVar JitCompiler::getColumn(uint index)
 {
-  I64FPUnion u;
-  u.f64 = value;
-  return getConstantI64(u.i64);
+  size_t i, length = columnIndexes.getLength();
+
+  for (i = 0; i < length; i++)
+  {
+    if (columnIndexes[i] == index) return columnVariables[i];
+  }
+
+  // Load the column pointer once, before the loop.
+  AsmJit::Emittable* old = beginProlog();
+  AsmJit::GPVar column(c->newGP(AsmJit::VARIABLE_TYPE_GPN));
+  c->mov(column, ptr(columnsAddress, (sysint_t)index * sizeof(void*)));
+  endProlog(old);
+
+  columnIndexes.append(index);
+  columnVariables.append(column);
+  return column;
 }
 
-MEvalFunc mpCompileFunction(WorkContext& ctx, ASTElement* tree, char** logOutput)
+MEvalFunc mpCompileFunction(WorkContext& ctx, ASTElement* tree, char** logOutput, std::string* image)
 {
   bool enableLogger = (logOutput != NULL);
   AsmJit::Compiler c;
@@ -597,13 +2182,13 @@ MEvalFunc mpCompileFunction(WorkContext& ctx, ASTElement* tree, char** logOutput
     c.setLogger(&logger);
   }
 
-  JitCompiler jitCompiler(ctx, &c);
+  JitCompiler jitCompiler(ctx, &c, JIT_MODE_ROWS);
 
   jitCompiler.beginFunction();
   jitCompiler.doTree(tree);
   jitCompiler.endFunction();
 
-  MEvalFunc fn = jitCompiler.make();
+  MEvalFunc fn = AsmJit::function_cast<MEvalFunc>(jitCompiler.make(image));
 
   if (enableLogger)
   {
@@ -614,9 +2199,66 @@ MEvalFunc mpCompileFunction(WorkContext& ctx, ASTElement* tree, char** logOutput
   return fn;
 }
 
-void mpFreeFunction(void* fn)
+MEvalFunc mpCompileSetFunction(WorkContext& ctx, ASTBlock* outputs)
 {
-  AsmJit::MemoryManager::getGlobal()->free((void*)fn);
+  AsmJit::Compiler c;
+  JitCompiler jitCompiler(ctx, &c, JIT_MODE_ROWS);
+
+  jitCompiler.beginFunction();
+  jitCompiler.doOutputs(outputs);
+  jitCompiler.endFunction();
+
+  return AsmJit::function_cast<MEvalFunc>(jitCompiler.make());
+}
+
+MEvalColumnsFunc mpCompileColumnsFunction(WorkContext& ctx, ASTElement* tree)
+{
+  AsmJit::Compiler c;
+  JitCompiler jitCompiler(ctx, &c, JIT_MODE_COLUMNS);
+
+  jitCompiler.beginFunction();
+  jitCompiler.doTree(tree);
+  jitCompiler.beginTail();
+  jitCompiler.doTree(tree);
+  jitCompiler.endFunction();
+
+  return AsmJit::function_cast<MEvalColumnsFunc>(jitCompiler.make());
+}
+
+MEvalReduceFunc mpCompileReduceFunction(WorkContext& ctx, ASTElement* tree, int op)
+{
+  AsmJit::Compiler c;
+  JitCompiler jitCompiler(ctx, &c, JIT_MODE_REDUCE, op);
+
+  jitCompiler.beginFunction();
+  for (uint k = 0; k < REDUCE_ACCUMULATORS; k++) jitCompiler.doTree(tree);
+  jitCompiler.beginTail();
+  jitCompiler.doTree(tree);
+  jitCompiler.endFunction();
+
+  return AsmJit::function_cast<MEvalReduceFunc>(jitCompiler.make());
+}
+
+MEvalFunc mpLoadFunction(WorkContext& ctx, const void* image, size_t size)
+{
+  void* p = mpAllocCode(ctx, size);
+  if (p == NULL) return NULL;
+
+  memcpy(p, image, size);
+  return AsmJit::function_cast<MEvalFunc>(p);
+}
+
+void mpFreeFunction(ContextPrivate* ctx, void* fn)
+{
+  if (ctx != NULL && ctx->arena != NULL && ctx->arena->free(fn)) return;
+  if (AsmJit::MemoryManager::getGlobal()->free(fn)) return;
+
+  // Compiled by Context::compileMany().
+  for (uint i = 1; i < JIT_MEMORY_COUNT; i++)
+  {
+    AsmJit::MemoryManager* memory = jitMemory[i];
+    if (memory != NULL && memory->free(fn)) return;
+  }
 }
 
 } // MathPresso namespace
@@ -30,10 +30,44 @@
 #include "MathPresso_AST_p.h"
 #include "MathPresso_Util_p.h"
 
+#include <stdint.h>
+#include <string>
+
 namespace MathPresso {
 
-MATHPRESSO_HIDDEN MEvalFunc mpCompileFunction(WorkContext& ctx, ASTElement* tree, char** logOutput = NULL);
-MATHPRESSO_HIDDEN void mpFreeFunction(void* fn);
+//! @internal
+//!
+//! @brief Compile @a tree into a row function. If @a image is not NULL and
+//! the code doesn't depend on its address, the machine code is stored to
+//! @a image, it can be loaded by @ref mpLoadFunction() in other process.
+MATHPRESSO_HIDDEN MEvalFunc mpCompileFunction(WorkContext& ctx, ASTElement* tree, char** logOutput = NULL, std::string* image = NULL);
+
+//! @internal
+//!
+//! @brief Copy @a image created by @ref mpCompileFunction() to executable
+//! memory of @a ctx, the function is freed by @ref mpFreeFunction().
+MATHPRESSO_HIDDEN MEvalFunc mpLoadFunction(WorkContext& ctx, const void* image, size_t size);
+
+//! @internal
+//!
+//! @brief Get features of the host CPU the code is compiled for.
+MATHPRESSO_HIDDEN uint32_t mpGetJitFeatures();
+
+//! @internal
+//!
+//! @brief Get identifier of this build of the JIT compiler, code stored by
+//! other builds is not loaded.
+MATHPRESSO_HIDDEN const char* mpGetJitBuildId();
+
+MATHPRESSO_HIDDEN MEvalFunc mpCompileSetFunction(WorkContext& ctx, ASTBlock* outputs);
+MATHPRESSO_HIDDEN MEvalColumnsFunc mpCompileColumnsFunction(WorkContext& ctx, ASTElement* tree);
+MATHPRESSO_HIDDEN MEvalReduceFunc mpCompileReduceFunction(WorkContext& ctx, ASTElement* tree, int op);
+
+//! @internal
+//!
+//! @brief Free function @a fn compiled with context @a ctx (can be NULL if
+//! the context has no code arena).
+MATHPRESSO_HIDDEN void mpFreeFunction(ContextPrivate* ctx, void* fn);
 
 } // MathPresso namespace
 
@@ -34,7 +34,8 @@
 namespace MathPresso {
 
 Optimizer::Optimizer(WorkContext& ctx) :
-  _ctx(ctx)
+  _ctx(ctx),
+  _valueCount(0)
 {
 }
 
@@ -54,6 +55,8 @@ ASTElement* Optimizer::doNode(ASTElement* element)
       return doTransform(reinterpret_cast<ASTTransform*>(element));
     case MELEMENT_CALL:
       return doCall(reinterpret_cast<ASTCall*>(element));
+    case MELEMENT_CONDITION:
+      return doCondition(reinterpret_cast<ASTCondition*>(element));
     default:
       return element;
   }
@@ -71,11 +74,20 @@ ASTElement* Optimizer::doBlock(ASTBlock* element)
 
 ASTElement* Optimizer::doOperator(ASTOperator* element)
 {
-  ASTElement* left;
-  ASTElement* right;
+  switch (element->getOperatorType())
+  {
+    case MOPERATOR_PLUS:
+    case MOPERATOR_MINUS:
+    case MOPERATOR_MUL:
+    case MOPERATOR_DIV:
+      return doChain(element);
+  }
 
-  left = element->_left = doNode(element->getLeft());
-  right = element->_right = doNode(element->getRight());
+  element->setLeft(doNode(element->getLeft()));
+  element->setRight(doNode(element->getRight()));
+
+  ASTElement* left = element->getLeft();
+  ASTElement* right = element->getRight();
 
   bool leftConst = left->isConstant();
   bool rightConst = right->isConstant();
@@ -85,188 +97,49 @@ ASTElement* Optimizer::doOperator(ASTOperator* element)
     // Both are constants, simplify them.
     mreal_t result = element->evaluate(NULL);
 
-    ASTConstant* replacement = new ASTConstant(_ctx.genId(), result);
+    ASTConstant* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(result));
+    if (replacement == NULL) return element;
+
     replacement->getParent() = element->getParent();
-    delete element;
     return replacement;
   }
   else if (leftConst || rightConst)
   {
-    // Left or right is constant, try to find another one deeper that can be joined
-    ASTElement* c;
-    ASTElement* x;
-
-    if (leftConst)
-    {
-      c = left;
-      x = right;
-    }
-    else
-    {
-      c = right;
-      x = left;
-    }
-
+    ASTElement* c = leftConst ? left : right;
+    ASTElement* x = leftConst ? right : left;
     mreal_t cvalue = c->evaluate(NULL);
-    if (cvalue == 0) // Optimize var*0, var+0, etc.
+
+    switch (element->getOperatorType())
     {
-      switch (element->getOperatorType())
+      case MOPERATOR_MOD:
       {
-        case MOPERATOR_PLUS:
-        { // x+0 == x
-          element->replaceChild(x, NULL);
-          delete element;
-          return x;
-        }
-        case MOPERATOR_MUL:
-        { // x*0 == 0
-          element->replaceChild(c, NULL);
-          delete element;
-          return c;
-        }
-        case MOPERATOR_MINUS:
+        if (cvalue == 0 && x == right) // 0%x == 0
         {
-          if (x == left) // x-0 == x
-          {
-            element->replaceChild(x, NULL);
-            delete element;
-            return x;
-          }
-          else // 0-x == -x
-          {
-            element->replaceChild(x, NULL);
-            ASTTransform* replacement = new ASTTransform(_ctx.genId());
-            replacement->setTransformType(MTRANSFORM_NEGATE);
-            replacement->setChild(x);
-            return replacement;
-          }
-        }
-        case MOPERATOR_DIV:
-        case MOPERATOR_MOD:
-        {
-          if (x == right) // 0/x == 0
-          {
-            element->replaceChild(c, NULL);
-            delete element;
-            return c;
-          }
-          else // x/0 - divide by zero!
-          {
-            // Not sure what to do here...
-
-            //ASTConstant* replacement = new ASTConstant(_ctx.genId(), std::numeric_limits<double>::quiet_NaN());
-            //replacement->getParent() = element->getParent();
-            //delete element;
-            //return replacement;
-            break;
-          }
+          return c;
         }
+        break;
       }
-    }
-    else if (cvalue == 1) // Optimize var*1, var^1, etc.
-    {
-      switch (element->getOperatorType())
+      case MOPERATOR_POW:
       {
-        case MOPERATOR_MUL:
-        { // x*1 == x
-          element->replaceChild(x, NULL);
-          delete element;
-          return x;
-        }
-        case MOPERATOR_DIV:
+        if (x == left) // x^c, multiplications or a square root instead of pow().
         {
-          if (x == left) // x/1 == x
-          {
-            element->replaceChild(x, NULL);
-            delete element;
-            return x;
-          }
-          else break;
+          return doPower(element, x, cvalue);
         }
-        case MOPERATOR_POW:
+        else if (cvalue == 1) // 1^x == 1
         {
-          if (x == left) // x^1 == x
-          {
-            element->replaceChild(x, NULL);
-            delete element;
-            return x;
-          }
-          else // 1^x == 1
-          {
-            ASTConstant* replacement = new ASTConstant(_ctx.genId(), 1.0);
-            replacement->getParent() = element->getParent();
-            delete element;
-            return replacement;
-          }
-        }
-      }
-    }
-    else if (cvalue == -1) // Optimize var*-1, var/-1
-    {
-      switch (element->getOperatorType())
-      {
-        case MOPERATOR_DIV:
-          if (x == right) break; // skip -1/x
-          // fall through
-        case MOPERATOR_MUL:
-        {
-          // -1*x == x*-1 == x/-1 == -x
-          element->replaceChild(x, NULL);
-          ASTTransform* replacement = new ASTTransform(_ctx.genId());
-          replacement->setTransformType(MTRANSFORM_NEGATE);
-          replacement->setChild(x);
-          delete element;
-          return replacement;
+          return c;
         }
+        break;
       }
     }
-
-    ASTElement* y = findConstNode(x, element->getOperatorType());
-    if (y != NULL)
-    {
-      ASTOperator* p = reinterpret_cast<ASTOperator*>(y->getParent());
-      ASTElement* keep;
-
-      MP_ASSERT(p->getElementType() == MELEMENT_OPERATOR);
-
-      mreal_t result;
-
-      // Hardcoded evaluator (we accept only PLUS or MUL operators)
-      switch (element->getOperatorType())
-      {
-        case MOPERATOR_PLUS:
-          result = c->evaluate(NULL) + y->evaluate(NULL);
-          break;
-        case MOPERATOR_MUL:
-          result = c->evaluate(NULL) * y->evaluate(NULL);
-          break;
-        default:
-          MP_ASSERT_NOT_REACHED();
-      }
-
-      if (p->getRight() == y)
-      {
-        keep = p->getLeft();
-        p->_left = NULL;
-      }
-      else
-      {
-        keep = p->getRight();
-        p->_right = NULL;
-      }
-      p->getParent()->replaceChild(p, keep);
-      delete p;
-      c->getParent()->replaceChild(c, new ASTConstant(c->getElementId(), result));
-      delete c;
-    }
   }
   return element;
 }
 
 ASTElement* Optimizer::doCall(ASTCall* element)
 {
-  Vector<ASTElement*>& arguments = element->getArguments();
-  size_t i, len = arguments.getLength();
+  ASTElement** arguments = element->getArguments();
+  size_t i, len = element->getArgumentsCount();
   bool allConst = true;
 
   for (i = 0; i < len; i++)
@@ -279,23 +152,69 @@ ASTElement* Optimizer::doCall(ASTCall* element)
   {
     mreal_t result = element->evaluate(NULL);
 
-    ASTElement* replacement = new ASTConstant(_ctx.genId(), result);
+    ASTElement* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(result));
+    if (replacement == NULL) return element;
+
     replacement->getParent() = element->getParent();
-    delete element;
     return replacement;
   }
+
+  // pow(x, c) is the same as x^c.
+  if (element->getFunction()->getFunctionId() == MFUNCTION_POW && arguments[1]->isConstant())
+    return doPower(element, arguments[0], arguments[1]->evaluate(NULL));
+
   return element;
 }
 
+ASTElement* Optimizer::doPower(ASTElement* element, ASTElement* x, mreal_t exponent)
+{
+  if (exponent == 0)
+  {
+    // x^0 == 1, even if x is NaN.
+    ASTConstant* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), 1.0);
+    if (replacement == NULL) return element;
+
+    replacement->getParent() = element->getParent();
+    return replacement;
+  }
+
+  if (exponent == 1)
+    return x;
+
+  uint transformType;
+  int n = 0;
+
+  if (exponent == 0.5)
+    transformType = MTRANSFORM_SQRT;
+  else if (exponent == -0.5)
+    transformType = MTRANSFORM_RSQRT;
+  else if (exponent == -1)
+    transformType = MTRANSFORM_RECIPROCAL;
+  else if (exponent >= -OPTIMIZER_MAX_POWI && exponent <= OPTIMIZER_MAX_POWI && exponent == (mreal_t)(n = (int)exponent))
+    transformType = MTRANSFORM_POWI;
+  else
+    return element;
+
+  ASTTransform* replacement = new(_ctx.getZone()) ASTTransform(_ctx.genId());
+  if (replacement == NULL) return element;
+
+  replacement->setTransformType(transformType);
+  replacement->setExponent(n);
+  replacement->setChild(x);
+  replacement->getParent() = element->getParent();
+  return replacement;
+}
+
 ASTElement* Optimizer::doTransform(ASTTransform* element)
 {
   if (element->isConstant())
   {
     mreal_t result = element->evaluate(NULL);
 
-    ASTElement* replacement = new ASTConstant(_ctx.genId(), result);
+    ASTElement* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(result));
+    if (replacement == NULL) return element;
+
     replacement->getParent() = element->getParent();
-    delete element;
     return replacement;
   }
   ASTElement* child = doNode(element->getChild());
@@ -310,12 +229,15 @@ ASTElement* Optimizer::doTransform(ASTTransform* element)
         if (childTransform->getTransformType() == MTRANSFORM_NEGATE)
         {
           ASTElement* childChild = childTransform->getChild();
-          childTransform->removeChild();
-          delete element;
           return childChild;
         }
       }
       break;
+    case MTRANSFORM_SQRT:
+    case MTRANSFORM_RECIPROCAL:
+    case MTRANSFORM_RSQRT:
+    case MTRANSFORM_POWI:
+      break;
     case MTRANSFORM_NONE:
       // Should not happen
     default:
@@ -325,28 +247,442 @@ ASTElement* Optimizer::doTransform(ASTTransform* element)
   return element;
 }
 
-ASTElement* Optimizer::findConstNode(ASTElement* _element, int op)
+ASTElement* Optimizer::doCondition(ASTCondition* element)
+{
+  element->setCondition(doNode(element->getCondition()));
+  element->setThen(doNode(element->getThen()));
+  element->setElse(doNode(element->getElse()));
+
+  // Constant condition selects one branch.
+  ASTElement* condition = element->getCondition();
+  if (!condition->isConstant()) return element;
+
+  ASTElement* replacement = condition->evaluate(NULL) != 0 ? element->getThen() : element->getElse();
+  replacement->getParent() = element->getParent();
+  return replacement;
+}
+
+// ============================================================================
+// [MathPresso::Optimizer - Sums and Products]
+// ============================================================================
+
+ASTElement* Optimizer::doChain(ASTOperator* element)
+{
+  // Reordering changes the result, it's done only with MOPTION_FAST_MATH.
+  if (!_ctx.isFastMath()) return doOrdered(element);
+
+  OptimizerChain chain(element->getOperatorType() == MOPERATOR_MUL ||
+                       element->getOperatorType() == MOPERATOR_DIV);
+
+  // Without memory keep the chain as it is.
+  if (!collectTerms(chain, element, false)) return element;
+
+  if (chain.terms.getLength() == 0)
+  {
+    // All terms are constants (or became constants, like x^0).
+    mreal_t result = chain.constant;
+    if (chain.product)
+    {
+      result /= chain.denominator;
+      if (chain.negated) result = -result;
+    }
+
+    ASTConstant* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(result));
+    if (replacement == NULL) return element;
+
+    replacement->getParent() = element->getParent();
+    return replacement;
+  }
+
+  bool negated = false;
+  bool divided = false;
+  mreal_t c = chain.constant;
+
+  if (chain.product)
+  {
+    if (c == 0 && chain.denominator != 0)
+    {
+      // x*0 == 0/x == 0
+      ASTConstant* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), 0.0);
+      if (replacement == NULL) return element;
+
+      replacement->getParent() = element->getParent();
+      return replacement;
+    }
+
+    // x/c == x*(1/c), multiplication is much faster than division.
+    if (chain.denominator != 1)
+    {
+      mreal_t reciprocal = _ctx.toPrecision(1.0 / chain.denominator);
+      int exponent;
+
+      if (reciprocal != 0 && mpIsFinite(reciprocal) &&
+          (_ctx.isFastMath() || fabs(frexp(chain.denominator, &exponent)) == 0.5))
+        c *= reciprocal;
+      else
+        divided = true;
+    }
+
+    // -1*x == -x
+    if (chain.negated) c = -c;
+    if (c == -1)
+    {
+      negated = true;
+      c = 1;
+    }
+  }
+
+  // Constants are evaluated first, x+0 == x and x*1 == x.
+  c = _ctx.toPrecision(c);
+  if (c != (chain.product ? 1.0 : 0.0))
+  {
+    ASTConstant* constant = new(_ctx.getZone()) ASTConstant(_ctx.genId(), c);
+    if (constant == NULL || !chain.terms.prepend(OptimizerTerm(constant, false))) return element;
+  }
+
+  if (divided)
+  {
+    ASTConstant* constant = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(chain.denominator));
+    if (constant == NULL || !chain.terms.append(OptimizerTerm(constant, true))) return element;
+  }
+
+  bool inverted;
+  ASTElement* result = lowerTerms(chain.terms.getData(), chain.terms.getLength(), chain.product, inverted);
+  if (result == NULL) return element;
+
+  // -x, 1/x or -(1/x) of the whole chain.
+  uint transforms[2];
+  size_t i, count = 0;
+
+  if (inverted) transforms[count++] = chain.product ? MTRANSFORM_RECIPROCAL : MTRANSFORM_NEGATE;
+  if (negated) transforms[count++] = MTRANSFORM_NEGATE;
+
+  for (i = 0; i < count; i++)
+  {
+    ASTTransform* transform = new(_ctx.getZone()) ASTTransform(_ctx.genId());
+    if (transform == NULL) return element;
+
+    transform->setTransformType(transforms[i]);
+    transform->setChild(result);
+    result = transform;
+  }
+
+  result->getParent() = element->getParent();
+  return result;
+}
+
+ASTElement* Optimizer::doOrdered(ASTOperator* element)
+{
+  element->setLeft(doNode(element->getLeft()));
+  element->setRight(doNode(element->getRight()));
+
+  ASTElement* left = element->getLeft();
+  ASTElement* right = element->getRight();
+  uint type = element->getOperatorType();
+
+  // Only an operation of two constants is folded, it's the same as if it
+  // was evaluated.
+  if (left->isConstant() && right->isConstant())
+  {
+    mreal_t result = element->evaluate(NULL);
+
+    ASTConstant* replacement = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(result));
+    if (replacement == NULL) return element;
+
+    replacement->getParent() = element->getParent();
+    return replacement;
+  }
+
+  if (!right->isConstant())
+  {
+    // 1*x == x.
+    if (type == MOPERATOR_MUL && left->isConstant() && left->evaluate(NULL) == 1.0)
+    {
+      right->getParent() = element->getParent();
+      return right;
+    }
+    return element;
+  }
+
+  // x*1 == x/1 == x-0 == x, even if x is -0 or NaN (x+0 is not, -0+0 is 0).
+  mreal_t c = right->evaluate(NULL);
+  if (((type == MOPERATOR_MUL || type == MOPERATOR_DIV) && c == 1.0) ||
+      (type == MOPERATOR_MINUS && c == 0.0))
+  {
+    left->getParent() = element->getParent();
+    return left;
+  }
+
+  // x/c == x*(1/c) if 1/c is exact (c is a power of two).
+  int exponent;
+  if (type == MOPERATOR_DIV && c != 0 && mpIsFinite(c) && fabs(frexp(c, &exponent)) == 0.5)
+  {
+    mreal_t reciprocal = _ctx.toPrecision(1.0 / c);
+    if (reciprocal != 0 && mpIsFinite(reciprocal))
+    {
+      ASTOperator* op = new(_ctx.getZone()) ASTOperator(_ctx.genId(), MOPERATOR_MUL);
+      ASTConstant* constant = new(_ctx.getZone()) ASTConstant(_ctx.genId(), reciprocal);
+      if (op == NULL || constant == NULL) return element;
+
+      op->setLeft(left);
+      op->setRight(constant);
+      op->getParent() = element->getParent();
+      return op;
+    }
+  }
+
+  return element;
+}
+
+bool Optimizer::collectTerms(OptimizerChain& chain, ASTElement* element, bool inverted)
 {
-  if (_element->getElementType() != MELEMENT_OPERATOR) return NULL;
-  ASTOperator* element = reinterpret_cast<ASTOperator*>(_element);
+  if (element->getElementType() == MELEMENT_OPERATOR)
+  {
+    ASTOperator* op = reinterpret_cast<ASTOperator*>(element);
+    uint type = op->getOperatorType();
+
+    // a+b, a-b, a*b and a/b are flattened into the terms of the chain.
+    if (type == (chain.product ? MOPERATOR_MUL : MOPERATOR_PLUS) ||
+        type == (chain.product ? MOPERATOR_DIV : MOPERATOR_MINUS))
+    {
+      return collectTerms(chain, op->getLeft(), inverted) &&
+             collectTerms(chain, op->getRight(), inverted ^ (type == MOPERATOR_MINUS || type == MOPERATOR_DIV));
+    }
+  }
+  else if (element->getElementType() == MELEMENT_TRANSFORM &&
+           reinterpret_cast<ASTTransform*>(element)->getTransformType() == MTRANSFORM_NEGATE)
+  {
+    // -a is subtracted from a sum, a product is negated.
+    ASTElement* child = reinterpret_cast<ASTTransform*>(element)->getChild();
 
-  int op0 = op;
-  int op1 = element->getOperatorType();
+    if (chain.product)
+      chain.negated = !chain.negated;
+    else
+      inverted = !inverted;
 
-  if ((op0 == MOPERATOR_PLUS && op1 == MOPERATOR_PLUS) ||
-      (op0 == MOPERATOR_MUL  && op1 == MOPERATOR_MUL ) )
+    return collectTerms(chain, child, inverted);
+  }
+
+  ASTElement* optimized = doNode(element);
+
+  // (a+b)^1 + c, the optimized term can be a chain of the same kind.
+  if (optimized != element && optimized->getElementType() == MELEMENT_OPERATOR)
   {
-    ASTElement* left = element->getLeft();
-    ASTElement* right = element->getRight();
+    uint type = reinterpret_cast<ASTOperator*>(optimized)->getOperatorType();
+    if (type == (chain.product ? MOPERATOR_MUL : MOPERATOR_PLUS) ||
+        type == (chain.product ? MOPERATOR_DIV : MOPERATOR_MINUS))
+    {
+      return collectTerms(chain, optimized, inverted);
+    }
+  }
+  element = optimized;
 
-    if (left->isConstant()) return left;
-    if (right->isConstant()) return right;
+  if (element->isConstant())
+  {
+    mreal_t value = element->evaluate(NULL);
 
-    if ((left = findConstNode(left, op)) != NULL) return left;
-    if ((right = findConstNode(right, op)) != NULL) return right;
+    if (!chain.product)
+      chain.constant += inverted ? -value : value;
+    else if (inverted)
+      chain.denominator *= value;
+    else
+      chain.constant *= value;
+    return true;
+  }
+
+  return chain.terms.append(OptimizerTerm(element, inverted));
+}
+
+ASTElement* Optimizer::lowerTerms(const OptimizerTerm* terms, size_t count, bool product, bool& inverted)
+{
+  if (count == 1)
+  {
+    inverted = terms[0].inverted;
+    return terms[0].element;
+  }
+
+  // Both halves can be evaluated in parallel, the order of terms is kept
+  // (a-b == -(b-a) so the left half decides the sign of the result).
+  bool leftInverted;
+  bool rightInverted;
+
+  ASTElement* left = lowerTerms(terms, count / 2, product, leftInverted);
+  if (left == NULL) return NULL;
+
+  ASTElement* right = lowerTerms(terms + count / 2, count - count / 2, product, rightInverted);
+  if (right == NULL) return NULL;
+
+  uint operatorType;
+  if (product)
+    operatorType = (leftInverted == rightInverted) ? MOPERATOR_MUL : MOPERATOR_DIV;
+  else
+    operatorType = (leftInverted == rightInverted) ? MOPERATOR_PLUS : MOPERATOR_MINUS;
+
+  ASTOperator* op = new(_ctx.getZone()) ASTOperator(_ctx.genId(), operatorType);
+  if (op == NULL) return NULL;
+
+  op->setLeft(left);
+  op->setRight(right);
+
+  inverted = leftInverted;
+  return op;
+}
+
+// ============================================================================
+// [MathPresso::Optimizer - Common Subexpressions]
+// ============================================================================
+
+void Optimizer::doCommon(ASTElement* tree)
+{
+  // Without all assigned variables nothing can be shared safely.
+  if (!collectAssigned(tree)) return;
+
+  numberElement(&tree);
+  countUses(tree);
+}
+
+bool Optimizer::collectAssigned(ASTElement* element)
+{
+  if (element->getElementType() == MELEMENT_OPERATOR &&
+      reinterpret_cast<ASTOperator*>(element)->getOperatorType() == MOPERATOR_ASSIGN)
+  {
+    ASTVariable* var = reinterpret_cast<ASTVariable*>(reinterpret_cast<ASTOperator*>(element)->getLeft());
+    if (!_assigned.append(var->getOffset())) return false;
+  }
+
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
+
+  for (i = 0; i < len; i++)
+  {
+    if (!collectAssigned(children[i])) return false;
   }
+  return true;
+}
+
+uint Optimizer::numberElement(ASTElement** slot)
+{
+  ASTElement* element = *slot;
+
+  // Counted again by countUses() when the tree is final.
+  element->getUseCount() = 0;
+
+  // Key is the element type, its operator, function or transform, and value
+  // numbers of children (calls have up to 8 arguments, blocks are never
+  // shared).
+  uint32_t key[2 + sizeof(mreal_t) / sizeof(uint32_t) + sizeof(void*) / sizeof(uint32_t) + 8];
+  size_t length = 0;
+  bool shareable = true;
+
+  key[length++] = element->getElementType();
+
+  switch (element->getElementType())
+  {
+    case MELEMENT_BLOCK:
+      shareable = false;
+      break;
+
+    case MELEMENT_CONSTANT:
+    {
+      mreal_t value = reinterpret_cast<ASTConstant*>(element)->getValue();
+      memcpy(&key[length], &value, sizeof(mreal_t));
+      length += sizeof(mreal_t) / sizeof(uint32_t);
+      break;
+    }
+
+    case MELEMENT_VARIABLE:
+    {
+      // Value of an assigned variable depends on where it's read.
+      int offset = reinterpret_cast<ASTVariable*>(element)->getOffset();
+      if (_assigned.indexOf(offset) != MP_INVALID_INDEX) shareable = false;
+      key[length++] = (uint32_t)offset;
+      break;
+    }
+
+    case MELEMENT_OPERATOR:
+    {
+      uint op = reinterpret_cast<ASTOperator*>(element)->getOperatorType();
+      if (op == MOPERATOR_ASSIGN) shareable = false;
+      key[length++] = op;
+      break;
+    }
+
+    case MELEMENT_CALL:
+    {
+      // Only functions that can be evaluated at compile time have no side
+      // effects.
+      Function* fn = reinterpret_cast<ASTCall*>(element)->getFunction();
+      if ((fn->getPrototype() & MFUNC_EVAL) == 0) shareable = false;
+
+      void* ptr = fn->getPtr();
+      memcpy(&key[length], &ptr, sizeof(void*));
+      length += sizeof(void*) / sizeof(uint32_t);
+      break;
+    }
+
+    case MELEMENT_TRANSFORM:
+    {
+      ASTTransform* transform = reinterpret_cast<ASTTransform*>(element);
+      key[length++] = transform->getTransformType();
+      key[length++] = (uint32_t)transform->getExponent();
+      break;
+    }
+
+    case MELEMENT_CONDITION:
+      break;
+  }
+
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
+  size_t first = length;
+
+  for (i = 0; i < len; i++)
+  {
+    uint value = numberElement(&children[i]);
+    if (shareable) key[length++] = value;
+  }
+
+  // x + y, x * y, x == y and x != y are the same as y + x, y * x, y == x
+  // and y != x.
+  if (shareable && element->getElementType() == MELEMENT_OPERATOR)
+  {
+    uint op = reinterpret_cast<ASTOperator*>(element)->getOperatorType();
+    if ((op == MOPERATOR_PLUS || op == MOPERATOR_MUL || op == MOPERATOR_EQ || op == MOPERATOR_NE) &&
+        key[first] > key[first + 1])
+    {
+      uint32_t t = key[first];
+      key[first] = key[first + 1];
+      key[first + 1] = t;
+    }
+  }
+
+  if (shareable)
+  {
+    OptimizerValue* value = _values.get(reinterpret_cast<const char*>(key), length * sizeof(uint32_t));
+    if (value != NULL)
+    {
+      // Leaves are not worth sharing, they are loaded directly.
+      if (element->getChildrenCount() != 0)
+        *slot = value->element;
+      return value->number;
+    }
+
+    _values.put(reinterpret_cast<const char*>(key), length * sizeof(uint32_t),
+      OptimizerValue(_valueCount, element));
+  }
+
+  return _valueCount++;
+}
+
+void Optimizer::countUses(ASTElement* element)
+{
+  // Children of a shared element are counted only once.
+  if (element->getUseCount()++ != 0) return;
+
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
 
-  return NULL;
+  for (i = 0; i < len; i++) countUses(children[i]);
 }
 
 } // MathPresso namespace
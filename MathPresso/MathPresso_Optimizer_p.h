@@ -38,16 +38,88 @@ namespace MathPresso {
 
 //! @internal
 //!
-//! @brief Simplifies expression tree by evaluating constant nodes
+//! @brief Largest absolute value of an integer exponent replaced by
+//! multiplications, the error of x^n grows with n.
+enum { OPTIMIZER_MAX_POWI = 16 };
+
+//! @internal
+//!
+//! @brief Term of a flattened sum or product.
+struct OptimizerTerm
+{
+  inline OptimizerTerm(ASTElement* element, bool inverted) : element(element), inverted(inverted) {}
+
+  ASTElement* element;
+  //! @brief Whether the term is subtracted (sum) or divides (product).
+  bool inverted;
+};
+
+//! @internal
+//!
+//! @brief Chain of @c + and @c - or @c * and @c / operators flattened into
+//! terms, constants of the chain are folded into one.
+struct OptimizerChain
+{
+  inline OptimizerChain(bool product) :
+    product(product),
+    negated(false),
+    constant(product ? 1.0 : 0.0),
+    denominator(1.0)
+  {
+  }
+
+  //! @brief Whether the chain is a product (otherwise a sum).
+  bool product;
+  //! @brief Whether the product is negated (count of negations is odd).
+  bool negated;
+  //! @brief Sum of constant terms or product of constant factors.
+  mreal_t constant;
+  //! @brief Product of constant divisors.
+  mreal_t denominator;
+  //! @brief Terms that are not constant, in the order of evaluation.
+  Vector<OptimizerTerm, 16> terms;
+};
+
+//! @internal
+//!
+//! @brief Value found by common subexpression elimination.
+struct OptimizerValue
+{
+  inline OptimizerValue(uint number, ASTElement* element) : number(number), element(element) {}
+
+  uint number;
+  ASTElement* element;
+};
+
+//! @internal
+//!
+//! @brief Simplifies expression tree by evaluating constant nodes, folding
+//! constants of sums and products and merging common subexpressions.
+//!
+//! After optimization the tree can be a DAG, a common subexpression is one
+//! element referenced by more parents (see @ref ASTElement::getUseCount()).
 class Optimizer
 {
   WorkContext& _ctx;
 
+  //! @brief Value number and the first element of each shareable value,
+  //! keyed by the element type, its operator or function and value numbers
+  //! of its children.
+  Hash<OptimizerValue> _values;
+  //! @brief Count of value numbers.
+  uint _valueCount;
+  //! @brief Offsets of variables assigned by the expression.
+  Vector<int> _assigned;
+
 public:
   Optimizer(WorkContext& ctx);
   ~Optimizer();
 
-  inline void optimize(ASTElement* &element) { element = doNode(element); }
+  inline void optimize(ASTElement* &element)
+  {
+    element = doNode(element);
+    doCommon(element);
+  }
 
 protected:
   ASTElement* doNode(ASTElement* element);
@@ -55,8 +127,22 @@ protected:
   ASTElement* doOperator(ASTOperator* element);
   ASTElement* doCall(ASTCall* element);
   ASTElement* doTransform(ASTTransform* element);
+  ASTElement* doCondition(ASTCondition* element);
+  ASTElement* doPower(ASTElement* element, ASTElement* x, mreal_t exponent);
+
+  // Sums and products.
+
+  ASTElement* doChain(ASTOperator* element);
+  ASTElement* doOrdered(ASTOperator* element);
+  bool collectTerms(OptimizerChain& chain, ASTElement* element, bool inverted);
+  ASTElement* lowerTerms(const OptimizerTerm* terms, size_t count, bool product, bool& inverted);
+
+  // Common subexpressions.
 
-  ASTElement* findConstNode(ASTElement* element, int op);
+  void doCommon(ASTElement* tree);
+  bool collectAssigned(ASTElement* element);
+  uint numberElement(ASTElement** slot);
+  void countUses(ASTElement* element);
 };
 
 } // MathPresso namespace
@@ -0,0 +1,608 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// [Dependencies]
+#include "MathPresso.h"
+#include "MathPresso_Context_p.h"
+#include "MathPresso_Parallel_p.h"
+#include "MathPresso_Util_p.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace MathPresso {
+
+// ============================================================================
+// [MathPresso::Parallel - Helpers]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Bytes of input and output touched by one chunk, so the chunk fits
+//! into the L2 cache together with the data of the other hyper-thread.
+enum { MP_PARALLEL_CHUNK_BYTES = 64 * 1024 };
+
+//! @internal
+//!
+//! @brief Minimum count of rows in one chunk.
+enum { MP_PARALLEL_MIN_ROWS = 64 };
+
+//! @internal
+//!
+//! @brief Maximum count of threads of @ref Context::compileMany().
+enum { MP_COMPILE_MANY_MAX_THREADS = 64 };
+
+static size_t mpGetChunkRows(size_t count, size_t rowBytes, uint threadCount)
+{
+  size_t rows = MP_PARALLEL_CHUNK_BYTES / (rowBytes != 0 ? rowBytes : 1);
+
+  // Few chunks per thread at least, so there is something to steal when
+  // some thread is slower than the others.
+  size_t balanced = count / ((size_t)threadCount * 4);
+  if (rows > balanced) rows = balanced;
+  if (rows < MP_PARALLEL_MIN_ROWS) rows = MP_PARALLEL_MIN_ROWS;
+
+  // Multiple of 4 rows, packed loops of the column function have no tail
+  // except in the last chunk.
+  return (rows + 3) & ~(size_t)3;
+}
+
+static void mpPinThread(uint index)
+{
+  uint cpuCount = std::thread::hardware_concurrency();
+  uint cpu = (cpuCount != 0) ? index % cpuCount : index;
+
+#if defined(_WIN32)
+  SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % CPU_SETSIZE, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  // Pinning is not supported, threads are scheduled by the OS.
+  (void)cpu;
+#endif
+}
+
+// ============================================================================
+// [MathPresso::ParallelPool - Construction / Destruction]
+// ============================================================================
+
+ParallelPool::ParallelPool(uint threadCount, int flags) :
+  workers(NULL),
+  workerCount(0),
+  queues(NULL),
+  flags(flags),
+  job(NULL),
+  generation(0),
+  running(0),
+  quit(false)
+{
+  if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+  if (threadCount <= 1) return;
+
+  queues = new(std::nothrow) ParallelQueue[threadCount];
+  if (queues == NULL) return;
+
+  workers = new(std::nothrow) std::thread[threadCount - 1];
+  if (workers == NULL) return;
+
+  // Thread creation reports failure by an exception, continue with threads
+  // created so far, the calling thread's queue is always after the last one.
+  try {
+    for (uint i = 0; i < threadCount - 1; i++)
+    {
+      workers[i] = std::thread(&ParallelPool::work, this, i);
+      workerCount++;
+    }
+  } catch (...) {
+  }
+}
+
+ParallelPool::~ParallelPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_all();
+
+  for (uint i = 0; i < workerCount; i++) workers[i].join();
+
+  delete[] workers;
+  delete[] queues;
+}
+
+// ============================================================================
+// [MathPresso::ParallelPool - Run]
+// ============================================================================
+
+void ParallelPool::run(ParallelJob* job)
+{
+  std::lock_guard<std::mutex> runGuard(runLock);
+
+  size_t i, chunkCount = job->chunkCount;
+  if (workerCount == 0 || chunkCount < 2)
+  {
+    for (i = 0; i < chunkCount; i++) job->run(i);
+    return;
+  }
+
+  // Each thread starts with a continuous range of chunks.
+  uint threadCount = workerCount + 1;
+  for (i = 0; i < threadCount; i++)
+  {
+    std::lock_guard<std::mutex> guard(queues[i].lock);
+    queues[i].begin = chunkCount * i / threadCount;
+    queues[i].end = chunkCount * (i + 1) / threadCount;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    this->job = job;
+    running = workerCount;
+    generation++;
+  }
+  wake.notify_all();
+
+  process(job, workerCount);
+
+  // Chunks can be still running by workers that stole them.
+  std::unique_lock<std::mutex> guard(lock);
+  while (running != 0) done.wait(guard);
+  this->job = NULL;
+}
+
+void ParallelPool::work(uint index)
+{
+  if (flags & MPARALLEL_PIN_THREADS) mpPinThread(index);
+
+  size_t seen = 0;
+  for (;;)
+  {
+    ParallelJob* current;
+
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      while (!quit && generation == seen) wake.wait(guard);
+      if (quit) return;
+
+      seen = generation;
+      current = job;
+    }
+
+    process(current, index);
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (--running == 0) done.notify_one();
+    }
+  }
+}
+
+void ParallelPool::process(ParallelJob* job, uint index)
+{
+  size_t chunk;
+  while (pop(index, &chunk) || steal(index, &chunk)) job->run(chunk);
+}
+
+bool ParallelPool::pop(uint index, size_t* chunk)
+{
+  ParallelQueue& queue = queues[index];
+  std::lock_guard<std::mutex> guard(queue.lock);
+
+  if (queue.begin == queue.end) return false;
+  *chunk = queue.begin++;
+  return true;
+}
+
+bool ParallelPool::steal(uint index, size_t* chunk)
+{
+  uint threadCount = workerCount + 1;
+
+  for (uint i = 1; i < threadCount; i++)
+  {
+    ParallelQueue& victim = queues[(index + i) % threadCount];
+    size_t first, last;
+
+    {
+      std::lock_guard<std::mutex> guard(victim.lock);
+      size_t remaining = victim.end - victim.begin;
+      if (remaining == 0) continue;
+
+      // Take the back half, the owner continues from the front.
+      last = victim.end;
+      first = last - (remaining + 1) / 2;
+      victim.end = first;
+    }
+
+    // The first stolen chunk is returned, the rest can be stolen again.
+    *chunk = first;
+    if (first + 1 < last)
+    {
+      ParallelQueue& queue = queues[index];
+      std::lock_guard<std::mutex> guard(queue.lock);
+      queue.begin = first + 1;
+      queue.end = last;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+// ============================================================================
+// [MathPresso::ParallelJob - Batch]
+// ============================================================================
+
+struct MATHPRESSO_HIDDEN ParallelBatchJob : public ParallelJob
+{
+  inline ParallelBatchJob(MEvalFunc fn, const void* priv, void* rows, size_t stride, mreal_t* out, size_t count, size_t chunkRows) :
+    ParallelJob((count + chunkRows - 1) / chunkRows),
+    fn(fn),
+    priv(priv),
+    rows(reinterpret_cast<char*>(rows)),
+    stride(stride),
+    out(out),
+    count(count),
+    chunkRows(chunkRows)
+  {
+  }
+
+  virtual void run(size_t index)
+  {
+    size_t start = index * chunkRows;
+    size_t n = count - start;
+    if (n > chunkRows) n = chunkRows;
+
+    fn(priv, out + start, rows + start * stride, stride, n);
+  }
+
+  MEvalFunc fn;
+  const void* priv;
+  char* rows;
+  size_t stride;
+  mreal_t* out;
+  size_t count;
+  size_t chunkRows;
+};
+
+// ============================================================================
+// [MathPresso::ParallelJob - Columns]
+// ============================================================================
+
+struct MATHPRESSO_HIDDEN ParallelColumnsJob : public ParallelJob
+{
+  inline ParallelColumnsJob(MEvalColumnsFunc fn, const ExpressionPrivate* p, const void* const* columns, void* out, size_t count, size_t chunkRows) :
+    ParallelJob((count + chunkRows - 1) / chunkRows),
+    fn(fn),
+    p(p),
+    columns(columns),
+    out(reinterpret_cast<char*>(out)),
+    count(count),
+    chunkRows(chunkRows),
+    valueSize(p->getValueSize())
+  {
+  }
+
+  virtual void run(size_t index)
+  {
+    size_t start = index * chunkRows;
+    size_t n = count - start;
+    if (n > chunkRows) n = chunkRows;
+
+    size_t k, columnCount = p->columnCount;
+    const void* buffer[32];
+    const void** chunkColumns = buffer;
+
+    if (columnCount > 32)
+    {
+      chunkColumns = reinterpret_cast<const void**>(::malloc(columnCount * sizeof(void*)));
+      if (chunkColumns == NULL)
+      {
+        memset(out + start * valueSize, 0, n * valueSize);
+        return;
+      }
+    }
+
+    for (k = 0; k < columnCount; k++)
+    {
+      const char* column = reinterpret_cast<const char*>(columns[k]);
+      chunkColumns[k] = column ? column + start * valueSize : NULL;
+    }
+
+    fn(p, out + start * valueSize, chunkColumns, n);
+    if (chunkColumns != buffer) ::free(chunkColumns);
+  }
+
+  MEvalColumnsFunc fn;
+  const ExpressionPrivate* p;
+  const void* const* columns;
+  char* out;
+  size_t count;
+  size_t chunkRows;
+  size_t valueSize;
+};
+
+// ============================================================================
+// [MathPresso::ParallelEvaluator - Construction / Destruction]
+// ============================================================================
+
+ParallelEvaluator::ParallelEvaluator(unsigned int threadCount, int flags)
+{
+  _privateData = new(std::nothrow) ParallelPool(threadCount, flags);
+}
+
+ParallelEvaluator::~ParallelEvaluator()
+{
+  if (_privateData) delete reinterpret_cast<ParallelPool*>(_privateData);
+}
+
+// ============================================================================
+// [MathPresso::ParallelEvaluator - Methods]
+// ============================================================================
+
+unsigned int ParallelEvaluator::getThreadCount() const
+{
+  ParallelPool* pool = reinterpret_cast<ParallelPool*>(_privateData);
+  return pool ? pool->getThreadCount() : 1;
+}
+
+void ParallelEvaluator::evaluateBatch(const Expression& e, void* rows, size_t stride, mreal_t* out, size_t count)
+{
+  ParallelPool* pool = reinterpret_cast<ParallelPool*>(_privateData);
+  const ExpressionPrivate* p = reinterpret_cast<const ExpressionPrivate*>(e._privateData);
+
+  // Expression that assigns writes to its row, rows of different threads
+  // must not overlap.
+  if (pool == NULL || p == NULL || p->ast == NULL ||
+      (p->hasAssignment && stride < p->columnCount * p->getValueSize()))
+  {
+    e.evaluateBatch(rows, stride, out, count);
+    return;
+  }
+
+  size_t chunkRows = mpGetChunkRows(count, stride + sizeof(mreal_t), pool->getThreadCount());
+  ParallelBatchJob job(e._evaluate, p, rows, stride, out, count, chunkRows);
+  pool->run(&job);
+}
+
+void ParallelEvaluator::evaluateColumns(const Expression& e, const mreal_t* const* columns, mreal_t* out, size_t count)
+{
+  ParallelPool* pool = reinterpret_cast<ParallelPool*>(_privateData);
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(e._privateData);
+
+  if (pool == NULL || p == NULL || p->ast == NULL || p->getValueSize() != sizeof(mreal_t))
+  {
+    e.evaluateColumns(columns, out, count);
+    return;
+  }
+
+  // Compile the column function once, before it's used by more threads.
+  size_t chunkRows = mpGetChunkRows(count, (p->columnCount + 1) * sizeof(mreal_t), pool->getThreadCount());
+  ParallelColumnsJob job(mpGetColumnsFunction(p), p, reinterpret_cast<const void* const*>(columns), out, count, chunkRows);
+  pool->run(&job);
+}
+
+void ParallelEvaluator::evaluateColumns(const Expression& e, const float* const* columns, float* out, size_t count)
+{
+  ParallelPool* pool = reinterpret_cast<ParallelPool*>(_privateData);
+  ExpressionPrivate* p = reinterpret_cast<ExpressionPrivate*>(e._privateData);
+
+  if (pool == NULL || p == NULL || p->ast == NULL || p->getValueSize() != sizeof(float))
+  {
+    e.evaluateColumns(columns, out, count);
+    return;
+  }
+
+  // Compile the column function once, before it's used by more threads.
+  size_t chunkRows = mpGetChunkRows(count, (p->columnCount + 1) * sizeof(float), pool->getThreadCount());
+  ParallelColumnsJob job(mpGetColumnsFunction(p), p, reinterpret_cast<const void* const*>(columns), out, count, chunkRows);
+  pool->run(&job);
+}
+
+// ============================================================================
+// [MathPresso::Context - Compile Many]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Expressions created by @ref Context::compileMany(), shared by all
+//! of its threads.
+struct MATHPRESSO_HIDDEN CompileManyJob
+{
+  inline CompileManyJob(const Context& ctx, const char* const* sources, size_t count, Expression* out, int options) :
+    ctx(ctx), sources(sources), count(count), out(out), options(options)
+  {
+    next.init(0);
+  }
+
+  //! @brief Create expressions until all are taken, store index and result
+  //! of the first one that failed to @c failed[thread] and
+  //! @c results[thread].
+  void work(uint thread);
+
+  //! @brief Context of all expressions.
+  const Context& ctx;
+  const char* const* sources;
+  size_t count;
+  Expression* out;
+  int options;
+
+  //! @brief Count of expressions taken so far.
+  Atomic next;
+
+  //! @brief Index of the first expression that failed, per thread.
+  size_t* failed;
+  //! @brief Result of the first expression that failed, per thread.
+  mresult_t* results;
+};
+
+void CompileManyJob::work(uint thread)
+{
+  failed[thread] = count;
+  results[thread] = MRESULT_OK;
+
+  for (;;)
+  {
+    size_t i = next.inc() - 1;
+    if (i >= count) break;
+
+    // Each thread has its own executable memory.
+    mresult_t result = out[i]._create(ctx, sources[i], options, NULL, false, thread + 1);
+    if (result != MRESULT_OK && i < failed[thread])
+    {
+      failed[thread] = i;
+      results[thread] = result;
+    }
+  }
+}
+
+mresult_t Context::compileMany(const char* const* sources, size_t count, Expression* out, int options, uint threadCount) const
+{
+  if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+  if (threadCount > count) threadCount = (uint)count;
+  if (threadCount == 0) threadCount = 1;
+
+  size_t failed[MP_COMPILE_MANY_MAX_THREADS];
+  mresult_t results[MP_COMPILE_MANY_MAX_THREADS];
+  if (threadCount > MP_COMPILE_MANY_MAX_THREADS) threadCount = MP_COMPILE_MANY_MAX_THREADS;
+
+  CompileManyJob job(*this, sources, count, out, options);
+  job.failed = failed;
+  job.results = results;
+
+  std::thread workers[MP_COMPILE_MANY_MAX_THREADS - 1];
+  uint workerCount = 0;
+
+  // Thread creation reports failure by an exception, continue with threads
+  // created so far.
+  try {
+    for (uint i = 1; i < threadCount; i++)
+    {
+      workers[i - 1] = std::thread(&CompileManyJob::work, &job, i);
+      workerCount++;
+    }
+  } catch (...) {
+  }
+
+  job.work(0);
+
+  size_t first = failed[0];
+  mresult_t result = results[0];
+
+  for (uint i = 0; i < workerCount; i++)
+  {
+    workers[i].join();
+    if (failed[i + 1] < first)
+    {
+      first = failed[i + 1];
+      result = results[i + 1];
+    }
+  }
+
+  return result;
+}
+
+// ============================================================================
+// [MathPresso::AsyncCompiler]
+// ============================================================================
+
+bool AsyncCompiler::post(ExpressionPrivate* p)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+
+    // Thread creation and queue growth report failure by an exception, the
+    // caller compiles the expression itself then.
+    try {
+      if (!started)
+      {
+        std::thread(&AsyncCompiler::work, this).detach();
+        started = true;
+      }
+      queue.push_back(p);
+    } catch (...) {
+      return false;
+    }
+
+    p->refCount.inc();
+  }
+
+  wake.notify_one();
+  return true;
+}
+
+void AsyncCompiler::wait(ExpressionPrivate* p)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while (running == p || std::find(queue.begin(), queue.end(), p) != queue.end())
+    done.wait(guard);
+}
+
+void AsyncCompiler::work()
+{
+  for (;;)
+  {
+    ExpressionPrivate* p;
+
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      while (queue.empty()) wake.wait(guard);
+
+      p = queue.front();
+      queue.pop_front();
+      running = p;
+    }
+
+    mpCompileDeferred(p);
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      running = NULL;
+    }
+    done.notify_all();
+
+    // The expression can be freed by its owner while it's compiled.
+    mpReleaseExpression(p);
+  }
+}
+
+AsyncCompiler* mpGetAsyncCompiler()
+{
+  // Never destroyed, the detached thread can be still compiling when the
+  // process exits.
+  static AsyncCompiler* compiler = new(std::nothrow) AsyncCompiler();
+  return compiler;
+}
+
+} // MathPresso namespace
@@ -0,0 +1,179 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _MATHPRESSO_PARALLEL_P_H
+#define _MATHPRESSO_PARALLEL_P_H
+
+#include "MathPresso.h"
+#include "MathPresso_Util_p.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace MathPresso {
+
+struct ExpressionPrivate;
+
+// ============================================================================
+// [MathPresso::ParallelJob]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Work split into chunks that can be run in any order by any thread.
+struct MATHPRESSO_HIDDEN ParallelJob
+{
+  inline ParallelJob(size_t chunkCount) : chunkCount(chunkCount) {}
+  virtual ~ParallelJob() {}
+
+  //! @brief Run chunk at @a index.
+  virtual void run(size_t index) = 0;
+
+  //! @brief Count of chunks.
+  size_t chunkCount;
+};
+
+// ============================================================================
+// [MathPresso::ParallelQueue]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Chunks owned by one thread, a range of chunk indexes.
+//!
+//! The owner takes chunks from the front, other threads steal them from the
+//! back.
+struct MATHPRESSO_HIDDEN ParallelQueue
+{
+  inline ParallelQueue() : begin(0), end(0) {}
+
+  std::mutex lock;
+  size_t begin;
+  size_t end;
+
+  // Keep queues of different threads in different cache lines.
+  char padding[64];
+};
+
+// ============================================================================
+// [MathPresso::ParallelPool]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Pool of threads that run @ref ParallelJob instances.
+struct MATHPRESSO_HIDDEN ParallelPool
+{
+  ParallelPool(uint threadCount, int flags);
+  ~ParallelPool();
+
+  //! @brief Get count of threads including the calling one.
+  inline uint getThreadCount() const { return workerCount + 1; }
+
+  //! @brief Run all chunks of @a job and wait until they are done.
+  void run(ParallelJob* job);
+
+  void work(uint index);
+  void process(ParallelJob* job, uint index);
+  bool pop(uint index, size_t* chunk);
+  bool steal(uint index, size_t* chunk);
+
+  //! @brief Worker threads.
+  std::thread* workers;
+  //! @brief Count of worker threads (without the calling one).
+  uint workerCount;
+  //! @brief Queues, one per worker and the last one for the calling thread.
+  ParallelQueue* queues;
+  //! @brief Options, see @ref MPARALLEL.
+  int flags;
+
+  //! @brief Serializes calls to @ref run().
+  std::mutex runLock;
+
+  //! @brief Protects the members below.
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+
+  //! @brief Job being run.
+  ParallelJob* job;
+  //! @brief Incremented for each job, workers wait until it changes.
+  size_t generation;
+  //! @brief Count of workers that haven't finished the current job.
+  uint running;
+  //! @brief Set by the destructor to stop workers.
+  bool quit;
+
+private:
+  MP_DISABLE_COPY(ParallelPool)
+};
+
+// ============================================================================
+// [MathPresso::AsyncCompiler]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Thread that compiles expressions created by
+//! @ref Expression::createAsync(), one at a time in the order of creation.
+struct MATHPRESSO_HIDDEN AsyncCompiler
+{
+  inline AsyncCompiler() : running(NULL), started(false) {}
+
+  //! @brief Compile @a p by the thread, return false if the thread can't be
+  //! started.
+  bool post(ExpressionPrivate* p);
+  //! @brief Wait until @a p is compiled.
+  void wait(ExpressionPrivate* p);
+
+  void work();
+
+  //! @brief Protects the members below.
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+
+  //! @brief Expressions waiting for the thread, each is referenced.
+  std::deque<ExpressionPrivate*> queue;
+  //! @brief Expression being compiled.
+  ExpressionPrivate* running;
+  //! @brief Whether the thread was started.
+  bool started;
+
+private:
+  MP_DISABLE_COPY(AsyncCompiler)
+};
+
+//! @internal
+//!
+//! @brief Get the compiler used by all expressions, NULL if there is not
+//! enough memory.
+MATHPRESSO_HIDDEN AsyncCompiler* mpGetAsyncCompiler();
+
+} // MathPresso namespace
+
+#endif // _MATHPRESSO_PARALLEL_P_H
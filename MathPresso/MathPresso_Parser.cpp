@@ -64,12 +64,20 @@ static const OperatorInfo mpOperatorInfo[] =
   { 15, LeftAssoc  }, // MOPERATOR_DIV
   { 15, LeftAssoc  }, // MOPERATOR_MOD
   { 20, RightAssoc }, // MOPERATOR_POW
-  { 25, RightAssoc }  // MOPERATOR_UMINUS
+  { 25, RightAssoc }, // MOPERATOR_UMINUS
+  { 7,  LeftAssoc  }, // MOPERATOR_EQ
+  { 7,  LeftAssoc  }, // MOPERATOR_NE
+  { 8,  LeftAssoc  }, // MOPERATOR_LT
+  { 8,  LeftAssoc  }, // MOPERATOR_LE
+  { 8,  LeftAssoc  }, // MOPERATOR_GT
+  { 8,  LeftAssoc  }, // MOPERATOR_GE
+  { 6,  RightAssoc }  // MOPERATOR_CONDITION
 };
 
 ExpressionParser::ExpressionParser(WorkContext& ctx, const char* input, size_t length) :
   _ctx(ctx),
-  _tokenizer(input, length)
+  _tokenizer(input, length),
+  _conditionDepth(0)
 {
 }
 
@@ -84,7 +92,9 @@ mresult_t ExpressionParser::parse(ASTElement** dst)
 
 mresult_t ExpressionParser::parseTree(ASTElement** dst)
 {
-  Vector<ASTElement*> elements;
+  // Most expressions have only a few statements, they are copied to the
+  // zone when the block is created.
+  Vector<ASTElement*, 16> elements;
   mresult_t result = MRESULT_OK;
 
   for (;;)
@@ -92,7 +102,11 @@ mresult_t ExpressionParser::parseTree(ASTElement** dst)
     ASTElement* ast = NULL;
     if ((result = parseExpression(&ast, NULL, 0, false)) != MRESULT_OK)
       goto failed;
-    if (ast) elements.append(ast);
+    if (ast && !elements.append(ast))
+    {
+      result = MRESULT_NO_MEMORY;
+      goto failed;
+    }
 
     MP_ASSERT(_last.tokenType != MTOKEN_ERROR);
     switch (_last.tokenType)
@@ -101,6 +115,7 @@ mresult_t ExpressionParser::parseTree(ASTElement** dst)
         goto finished;
       case MTOKEN_COMMA:
       case MTOKEN_RPAREN:
+      case MTOKEN_COLON:
         result = MRESULT_UNEXPECTED_TOKEN;
         goto failed;
       case MTOKEN_SEMICOLON:
@@ -122,15 +137,16 @@ finished:
   }
   else
   {
-    ASTBlock* block = new ASTBlock(_ctx.genId());
-    block->getChildrenVector().swap(elements);
+    ASTBlock* block = new(_ctx.getZone()) ASTBlock(_ctx.genId());
+    if (block == NULL || !block->setElements(_ctx.getZone(), elements.getData(), elements.getLength()))
+      return MRESULT_NO_MEMORY;
 
     *dst = block;
     return MRESULT_OK;
   }
 
 failed:
-  for (size_t i = 0; i < elements.getLength(); i++) delete elements[i];
+  // Parsed elements are freed with the zone.
   return result;
 }
 
@@ -197,7 +213,7 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
           goto failure;
         }
 
-        right = new ASTConstant(_ctx.genId(), token.f);
+        right = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(token.f));
         break;
       // ----------------------------------------------------------------------
 
@@ -226,6 +242,7 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
 
       // ----------------------------------------------------------------------
       case MTOKEN_RPAREN:
+      case MTOKEN_COLON:
         if (op != MOPERATOR_NONE)
         {
           result = MRESULT_UNEXPECTED_TOKEN;
@@ -262,6 +279,13 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
             result = MRESULT_ASSIGNMENT_TO_NON_VARIABLE;
             goto failure;
           }
+
+          // Both branches of a condition are evaluated by compiled code.
+          if (_conditionDepth != 0)
+          {
+            result = MRESULT_ASSIGNMENT_INSIDE_EXPRESSION;
+            goto failure;
+          }
         }
 
         if (op != MOPERATOR_NONE || left == NULL)
@@ -283,7 +307,13 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
               goto failure;
             }
 
-            ASTTransform* transform = new ASTTransform(_ctx.genId());
+            ASTTransform* transform = new(_ctx.getZone()) ASTTransform(_ctx.genId());
+            if (transform == NULL)
+            {
+              result = MRESULT_NO_MEMORY;
+              goto failure;
+            }
+
             transform->setTransformType(MTRANSFORM_NEGATE);
             transform->setChild(right);
             right = transform;
@@ -301,6 +331,48 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
           *dst = left;
           return MRESULT_OK;
         }
+
+        if (op == MOPERATOR_CONDITION)
+        {
+          // c ? a : b, the first branch ends by colon, the second one by an
+          // operator of lower priority.
+          ASTElement* branches[2] = { NULL, NULL };
+
+          _conditionDepth++;
+          result = parseExpression(&branches[0], NULL, 0, true);
+          if (result == MRESULT_OK)
+          {
+            _tokenizer.next(&token);
+            if (token.tokenType != MTOKEN_COLON)
+              result = MRESULT_UNEXPECTED_TOKEN;
+            else
+              result = parseExpression(&branches[1], NULL, mpOperatorInfo[MOPERATOR_CONDITION].priority, true);
+          }
+          _conditionDepth--;
+
+          if (result != MRESULT_OK)
+            goto failure;
+
+          if (branches[0] == NULL || branches[1] == NULL)
+          {
+            result = MRESULT_EXPRESSION_EXPECTED;
+            goto failure;
+          }
+
+          ASTCondition* condition = new(_ctx.getZone()) ASTCondition(_ctx.genId());
+          if (condition == NULL)
+          {
+            result = MRESULT_NO_MEMORY;
+            goto failure;
+          }
+
+          condition->setCondition(left);
+          condition->setThen(branches[0]);
+          condition->setElse(branches[1]);
+
+          left = condition;
+          op = MOPERATOR_NONE;
+        }
         continue;
       // ----------------------------------------------------------------------
 
@@ -323,7 +395,7 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
         // Parse function
         if (isFunction)
         {
-          Function* function = _ctx._ctx->functions.get(symbolName, symbolLength);
+          Function* function = _ctx._ctx->findFunction(symbolName, symbolLength, token.hash);
           if (function == NULL)
           {
             result = MRESULT_INVALID_FUNCTION;
@@ -333,7 +405,8 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
           // Parse LPAREN token again
           _tokenizer.next(&ttoken);
 
-          Vector<ASTElement*> arguments;
+          // Functions have at most 8 arguments, they fit into the vector.
+          Vector<ASTElement*, 8> arguments;
 
           // Parse function arguments
           int numArgs = function->getArgumentsCount();
@@ -344,7 +417,6 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
 
             if (ttoken.tokenType == MTOKEN_ERROR)
             {
-              mpDeleteAll(arguments);
               result = MRESULT_INVALID_TOKEN;
               goto failure;
             }
@@ -354,7 +426,6 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
             {
               if (n == numArgs) break;
 
-              mpDeleteAll(arguments);
               result = MRESULT_NOT_ENOUGH_ARGUMENTS;
               goto failure;
             }
@@ -366,14 +437,12 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
               {
                 if (n >= numArgs)
                 {
-                  mpDeleteAll(arguments);
                   result = MRESULT_TOO_MANY_ARGUMENTS;
                   goto failure;
                 }
               }
               else
               {
-                mpDeleteAll(arguments);
                 result = MRESULT_UNEXPECTED_TOKEN;
                 goto failure;
               }
@@ -387,22 +456,29 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
             ASTElement* arg;
             if ((result = parseExpression(&arg, NULL, 0, true)) != MRESULT_OK)
             {
-              mpDeleteAll(arguments);
               goto failure;
             }
 
-            arguments.append(arg);
+            if (!arguments.append(arg))
+            {
+              result = MRESULT_NO_MEMORY;
+              goto failure;
+            }
           }
 
           // Done
-          ASTCall* call = new ASTCall(_ctx.genId(), function);
-          call->swapArguments(arguments);
+          ASTCall* call = new(_ctx.getZone()) ASTCall(_ctx.genId(), function);
+          if (call == NULL || !call->setArguments(_ctx.getZone(), arguments.getData(), arguments.getLength()))
+          {
+            result = MRESULT_NO_MEMORY;
+            goto failure;
+          }
           right = call;
         }
         else
         // Parse variable
         {
-          Variable* var = _ctx._ctx->variables.get(symbolName, symbolLength);
+          Variable* var = _ctx._ctx->findVariable(symbolName, symbolLength, token.hash);
           if (var == NULL)
           {
             result = MRESULT_INVALID_SYMBOL;
@@ -410,9 +486,9 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
           }
 
           if (var->type == MVARIABLE_CONSTANT)
-            right = new ASTConstant(_ctx.genId(), var->c.value);
+            right = new(_ctx.getZone()) ASTConstant(_ctx.genId(), _ctx.toPrecision(var->c.value));
           else
-            right = new ASTVariable(_ctx.genId(), var);
+            right = new(_ctx.getZone()) ASTVariable(_ctx.genId(), var, _ctx.isFloat32());
         }
 
         break;
@@ -425,7 +501,11 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
       // ----------------------------------------------------------------------
     }
 
-	MP_ASSERT(right != NULL);
+    if (right == NULL)
+    {
+      result = MRESULT_NO_MEMORY;
+      goto failure;
+    }
 
     if (left)
     {
@@ -444,7 +524,13 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
       }
 
       MP_ASSERT(op != MOPERATOR_NONE);
-      ASTOperator* parent = new ASTOperator(_ctx.genId(), op);
+      ASTOperator* parent = new(_ctx.getZone()) ASTOperator(_ctx.genId(), op);
+      if (parent == NULL)
+      {
+        result = MRESULT_NO_MEMORY;
+        goto failure;
+      }
+
       parent->setLeft(left);
       parent->setRight(right);
 
@@ -460,9 +546,7 @@ mresult_t ExpressionParser::parseExpression(ASTElement** dst,
   }
 
 failure:
-  if (left) delete left;
-  if (right) delete right;
-
+  // Parsed elements are freed with the zone.
   *dst = NULL;
   return result;
 }
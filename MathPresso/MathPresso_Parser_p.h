@@ -67,6 +67,9 @@ protected:
 
   Tokenizer _tokenizer;
   Token _last;
+
+  //! @brief Count of branches of @c ?: being parsed.
+  int _conditionDepth;
 };
 
 } // MathPresso namespace
@@ -125,16 +125,21 @@ uint Tokenizer::next(Token* dst)
   // Parse symbol
   else if (mpIsAlpha(uc) || uc == '_')
   {
+    // Hash is computed here so the parser doesn't read the name again.
+    unsigned int hash = mpUpdateHash(MP_SYMBOL_HASH_INIT, uc);
+
     while (++cur != end)
     {
       uc = *cur;
       if (!(mpIsAlnum(uc) || uc == '_')) break;
+      hash = mpUpdateHash(hash, uc);
     }
 
     dst->pos = (size_t)(first - beg);
     dst->len = (size_t)(cur - first);
 
     dst->tokenType = MTOKEN_SYMBOL;
+    dst->hash = hash;
     return MTOKEN_SYMBOL;
   }
 
@@ -146,12 +151,30 @@ uint Tokenizer::next(Token* dst)
     dst->pos = (size_t)(first - beg);
     dst->len = (size_t)(cur - first);
 
+    // Comparisons ==, !=, <= and >=.
+    if (cur != end && *cur == '=' && (uc == '=' || uc == '!' || uc == '<' || uc == '>'))
+    {
+      cur++;
+      dst->len = 2;
+      dst->tokenType = MTOKEN_OPERATOR;
+
+      switch (uc)
+      {
+        case '=': dst->operatorType = MOPERATOR_EQ; break;
+        case '!': dst->operatorType = MOPERATOR_NE; break;
+        case '<': dst->operatorType = MOPERATOR_LE; break;
+        case '>': dst->operatorType = MOPERATOR_GE; break;
+      }
+      return MTOKEN_OPERATOR;
+    }
+
     switch (uc)
     {
       case ',': dst->tokenType = MTOKEN_COMMA; break;
       case '(': dst->tokenType = MTOKEN_LPAREN; break;
       case ')': dst->tokenType = MTOKEN_RPAREN; break;
       case ';': dst->tokenType = MTOKEN_SEMICOLON; break;
+      case ':': dst->tokenType = MTOKEN_COLON; break;
       case '=': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_ASSIGN; break;
       case '+': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_PLUS; break;
       case '-': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_MINUS; break;
@@ -159,6 +182,9 @@ uint Tokenizer::next(Token* dst)
       case '/': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_DIV; break;
       case '%': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_MOD; break;
       case '^': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_POW; break;
+      case '<': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_LT; break;
+      case '>': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_GT; break;
+      case '?': dst->tokenType = MTOKEN_OPERATOR; dst->operatorType = MOPERATOR_CONDITION; break;
       default : dst->tokenType = MTOKEN_ERROR; break;
     }
 
@@ -47,6 +47,7 @@ enum MTOKEN_TYPE
   MTOKEN_COMMA,
   MTOKEN_LPAREN,
   MTOKEN_RPAREN,
+  MTOKEN_COLON,
   MTOKEN_OPERATOR,
   MTOKEN_SEMICOLON,
   MTOKEN_SYMBOL
@@ -70,6 +71,8 @@ struct Token
   {
     int operatorType;
     mreal_t f;
+    // Hash of symbol, the same as mpGetHash() of its name.
+    unsigned int hash;
   };
 };
 
@@ -213,36 +213,74 @@ bool StringBuilder::_reserve(size_t s)
 }
 
 // ============================================================================
-// [MathPresso::Hash<T>]
+// [MathPresso::Zone]
 // ============================================================================
 
-static const int mpPrimeTable[] = {
-  23, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593,
-  49157, 98317, 196613, 393241, 786433, 1572869, 3145739
-};
+Zone::Zone(size_t chunkSize) :
+  _chunks(NULL),
+  _chunkSize(chunkSize)
+{
+}
 
-int mpGetPrime(int x)
+Zone::~Zone()
 {
-  int prime = 0;
+  reset();
+}
 
-  for (int i = 0; i < sizeof(mpPrimeTable) / sizeof(mpPrimeTable[0]); i++)
+void Zone::reset()
+{
+  Chunk* cur = _chunks;
+  while (cur)
   {
-    prime = mpPrimeTable[0];
-    if (prime > x) break;
+    Chunk* prev = cur->prev;
+    ::free(cur);
+    cur = prev;
   }
-  return prime;
+  _chunks = NULL;
 }
 
+void Zone::swap(Zone& other)
+{
+  Chunk* chunks = _chunks;
+  size_t chunkSize = _chunkSize;
+
+  _chunks = other._chunks;
+  _chunkSize = other._chunkSize;
+
+  other._chunks = chunks;
+  other._chunkSize = chunkSize;
+}
+
+void* Zone::_alloc(size_t size)
+{
+  size_t chunkSize = _chunkSize;
+  if (chunkSize < size) chunkSize = size;
+
+  Chunk* chunk = reinterpret_cast<Chunk*>(::malloc(MP_ZONE_HEADER_SIZE + chunkSize));
+  if (chunk == NULL) return NULL;
+
+  chunk->prev = _chunks;
+  chunk->pos = size;
+  chunk->size = chunkSize;
+  _chunks = chunk;
+
+  // Larger expressions need less chunks.
+  if (_chunkSize < 16384) _chunkSize *= 2;
+
+  return chunk->getData();
+}
+
+// ============================================================================
+// [MathPresso::Hash<T>]
+// ============================================================================
+
 unsigned int mpGetHash(const char* _key, size_t klen)
 {
   const unsigned char* key = reinterpret_cast<const unsigned char*>(_key);
-  unsigned int hash = 0x12345678;
-  if (!klen) return 0;
+  unsigned int hash = MP_SYMBOL_HASH_INIT;
 
-  do {
-    unsigned int c = *key++;
-    hash ^= ((hash << 5) + (hash >> 2) + c);
-  } while (--klen);
+  while (klen--)
+    hash = mpUpdateHash(hash, *key++);
 
   return hash;
 }
@@ -36,6 +36,11 @@
 
 #include <new>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MP_HASH_SSE2
+#include <emmintrin.h>
+#endif
+
 #if defined(_MSC_VER)
 #include <windows.h>
 #endif // _MSC_VER
@@ -50,6 +55,12 @@ typedef unsigned int uint;
 
 #define MP_INVALID_INDEX ((size_t)-1)
 
+// ============================================================================
+// [MP_ARRAY_SIZE]
+// ============================================================================
+
+#define MP_ARRAY_SIZE(__array__) ((uint)(sizeof(__array__) / sizeof((__array__)[0])))
+
 // ============================================================================
 // [MP_DISABLE_COPY]
 // ============================================================================
@@ -89,16 +100,33 @@ struct MATHPRESSO_HIDDEN Atomic
   inline void init(size_t val) { _val = val; }
   inline size_t get() const { return _val; }
 
-  inline void inc()
+  //! @brief Increment the value and return the new one.
+  inline size_t inc()
+  {
+#if defined(_MSC_VER)
+#if (defined(__x86_64__) || defined(_WIN64) || defined(_M_IA64) || defined(_M_X64))
+    return (size_t)InterlockedIncrement64((LONGLONG volatile *)&_val);
+#else
+    return (size_t)InterlockedIncrement((LONG volatile *)&_val);
+#endif
+#elif defined(__GNUC__)
+    return __sync_add_and_fetch(&_val, 1);
+#else
+#error "MathPresso::Atomic - Unsupported compiler."
+#endif
+  }
+
+  //! @brief Add @a n to the value and return the new one.
+  inline size_t add(size_t n)
   {
 #if defined(_MSC_VER)
 #if (defined(__x86_64__) || defined(_WIN64) || defined(_M_IA64) || defined(_M_X64))
-    InterlockedIncrement64((LONGLONG volatile *)&_val);
+    return (size_t)InterlockedExchangeAdd64((LONGLONG volatile *)&_val, (LONGLONG)n) + n;
 #else
-    InterlockedIncrement((LONG volatile *)&_val);
+    return (size_t)InterlockedExchangeAdd((LONG volatile *)&_val, (LONG)n) + n;
 #endif
 #elif defined(__GNUC__)
-    __sync_fetch_and_add(&_val, 1);
+    return __sync_add_and_fetch(&_val, n);
 #else
 #error "MathPresso::Atomic - Unsupported compiler."
 #endif
@@ -122,6 +150,21 @@ struct MATHPRESSO_HIDDEN Atomic
   volatile size_t _val;
 };
 
+//! @internal
+//!
+//! @brief Set @a *dst to @a value if it's @a expected, return whether it
+//! was set.
+static inline bool mpAtomicSetPtrIf(void* volatile* dst, void* expected, void* value)
+{
+#if defined(_MSC_VER)
+  return InterlockedCompareExchangePointer(dst, value, expected) == expected;
+#elif defined(__GNUC__)
+  return __sync_bool_compare_and_swap(dst, expected, value);
+#else
+#error "MathPresso::mpAtomicSetPtrIf - Unsupported compiler."
+#endif
+}
+
 // ============================================================================
 // [MathPresso::mpIsXXX]
 // ============================================================================
@@ -131,6 +174,33 @@ static inline bool mpIsDigit(uint uc) { return uc >= '0' && uc <= '9'; }
 static inline bool mpIsAlpha(uint uc) { return (uc | 0x20) >= 'a' && (uc | 0x20) <= 'z'; }
 static inline bool mpIsAlnum(uint uc) { return mpIsAlpha(uc) || mpIsDigit(uc); }
 
+// ============================================================================
+// [MathPresso::mpIsFinite]
+// ============================================================================
+
+//! @brief Get whether @a x is neither infinite nor NaN.
+static inline bool mpIsFinite(double x) { return x - x == 0; }
+
+// ============================================================================
+// [MathPresso::mpGetHighestBit / mpGetBitCount]
+// ============================================================================
+
+//! @brief Get index of the highest bit set in @a n, which must not be zero.
+static inline uint mpGetHighestBit(uint n)
+{
+  uint bit = 0;
+  while (n >>= 1) bit++;
+  return bit;
+}
+
+//! @brief Get count of bits set in @a n.
+static inline uint mpGetBitCount(uint n)
+{
+  uint count = 0;
+  for (; n; n &= n - 1) count++;
+  return count;
+}
+
 // ============================================================================
 // [MathPresso::mpConvertToFloat]
 // ============================================================================
@@ -169,6 +239,84 @@ private:
   MP_DISABLE_COPY(StringBuilder)
 };
 
+// ============================================================================
+// [MathPresso::Zone]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Memory allocator for many small objects that are freed at once.
+//!
+//! Memory is taken from chunks by incrementing a pointer, a single allocation
+//! can't be freed. Objects allocated by the zone are never destroyed, so they
+//! must not own any other resources. All memory is released by @ref reset()
+//! or when the zone is destroyed.
+struct MATHPRESSO_HIDDEN Zone
+{
+  //! @brief Chunk of memory, data follow the header.
+  struct Chunk
+  {
+    //! @brief Previous chunk.
+    Chunk* prev;
+    //! @brief Used bytes.
+    size_t pos;
+    //! @brief Size of data (in bytes).
+    size_t size;
+
+    inline char* getData() { return reinterpret_cast<char*>(this) + MP_ZONE_HEADER_SIZE; }
+  };
+
+  enum
+  {
+    //! @brief Alignment of all allocations.
+    MP_ZONE_ALIGNMENT = 8,
+    //! @brief Size of the chunk header, keeps data aligned.
+    MP_ZONE_HEADER_SIZE = (sizeof(Chunk) + MP_ZONE_ALIGNMENT - 1) & ~(MP_ZONE_ALIGNMENT - 1)
+  };
+
+  Zone(size_t chunkSize = 512);
+  ~Zone();
+
+  //! @brief Allocate @a size bytes, returns NULL if out of memory.
+  inline void* alloc(size_t size)
+  {
+    size = (size + MP_ZONE_ALIGNMENT - 1) & ~(size_t)(MP_ZONE_ALIGNMENT - 1);
+
+    Chunk* cur = _chunks;
+    if (cur == NULL || cur->size - cur->pos < size) return _alloc(size);
+
+    void* p = cur->getData() + cur->pos;
+    cur->pos += size;
+    return p;
+  }
+
+  //! @brief Allocate a copy of @a length items of @a data.
+  template<typename T>
+  inline T* dup(const T* data, size_t length)
+  {
+    T* p = reinterpret_cast<T*>(alloc(length * sizeof(T)));
+    if (p != NULL) memcpy(p, data, length * sizeof(T));
+    return p;
+  }
+
+  //! @brief Free all chunks.
+  void reset();
+
+  //! @brief Swap memory of this zone with @a other.
+  void swap(Zone& other);
+
+  //! @brief Allocate a new chunk and @a size bytes from it.
+  void* _alloc(size_t size);
+
+  //! @brief Current chunk.
+  Chunk* _chunks;
+  //! @brief Size of the next chunk, grows up to 16kB.
+  size_t _chunkSize;
+
+private:
+  MP_DISABLE_COPY(Zone)
+};
+
 // ============================================================================
 // [MathPresso::Vector<T>]
 // ============================================================================
@@ -344,7 +492,7 @@ bool Vector<T, N>::insert(size_t index, const T& item)
   if (_length == _capacity && !_grow()) return false;
 
   T* dst = _data + index;
-  memmove(dst + 1, dst, _length - index);
+  memmove(dst + 1, dst, sizeof(T) * (_length - index));
   memcpy(dst, &item, sizeof(T));
 
   _length++;
@@ -376,7 +524,7 @@ void Vector<T, N>::removeAt(size_t i)
 
   T* dst = _data + i;
   _length--;
-  memmove(dst, dst + 1, _length - i);
+  memmove(dst, dst + 1, sizeof(T) * (_length - i));
 }
 
 template<typename T, unsigned int N>
@@ -456,16 +604,114 @@ static void mpDeleteAll(Vector<T, N>& vector)
 // [Hash<T>]
 // ============================================================================
 
-MATHPRESSO_HIDDEN int mpGetPrime(int x);
+//! @internal
+//!
+//! @brief Initial value of @ref mpGetHash() (FNV-1a offset basis).
+#define MP_SYMBOL_HASH_INIT 0x811C9DC5U
+
+//! @internal
+//!
+//! @brief Add character @a c to @a hash (FNV-1a), used by @ref mpGetHash()
+//! and by the tokenizer that computes the hash of a symbol while reading it.
+//! Tables mix the result by @ref mpMixHash().
+static inline unsigned int mpUpdateHash(unsigned int hash, unsigned int c)
+{
+  return (hash ^ (c & 0xFFU)) * 0x01000193U;
+}
+
 MATHPRESSO_HIDDEN unsigned int mpGetHash(const char* _key, size_t klen);
 
+//! @internal
+//!
+//! @brief Mix bits of @a hash, so both the group and the tag taken from it
+//! depend on all characters.
+static inline unsigned int mpMixHash(unsigned int hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6BU;
+  hash ^= hash >> 13;
+  hash *= 0xC2B2AE35U;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+//! @internal
+//!
+//! @brief Control bytes of @ref Hash slots, a used slot has the low 7 bits
+//! of the mixed hash instead.
+enum MP_HASH_CTRL
+{
+  MP_HASH_EMPTY = 0x80,
+  MP_HASH_DELETED = 0xFE
+};
+
+//! @internal
+//!
+//! @brief Count of slots probed at once.
+enum { MP_HASH_GROUP_SIZE = 16 };
+
+//! @internal
+//!
+//! @brief Get mask of bytes of the group at @a ctrl equal to @a value, bit
+//! @c i is set if @c ctrl[i] matches.
+static inline unsigned int mpHashMatch(const unsigned char* ctrl, unsigned int value)
+{
+#if defined(MP_HASH_SSE2)
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+  return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+#else
+  unsigned int mask = 0;
+  for (unsigned int i = 0; i < MP_HASH_GROUP_SIZE; i++)
+    mask |= (unsigned int)(ctrl[i] == value) << i;
+  return mask;
+#endif // MP_HASH_SSE2
+}
+
+//! @internal
+//!
+//! @brief Get mask of empty or deleted slots of the group at @a ctrl (both
+//! have the highest bit set).
+static inline unsigned int mpHashMatchFree(const unsigned char* ctrl)
+{
+#if defined(MP_HASH_SSE2)
+  return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl)));
+#else
+  unsigned int mask = 0;
+  for (unsigned int i = 0; i < MP_HASH_GROUP_SIZE; i++)
+    mask |= (unsigned int)(ctrl[i] >> 7) << i;
+  return mask;
+#endif // MP_HASH_SSE2
+}
+
+//! @internal
+//!
+//! @brief Get index of the lowest set bit of @a mask (not zero).
+static inline unsigned int mpBitScan(unsigned int mask)
+{
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, mask);
+  return (unsigned int)i;
+#else
+  return (unsigned int)__builtin_ctz(mask);
+#endif // _MSC_VER
+}
+
+//! @brief Hash table that maps strings to values of type @a T.
+//!
+//! Open addressing, all slots are in one allocation and slots are probed by
+//! groups of @ref MP_HASH_GROUP_SIZE, each slot has a control byte with 7
+//! bits of the hash, so one SSE2 comparison finds candidates of the whole
+//! group. Keys are copied to a zone owned by the hash. A rehash (when the
+//! hash grows, or when @ref put() or @ref remove() reclaims deleted slots)
+//! moves the values and repacks the keys to a new zone, so pointers to
+//! values and keys (including the result of @ref dataToKey()) are valid only
+//! until the next @ref put() or @ref remove().
 template<typename T>
 struct MATHPRESSO_HIDDEN Hash
 {
   struct Node
   {
-    Node* next;
-
     char* key;
     unsigned int klen;
     unsigned int hash;
@@ -473,21 +719,35 @@ struct MATHPRESSO_HIDDEN Hash
     T value;
   };
 
-  Hash() : _elements(0), _buckets(1), _grow(1), _shrink(0), _data(_embedded) { _data[0] = NULL; }
+  Hash() : _nodes(NULL), _ctrl(NULL), _capacity(0), _length(0), _growthLeft(0), _deadBytes(0) {}
   ~Hash() { clear(); }
 
   void clear();
   bool copyFrom(const Hash<T>& other);
   bool mergeWith(const Hash<T>& other);
 
+  //! @brief Get count of keys.
+  inline size_t getLength() const { return _length; }
+
   bool put(const char* key, size_t klen, const T& value);
-  T* get(const char* key, size_t klen);
+  //! @overload
+  bool put(const char* key, size_t klen, unsigned int hash, const T& value);
+
+  //! @brief Find @a key, lookups don't modify the hash so they can run
+  //! concurrently (but not together with @ref put() or @ref remove()).
+  inline T* get(const char* key, size_t klen) const { return get(key, klen, mpGetHash(key, klen)); }
+  //! @overload, @a hash is @c mpGetHash(key, klen) computed by the caller.
+  T* get(const char* key, size_t klen, unsigned int hash) const;
+
   bool remove(const char* key, size_t klen);
-  bool contains(const char* key, size_t klen) const;
+  inline bool contains(const char* key, size_t klen) const { return get(key, klen) != NULL; }
+
+  //! @brief Move all nodes to a new table of @a capacity slots (power of
+  //! two) and repack the keys.
+  bool rehash(size_t capacity);
 
-  void grow();
-  void shrink();
-  void rehash(int count);
+  //! @brief Get index of the slot of @a key or @ref _capacity.
+  size_t find(const char* key, size_t klen, unsigned int hash) const;
 
   static const char* dataToKey(const T* data)
   {
@@ -497,14 +757,22 @@ struct MATHPRESSO_HIDDEN Hash
     return node->key;
   }
 
-  int _elements;
-  int _buckets;
+  //! @brief Slots, used slots have a control byte less than 0x80.
+  Node* _nodes;
+  //! @brief Control bytes of slots (see @ref MP_HASH_CTRL).
+  unsigned char* _ctrl;
 
-  int _grow;
-  int _shrink;
+  //! @brief Count of slots, zero or a power of two (at least one group).
+  size_t _capacity;
+  //! @brief Count of used slots.
+  size_t _length;
+  //! @brief Count of empty slots that can be used before the table grows.
+  size_t _growthLeft;
+  //! @brief Bytes of keys of removed nodes, released by @ref rehash().
+  size_t _deadBytes;
 
-  Node** _data;
-  Node* _embedded[1];
+  //! @brief Copies of keys.
+  Zone _keys;
 
 private:
   // DISABLE COPY.
@@ -514,31 +782,21 @@ private:
 template<typename T>
 void Hash<T>::clear()
 {
-  int i;
-
-  for (i = 0; i < _buckets; i++)
+  for (size_t i = 0; i < _capacity; i++)
   {
-    Node* node = _data[i];
-    while (node)
-    {
-      Node* next = node->next;
-      node->value.~T();
-      ::free(node);
-      node = next;
-    }
+    if (_ctrl[i] < MP_HASH_EMPTY) _nodes[i].value.~T();
   }
 
-  _elements = 0;
-  _buckets = 1;
-
-  _grow = 1;
-  _shrink = 0;
-
-  if (_data != _embedded)
-    ::free(_data);
+  // Control bytes are in the same allocation after the nodes.
+  ::free(_nodes);
 
-  _data = _embedded;
-  _data[0] = NULL;
+  _nodes = NULL;
+  _ctrl = NULL;
+  _capacity = 0;
+  _length = 0;
+  _growthLeft = 0;
+  _deadBytes = 0;
+  _keys.reset();
 }
 
 template<typename T>
@@ -553,174 +811,475 @@ bool Hash<T>::mergeWith(const Hash<T>& other)
 {
   if (this == &other) return true;
 
-  int i;
-  for (i = 0; i < other._buckets; i++)
+  for (size_t i = 0; i < other._capacity; i++)
   {
-    Node* node = other._data[i];
-    while (node)
-    {
-      if (!put(node->key, node->klen, node->value)) return false;
-      node = node->next;
-    }
+    if (other._ctrl[i] >= MP_HASH_EMPTY) continue;
+
+    const Node& node = other._nodes[i];
+    if (!put(node.key, node.klen, node.hash, node.value)) return false;
   }
 
   return true;
 }
 
 template<typename T>
-bool Hash<T>::put(const char* key, size_t klen, const T& value)
+size_t Hash<T>::find(const char* key, size_t klen, unsigned int hash) const
 {
-  unsigned int hash = mpGetHash(key, klen);
-  unsigned int hmod = hash % _buckets;
+  if (_capacity == 0) return 0;
+
+  unsigned int mixed = mpMixHash(hash);
+  unsigned int tag = mixed & 0x7F;
 
-  Node* node = _data[hmod];
-  while (node)
+  size_t groupMask = (_capacity / MP_HASH_GROUP_SIZE) - 1;
+  size_t group = (size_t)(mixed >> 7) & groupMask;
+
+  // Triangular probing visits each group once.
+  for (size_t step = 1; step <= groupMask + 1; step++)
   {
-    if (node->klen == klen && memcmp(node->key, key, klen) == 0)
+    const unsigned char* ctrl = _ctrl + group * MP_HASH_GROUP_SIZE;
+    unsigned int mask = mpHashMatch(ctrl, tag);
+
+    while (mask != 0)
     {
-      // Merge with existing.
-      node->value = value;
-      return true;
+      size_t i = group * MP_HASH_GROUP_SIZE + mpBitScan(mask);
+      const Node& node = _nodes[i];
+
+      if (node.hash == hash && node.klen == klen && memcmp(node.key, key, klen) == 0)
+        return i;
+      mask &= mask - 1;
     }
-    node = node->next;
+
+    // The key would be in this group if it had an empty slot.
+    if (mpHashMatch(ctrl, MP_HASH_EMPTY) != 0) break;
+    group = (group + step) & groupMask;
+  }
+
+  return _capacity;
+}
+
+template<typename T>
+T* Hash<T>::get(const char* key, size_t klen, unsigned int hash) const
+{
+  size_t i = find(key, klen, hash);
+  return i < _capacity ? &_nodes[i].value : NULL;
+}
+
+template<typename T>
+bool Hash<T>::put(const char* key, size_t klen, const T& value)
+{
+  return put(key, klen, mpGetHash(key, klen), value);
+}
+
+template<typename T>
+bool Hash<T>::put(const char* key, size_t klen, unsigned int hash, const T& value)
+{
+  size_t i = find(key, klen, hash);
+  if (i < _capacity)
+  {
+    // Merge with existing.
+    _nodes[i].value = value;
+    return true;
   }
 
-  // Add a new record.
-  node = reinterpret_cast<Node*>(::malloc(sizeof(Node) + klen + 1));
-  if (!node) return false;
+  if (_growthLeft == 0)
+  {
+    // Deleted slots are reused by a table of the same size if there is many
+    // of them, otherwise the table grows.
+    size_t capacity = _capacity ? _capacity : (size_t)MP_HASH_GROUP_SIZE;
+    if (_length >= _capacity / 2) capacity *= 2;
+    if (!rehash(capacity)) return false;
+  }
+
+  char* keyCopy = reinterpret_cast<char*>(_keys.alloc(klen + 1));
+  if (keyCopy == NULL) return false;
+
+  memcpy(keyCopy, key, klen);
+  keyCopy[klen] = '\0';
 
-  node->key = (char*)node + sizeof(Node);
-  memcpy(node->key, key, klen);
-  node->key[klen] = '\0';
-  node->klen = klen;
-  node->hash = hash;
-  new(&node->value) T(value);
+  unsigned int mixed = mpMixHash(hash);
+  size_t groupMask = (_capacity / MP_HASH_GROUP_SIZE) - 1;
+  size_t group = (size_t)(mixed >> 7) & groupMask;
+  unsigned int mask;
 
-  node->next = _data[hmod];
-  _data[hmod] = node;
+  for (size_t step = 1; (mask = mpHashMatchFree(_ctrl + group * MP_HASH_GROUP_SIZE)) == 0; step++)
+    group = (group + step) & groupMask;
 
-  if (++_elements >= _grow) grow();
+  i = group * MP_HASH_GROUP_SIZE + mpBitScan(mask);
+  if (_ctrl[i] == MP_HASH_EMPTY) _growthLeft--;
+
+  Node& node = _nodes[i];
+  node.key = keyCopy;
+  node.klen = (unsigned int)klen;
+  node.hash = hash;
+  new(&node.value) T(value);
+
+  _ctrl[i] = (unsigned char)(mixed & 0x7F);
+  _length++;
   return true;
 }
 
 template<typename T>
-T* Hash<T>::get(const char* key, size_t klen)
+bool Hash<T>::remove(const char* key, size_t klen)
 {
-  unsigned int hash = mpGetHash(key, klen);
-  unsigned int hmod = hash % _buckets;
+  size_t i = find(key, klen, mpGetHash(key, klen));
+  if (i >= _capacity) return false;
 
-  Node* node = _data[hmod];
+  _nodes[i].value.~T();
+  _deadBytes += klen + 1;
+  _length--;
 
-  while (node)
+  // Lookups never continue after a group with an empty slot, so the slot
+  // can be empty again. Otherwise it must be skipped by them.
+  const unsigned char* ctrl = _ctrl + (i & ~(size_t)(MP_HASH_GROUP_SIZE - 1));
+  if (mpHashMatch(ctrl, MP_HASH_EMPTY) != 0)
+  {
+    _ctrl[i] = MP_HASH_EMPTY;
+    _growthLeft++;
+  }
+  else
   {
-    if (node->klen == klen && memcmp(node->key, key, klen) == 0)
-      return &node->value;
-    node = node->next;
+    _ctrl[i] = MP_HASH_DELETED;
   }
 
-  return NULL;
+  // Keys of removed nodes stay in the zone until the table is rebuilt, keep
+  // it amortized by rebuilding only after enough of them.
+  if (_deadBytes >= 4096 && _deadBytes >= _capacity)
+    rehash(_capacity);
+
+  return true;
 }
 
 template<typename T>
-bool Hash<T>::remove(const char* key, size_t klen)
+bool Hash<T>::rehash(size_t capacity)
 {
-  unsigned int hash = mpGetHash(key, klen);
-  unsigned int hmod = hash % _buckets;
+  size_t nodesSize = capacity * sizeof(Node);
+  Node* nodes = reinterpret_cast<Node*>(::malloc(nodesSize + capacity));
+  if (nodes == NULL) return false;
 
-  Node* node = _data[hmod];
-  Node* prev = NULL;
+  unsigned char* ctrl = reinterpret_cast<unsigned char*>(nodes) + nodesSize;
+  memset(ctrl, MP_HASH_EMPTY, capacity);
 
-  while (node)
+  Zone keys;
+  size_t groupMask = (capacity / MP_HASH_GROUP_SIZE) - 1;
+
+  for (size_t i = 0; i < _capacity; i++)
   {
-    Node* next = node->next;
-    if (node->klen == klen && memcmp(node->key, key, klen) == 0)
-    {
-      // Remove.
-      if (prev)
-        prev->next = next;
-      else
-        _data[hmod] = next;
+    if (_ctrl[i] >= MP_HASH_EMPTY) continue;
 
-      node->value.~T();
-      ::free(node);
+    Node& src = _nodes[i];
+    char* keyCopy = keys.dup(src.key, src.klen + 1);
 
-      if (--_elements < _shrink) shrink();
-      return true;
+    if (keyCopy == NULL)
+    {
+      for (size_t k = 0; k < capacity; k++)
+      {
+        if (ctrl[k] < MP_HASH_EMPTY) nodes[k].value.~T();
+      }
+      ::free(nodes);
+      return false;
     }
 
-    prev = node;
-    node = next;
+    // Keys are unique, the first free slot is used.
+    size_t group = (size_t)(mpMixHash(src.hash) >> 7) & groupMask;
+    unsigned int mask;
+
+    for (size_t step = 1; (mask = mpHashMatchFree(ctrl + group * MP_HASH_GROUP_SIZE)) == 0; step++)
+      group = (group + step) & groupMask;
+
+    size_t j = group * MP_HASH_GROUP_SIZE + mpBitScan(mask);
+    Node& dst = nodes[j];
+
+    dst.key = keyCopy;
+    dst.klen = src.klen;
+    dst.hash = src.hash;
+    new(&dst.value) T(src.value);
+    ctrl[j] = _ctrl[i];
   }
 
-  return false;
+  for (size_t i = 0; i < _capacity; i++)
+  {
+    if (_ctrl[i] < MP_HASH_EMPTY) _nodes[i].value.~T();
+  }
+  ::free(_nodes);
+
+  _nodes = nodes;
+  _ctrl = ctrl;
+  _capacity = capacity;
+  _growthLeft = capacity - capacity / 8 - _length;
+  _deadBytes = 0;
+  _keys.swap(keys);
+  return true;
+}
+
+// ============================================================================
+// [FrozenHash<T>]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Align @a size to 8 bytes.
+static inline size_t mpAlign8(size_t size)
+{
+  return (size + 7) & ~(size_t)7;
+}
+
+//! @internal
+//!
+//! @brief Map @a hash to <0, @a n).
+static inline uint mpReduceHash(unsigned int hash, size_t n)
+{
+  return (uint)(((unsigned long long)hash * (unsigned long long)n) >> 32);
 }
 
+//! @internal
+//!
+//! @brief Get slot of a key with @a hash in a bucket displaced by @a d.
+static inline uint mpFrozenSlot(unsigned int hash, uint d, size_t n)
+{
+  return mpReduceHash(mpMixHash(hash + (d + 1) * 0x9E3779B9U), n);
+}
+
+//! @brief Read-only copy of @ref Hash with a minimal perfect hash.
+//!
+//! Each bucket has a displacement chosen so that hashes of all buckets map
+//! to different slots, a lookup reads the displacement of its bucket and
+//! then compares the key of a single node. Keys with the same hash (the hash
+//! has only 32 bits) follow the slots and are linked from the first one.
+//! Nodes have the layout of the nodes of @ref Hash, so @ref Hash::dataToKey()
+//! works for values of both. Memory is given to @ref init(), the table
+//! doesn't own it and values are never destroyed (T must be a plain type).
 template<typename T>
-bool Hash<T>::contains(const char* key, size_t klen) const
+struct MATHPRESSO_HIDDEN FrozenHash
 {
-  unsigned int hash = mpGetHash(key, klen);
-  unsigned int hmod = hash % _buckets;
+  typedef typename Hash<T>::Node Node;
+
+  //! @brief Get count of buckets for @a length keys.
+  static inline size_t getBucketCount(size_t length) { return length / 4 + 1; }
+
+  //! @brief Get count of bytes used by @ref init() for @a src.
+  static size_t getSize(const Hash<T>& src);
 
-  Node* node = _data[hmod];
+  //! @brief Copy keys of @a src to @a mem and advance it by @ref getSize(),
+  //! return false if out of memory or no displacement was found.
+  bool init(const Hash<T>& src, char*& mem);
 
-  while (node)
+  //! @brief Find @a key, see @ref Hash::get().
+  inline T* get(const char* key, size_t klen, unsigned int hash) const
   {
-    if (node->klen == klen && memcmp(node->key, key, klen) == 0)
-      return true;
-    node = node->next;
+    if (_slotCount == 0) return NULL;
+
+    uint d = _displacements[mpReduceHash(mpMixHash(hash), _bucketCount)];
+    uint i = mpFrozenSlot(hash, d, _slotCount);
+
+    for (;;)
+    {
+      Node* node = &_nodes[i];
+      if (node->hash == hash && node->klen == klen && memcmp(node->key, key, klen) == 0)
+        return &node->value;
+
+      if ((i = _next[i]) == 0) return NULL;
+    }
   }
 
-  return false;
-}
+  //! @brief Put all keys to @a dst.
+  bool copyTo(Hash<T>& dst) const;
 
-template<typename T>
-void Hash<T>::grow()
-{
-  int i = mpGetPrime(_grow);
-  if (i != _buckets) rehash(i);
-}
+  //! @brief Nodes, slots first and then keys with the same hash as others.
+  Node* _nodes;
+  //! @brief Displacement of each bucket.
+  uint* _displacements;
+  //! @brief Next node with the same hash, 0 means none.
+  uint* _next;
+  //! @brief Count of nodes.
+  size_t _length;
+  //! @brief Count of slots (different hashes).
+  size_t _slotCount;
+  //! @brief Count of buckets.
+  size_t _bucketCount;
+};
 
 template<typename T>
-void Hash<T>::shrink()
+size_t FrozenHash<T>::getSize(const Hash<T>& src)
 {
-  int i = mpGetPrime(_shrink);
-  if (i != _buckets) rehash(i);
+  size_t n = src._length;
+  size_t size = mpAlign8(n * sizeof(Node)) +
+                mpAlign8(getBucketCount(n) * sizeof(uint)) +
+                mpAlign8(n * sizeof(uint));
+  size_t keys = 0;
+
+  for (size_t i = 0; i < src._capacity; i++)
+  {
+    if (src._ctrl[i] < MP_HASH_EMPTY) keys += src._nodes[i].klen + 1;
+  }
+
+  return size + mpAlign8(keys);
 }
 
 template<typename T>
-void Hash<T>::rehash(int count)
+bool FrozenHash<T>::init(const Hash<T>& src, char*& mem)
 {
-  int oldBuckets = _buckets;
-  int newBuckets = count;
+  size_t n = src._length;
+  size_t nb = getBucketCount(n);
+
+  _nodes = reinterpret_cast<Node*>(mem);
+  _displacements = reinterpret_cast<uint*>(mem + mpAlign8(n * sizeof(Node)));
+  _next = reinterpret_cast<uint*>(reinterpret_cast<char*>(_displacements) + mpAlign8(nb * sizeof(uint)));
+  _length = n;
+  _slotCount = 0;
+  _bucketCount = nb;
+
+  char* keysBegin = reinterpret_cast<char*>(_next) + mpAlign8(n * sizeof(uint));
+  char* keys = keysBegin;
+  mem = keysBegin;
+
+  memset(_displacements, 0, nb * sizeof(uint));
+  memset(_next, 0, n * sizeof(uint));
+
+  // Temporary arrays, nodes of src grouped by bucket, start of each group,
+  // buckets ordered by size, whether a node has the same hash as a previous
+  // one and used slots.
+  size_t tmpSize = n * sizeof(Node*) + (nb + 1) * sizeof(uint) * 3 + n * sizeof(uint) + n;
+  char* tmp = reinterpret_cast<char*>(::malloc(tmpSize));
+  if (tmp == NULL) return false;
+
+  const Node** grouped = reinterpret_cast<const Node**>(tmp);
+  uint* start = reinterpret_cast<uint*>(grouped + n);
+  uint* fill = start + nb + 1;
+  uint* order = fill + nb + 1;
+  uint* duplicate = order + nb + 1;
+  unsigned char* used = reinterpret_cast<unsigned char*>(duplicate + n);
+
+  memset(start, 0, (nb + 1) * sizeof(uint));
+  memset(used, 0, n);
+
+  size_t i, j, k;
+  for (i = 0; i < src._capacity; i++)
+  {
+    if (src._ctrl[i] < MP_HASH_EMPTY)
+      start[mpReduceHash(mpMixHash(src._nodes[i].hash), nb) + 1]++;
+  }
+
+  uint maxSize = 0;
+  for (i = 0; i < nb; i++)
+  {
+    if (start[i + 1] > maxSize) maxSize = start[i + 1];
+    start[i + 1] += start[i];
+    fill[i] = start[i];
+  }
+
+  for (i = 0; i < src._capacity; i++)
+  {
+    if (src._ctrl[i] < MP_HASH_EMPTY)
+      grouped[fill[mpReduceHash(mpMixHash(src._nodes[i].hash), nb)]++] = &src._nodes[i];
+  }
 
-  Node** oldData = _data;
-  Node** newData = reinterpret_cast<Node**>(::malloc(newBuckets * sizeof(void*)));
-  if (newData == NULL) return;
+  // Keys with the same hash are in the same bucket, only the first one of
+  // them gets a slot.
+  for (i = 0; i < nb; i++)
+  {
+    for (j = start[i]; j < start[i + 1]; j++)
+    {
+      for (k = start[i]; k < j; k++)
+      {
+        if (grouped[k]->hash == grouped[j]->hash) break;
+      }
+
+      duplicate[j] = (k != j);
+      _slotCount += (k == j);
+    }
+  }
+
+  // The largest buckets are placed first, while most slots are free.
+  size_t orderLength = 0;
+  for (uint size = maxSize; size > 0; size--)
+  {
+    for (i = 0; i < nb; i++)
+    {
+      if (start[i + 1] - start[i] == size) order[orderLength++] = (uint)i;
+    }
+  }
 
-  memset(newData, 0, newBuckets * sizeof(void*));
+  // Expected count of tries of the last bucket is the count of slots.
+  uint maxDisplacement = (uint)_slotCount * 32 + 1024;
+  uint overflow = (uint)_slotCount;
+  bool ok = true;
 
-  int i;
-  for (i = 0; i < oldBuckets; i++)
+  for (i = 0; i < orderLength && ok; i++)
   {
-    Node* node = _data[i];
-    while (node)
+    uint b = order[i];
+    const Node** bucket = grouped + start[b];
+    uint* bucketDuplicate = duplicate + start[b];
+    size_t size = start[b + 1] - start[b];
+
+    uint d;
+    for (d = 0; d < maxDisplacement; d++)
     {
-      Node* next = node->next;
-      unsigned int hmod = node->hash % newBuckets;
+      for (j = 0; j < size; j++)
+      {
+        if (bucketDuplicate[j]) continue;
+
+        uint s = mpFrozenSlot(bucket[j]->hash, d, _slotCount);
+        if (used[s]) break;
+
+        used[s] = 2;
+      }
+
+      // Slots marked by this try are free again, they are marked as used
+      // when the displacement is found.
+      for (k = 0; k < j; k++)
+      {
+        if (!bucketDuplicate[k]) used[mpFrozenSlot(bucket[k]->hash, d, _slotCount)] = 0;
+      }
+      if (j == size) break;
+    }
 
-      node->next = newData[hmod];
-      newData[hmod] = node;
+    if (d == maxDisplacement)
+    {
+      ok = false;
+      break;
+    }
 
-      node = next;
+    _displacements[b] = d;
+    for (j = 0; j < size; j++)
+    {
+      const Node* srcNode = bucket[j];
+      uint s = mpFrozenSlot(srcNode->hash, d, _slotCount);
+      uint index = s;
+
+      if (bucketDuplicate[j])
+      {
+        index = overflow++;
+        _next[index] = _next[s];
+        _next[s] = index;
+      }
+
+      Node* node = &_nodes[index];
+      memcpy(keys, srcNode->key, srcNode->klen + 1);
+      node->key = keys;
+      node->klen = srcNode->klen;
+      node->hash = srcNode->hash;
+      new(&node->value) T(srcNode->value);
+
+      keys += srcNode->klen + 1;
+      used[s] = 1;
     }
   }
 
-  _data = newData;
-  _buckets = newBuckets;
-  if (oldData != _embedded) ::free(oldData);
+  ::free(tmp);
+  mem = keysBegin + mpAlign8((size_t)(keys - keysBegin));
+  return ok;
+}
 
-  _grow   = (int)( ((double)_buckets * 0.85) );
-  _shrink = (int)( ((double)_buckets * 0.15) );
+template<typename T>
+bool FrozenHash<T>::copyTo(Hash<T>& dst) const
+{
+  for (size_t i = 0; i < _length; i++)
+  {
+    const Node& node = _nodes[i];
+    if (!dst.put(node.key, node.klen, node.hash, node.value)) return false;
+  }
+
+  return true;
 }
 
 } // MathPresso namespace
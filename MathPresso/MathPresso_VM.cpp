@@ -0,0 +1,873 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// [Dependencies]
+#include "MathPresso.h"
+#include "MathPresso_AST_p.h"
+#include "MathPresso_Context_p.h"
+#include "MathPresso_Util_p.h"
+#include "MathPresso_VM_p.h"
+
+#include <math.h>
+
+namespace MathPresso {
+
+// ============================================================================
+// [MathPresso::VMCompiler]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Compiles AST into @ref VMProgram.
+//!
+//! Registers are allocated in this order: constants, variables, common
+//! subexpressions and then temporaries. Temporaries are allocated and
+//! released like a stack, the result of a node is always the top-most
+//! temporary.
+struct MATHPRESSO_HIDDEN VMCompiler
+{
+  VMCompiler(WorkContext& ctx, VMProgram* program);
+  ~VMCompiler();
+
+  // Registers.
+
+  void collect(ASTElement* element);
+  mreal_t getConstant(ASTConstant* element);
+  uint getVariable(int offset);
+  uint allocTemp();
+  void releaseTemp(uint reg);
+
+  // Compiler.
+
+  void emit(uint op, uint dst, uint a = 0, uint b = 0);
+  uint roundF32(uint reg);
+  bool compile(ASTElement* tree, bool isSet);
+
+  uint doElement(ASTElement* element);
+  uint storeShared(uint src, uint dst);
+  uint doBlock(ASTBlock* element);
+  uint doOperator(ASTOperator* element);
+  uint doCall(ASTCall* element);
+  uint doTransform(ASTTransform* element);
+  uint doCondition(ASTCondition* element);
+
+  // Members.
+
+  WorkContext& ctx;
+  VMProgram* program;
+
+  //! @brief Variable offsets, register of @c variables[i] is
+  //! @c variableBase + i.
+  Vector<int> variables;
+  uint variableBase;
+
+  //! @brief Common subexpressions, register of @c shared[i] is
+  //! @c sharedBase + i.
+  Vector<ASTElement*> shared;
+  //! @brief Whether @c shared[i] was already computed.
+  Vector<bool> sharedDone;
+  uint sharedBase;
+
+  //! @brief First temporary register.
+  uint tempBase;
+  //! @brief Next free temporary register.
+  uint tempTop;
+
+  bool outOfMemory;
+};
+
+VMCompiler::VMCompiler(WorkContext& ctx, VMProgram* program) :
+  ctx(ctx),
+  program(program),
+  variableBase(0),
+  sharedBase(0),
+  tempBase(0),
+  tempTop(0),
+  outOfMemory(false)
+{
+}
+
+VMCompiler::~VMCompiler()
+{
+}
+
+void VMCompiler::collect(ASTElement* element)
+{
+  switch (element->getElementType())
+  {
+    case MELEMENT_CONSTANT:
+    {
+      mreal_t value = getConstant(reinterpret_cast<ASTConstant*>(element));
+      size_t i, len = program->constants.getLength();
+
+      for (i = 0; i < len; i++)
+      {
+        if (memcmp(&program->constants[i], &value, sizeof(mreal_t)) == 0) return;
+      }
+
+      outOfMemory |= !program->constants.append(value);
+      return;
+    }
+
+    case MELEMENT_VARIABLE:
+    {
+      int offset = reinterpret_cast<ASTVariable*>(element)->getOffset();
+      if (variables.indexOf(offset) == MP_INVALID_INDEX)
+        outOfMemory |= !variables.append(offset);
+      return;
+    }
+  }
+
+  // Common subexpression has one register and its children are collected
+  // only once.
+  if (element->getUseCount() > 1)
+  {
+    if (shared.indexOf(element) != MP_INVALID_INDEX) return;
+
+    outOfMemory |= !shared.append(element);
+    outOfMemory |= !sharedDone.append(false);
+  }
+
+  ASTElement** children = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
+
+  for (i = 0; i < len; i++) collect(children[i]);
+}
+
+mreal_t VMCompiler::getConstant(ASTConstant* element)
+{
+  // Single precision code uses constants rounded to float.
+  mreal_t value = element->getValue();
+  return ctx.isFloat32() ? (mreal_t)(float)value : value;
+}
+
+uint VMCompiler::getVariable(int offset)
+{
+  return variableBase + (uint)variables.indexOf(offset);
+}
+
+uint VMCompiler::allocTemp()
+{
+  uint reg = tempTop++;
+  if (program->registerCount < tempTop) program->registerCount = tempTop;
+  return reg;
+}
+
+void VMCompiler::releaseTemp(uint reg)
+{
+  // Constants and variables are never released.
+  if (reg >= tempBase)
+  {
+    MP_ASSERT(reg == tempTop - 1);
+    tempTop--;
+  }
+}
+
+void VMCompiler::emit(uint op, uint dst, uint a, uint b)
+{
+  VMInst* inst = program->code.newItem();
+  if (inst == NULL)
+  {
+    outOfMemory = true;
+    return;
+  }
+
+  inst->handler = NULL;
+  inst->op = op;
+  inst->dst = dst;
+  inst->a = a;
+  inst->b = b;
+  inst->fn = NULL;
+}
+
+uint VMCompiler::roundF32(uint reg)
+{
+  // Each intermediate result of a single precision expression is rounded
+  // to float, the result is the same as computed in single precision.
+  if (ctx.isFloat32()) emit(VM_ROUND_F32, reg, reg);
+  return reg;
+}
+
+bool VMCompiler::compile(ASTElement* tree, bool isSet)
+{
+  // Constants and common subexpressions must be complete, they are searched
+  // by the code generation.
+  collect(tree);
+  if (outOfMemory) return false;
+
+  variableBase = (uint)program->constants.getLength();
+  sharedBase = variableBase + (uint)variables.getLength();
+  tempBase = sharedBase + (uint)shared.getLength();
+  tempTop = tempBase;
+  program->registerCount = tempBase;
+
+  // Load all variables at the beginning of each row, assignment updates
+  // both the register and the row.
+  size_t i, len = variables.getLength();
+  for (i = 0; i < len; i++)
+  {
+    emit(ctx.isFloat32() ? VM_LOAD_F32 : VM_LOAD, variableBase + (uint)i);
+    if (!outOfMemory) program->code[program->code.getLength() - 1].offset = variables[i];
+  }
+
+  // Each child of the set is one result, the last one ends the row.
+  if (isSet)
+  {
+    ASTElement** elements = tree->getChildrenElements();
+    len = tree->getChildrenCount();
+
+    for (i = 0; i + 1 < len; i++)
+    {
+      uint result = doElement(elements[i]);
+      emit(ctx.isFloat32() ? VM_OUT_F32 : VM_OUT, 0, result);
+      releaseTemp(result);
+    }
+
+    tree = elements[len - 1];
+    program->resultCount = (uint)len;
+  }
+
+  uint result = doElement(tree);
+  emit(ctx.isFloat32() ? VM_END_F32 : VM_END, 0, result);
+
+  return !outOfMemory;
+}
+
+uint VMCompiler::doElement(ASTElement* element)
+{
+  size_t index = MP_INVALID_INDEX;
+
+  // Common subexpression is computed only by its first use.
+  if (element->getUseCount() > 1 && (index = shared.indexOf(element)) != MP_INVALID_INDEX)
+  {
+    if (sharedDone[index]) return sharedBase + (uint)index;
+    sharedDone[index] = true;
+  }
+
+  uint result;
+  switch (element->getElementType())
+  {
+    case MELEMENT_BLOCK:
+      result = doBlock(reinterpret_cast<ASTBlock*>(element));
+      break;
+    case MELEMENT_CONSTANT:
+    {
+      mreal_t value = getConstant(reinterpret_cast<ASTConstant*>(element));
+      size_t i = 0;
+
+      while (memcmp(&program->constants[i], &value, sizeof(mreal_t)) != 0) i++;
+      result = (uint)i;
+      break;
+    }
+    case MELEMENT_VARIABLE:
+      result = getVariable(reinterpret_cast<ASTVariable*>(element)->getOffset());
+      break;
+    case MELEMENT_OPERATOR:
+      result = doOperator(reinterpret_cast<ASTOperator*>(element));
+      break;
+    case MELEMENT_CALL:
+      result = doCall(reinterpret_cast<ASTCall*>(element));
+      break;
+    case MELEMENT_TRANSFORM:
+      result = doTransform(reinterpret_cast<ASTTransform*>(element));
+      break;
+    case MELEMENT_CONDITION:
+      result = doCondition(reinterpret_cast<ASTCondition*>(element));
+      break;
+    default:
+      MP_ASSERT_NOT_REACHED();
+      result = 0;
+      break;
+  }
+
+  if (index != MP_INVALID_INDEX)
+    result = storeShared(result, sharedBase + (uint)index);
+  return result;
+}
+
+uint VMCompiler::storeShared(uint src, uint dst)
+{
+  size_t length = program->code.getLength();
+
+  // The result was just computed to a temporary, store it directly to the
+  // register of the common subexpression.
+  if (src >= tempBase && length != 0 && program->code[length - 1].dst == src)
+    program->code[length - 1].dst = dst;
+  else
+    emit(VM_MOV, dst, src);
+
+  releaseTemp(src);
+  return dst;
+}
+
+uint VMCompiler::doBlock(ASTBlock* element)
+{
+  ASTElement** elements = element->getChildrenElements();
+  size_t i, len = element->getChildrenCount();
+  uint result = 0;
+
+  for (i = 0; i < len; i++)
+  {
+    if (i != 0) releaseTemp(result);
+    result = doElement(elements[i]);
+  }
+
+  return result;
+}
+
+uint VMCompiler::doOperator(ASTOperator* element)
+{
+  uint operatorType = element->getOperatorType();
+
+  if (operatorType == MOPERATOR_ASSIGN)
+  {
+    ASTVariable* varNode = reinterpret_cast<ASTVariable*>(element->getLeft());
+    MP_ASSERT(varNode->getElementType() == MELEMENT_VARIABLE);
+
+    uint src = doElement(element->getRight());
+    releaseTemp(src);
+
+    uint dst = getVariable(varNode->getOffset());
+    emit(ctx.isFloat32() ? VM_STORE_F32 : VM_STORE, dst, src);
+    if (!outOfMemory) program->code[program->code.getLength() - 1].offset = varNode->getOffset();
+    return dst;
+  }
+
+  uint a = doElement(element->getLeft());
+  uint b = doElement(element->getRight());
+  releaseTemp(b);
+  releaseTemp(a);
+
+  uint op;
+  switch (operatorType)
+  {
+    case MOPERATOR_PLUS : op = VM_ADD; break;
+    case MOPERATOR_MINUS: op = VM_SUB; break;
+    case MOPERATOR_MUL  : op = VM_MUL; break;
+    case MOPERATOR_DIV  : op = VM_DIV; break;
+    case MOPERATOR_MOD  : op = VM_MOD; break;
+    case MOPERATOR_POW  : op = VM_POW; break;
+    case MOPERATOR_EQ   : op = VM_EQ ; break;
+    case MOPERATOR_NE   : op = VM_NE ; break;
+    case MOPERATOR_LT   : op = VM_LT ; break;
+    case MOPERATOR_LE   : op = VM_LE ; break;
+
+    // a > b is b < a, a >= b is b <= a.
+    case MOPERATOR_GT   :
+    case MOPERATOR_GE   :
+    {
+      uint t = a;
+      a = b;
+      b = t;
+      op = (operatorType == MOPERATOR_GT) ? VM_LT : VM_LE;
+      break;
+    }
+
+    default:
+      MP_ASSERT_NOT_REACHED();
+      op = VM_ADD;
+      break;
+  }
+
+  uint dst = allocTemp();
+  emit(op, dst, a, b);
+
+  // Results of comparisons are 0 or 1.
+  return (op < VM_EQ) ? roundF32(dst) : dst;
+}
+
+uint VMCompiler::doCall(ASTCall* element)
+{
+  ASTElement** arguments = element->getArguments();
+  size_t i, len = element->getArgumentsCount();
+
+  Function* fn = element->getFunction();
+  uint op = _VM_OPCODE_COUNT;
+
+  switch (fn->getFunctionId())
+  {
+    case MFUNCTION_MIN       : op = VM_MIN       ; break;
+    case MFUNCTION_MAX       : op = VM_MAX       ; break;
+    case MFUNCTION_AVG       : op = VM_AVG       ; break;
+    case MFUNCTION_ABS       : op = VM_ABS       ; break;
+    case MFUNCTION_SQRT      : op = VM_SQRT      ; break;
+    case MFUNCTION_RECIPROCAL: op = VM_RECIPROCAL; break;
+  }
+
+  if (op != _VM_OPCODE_COUNT || len <= 2)
+  {
+    uint a = (len > 0) ? doElement(arguments[0]) : 0;
+    uint b = (len > 1) ? doElement(arguments[1]) : 0;
+
+    if (len > 1) releaseTemp(b);
+    if (len > 0) releaseTemp(a);
+
+    if (op == _VM_OPCODE_COUNT) op = VM_CALL0 + (uint)len;
+
+    uint dst = allocTemp();
+    emit(op, dst, a, b);
+    if (!outOfMemory) program->code[program->code.getLength() - 1].fn = fn->getPtr();
+
+    // min(), max() and abs() of floats are floats.
+    return (op == VM_MIN || op == VM_MAX || op == VM_ABS) ? dst : roundF32(dst);
+  }
+
+  // More arguments, they are passed in consecutive registers.
+  uint base = tempTop;
+  for (i = 0; i < len; i++)
+  {
+    uint reg = allocTemp();
+    uint arg = doElement(arguments[i]);
+
+    if (arg != reg)
+    {
+      if (arg >= tempBase) releaseTemp(arg);
+      emit(VM_MOV, reg, arg);
+    }
+  }
+
+  for (i = 0; i < len; i++) releaseTemp(base + (uint)(len - 1 - i));
+
+  uint dst = allocTemp();
+  emit(VM_CALLN, dst, base, (uint)len);
+  if (!outOfMemory) program->code[program->code.getLength() - 1].fn = fn->getPtr();
+  return roundF32(dst);
+}
+
+uint VMCompiler::doTransform(ASTTransform* element)
+{
+  uint a = doElement(element->getChild());
+
+  switch (element->getTransformType())
+  {
+    case MTRANSFORM_NONE:
+      return a;
+
+    case MTRANSFORM_NEGATE:
+    {
+      releaseTemp(a);
+      uint dst = allocTemp();
+      emit(VM_NEG, dst, a);
+      return dst;
+    }
+
+    case MTRANSFORM_SQRT:
+    case MTRANSFORM_RECIPROCAL:
+    case MTRANSFORM_RSQRT:
+    {
+      uint transformType = element->getTransformType();
+
+      releaseTemp(a);
+      uint dst = allocTemp();
+      emit(transformType == MTRANSFORM_RECIPROCAL ? VM_RECIPROCAL : VM_SQRT, dst, a);
+      roundF32(dst);
+
+      if (transformType == MTRANSFORM_RSQRT)
+      {
+        emit(VM_RECIPROCAL, dst, dst);
+        roundF32(dst);
+      }
+      return dst;
+    }
+
+    case MTRANSFORM_POWI:
+    {
+      // x^n by the binary method from the highest bit. The base a is read
+      // by all multiplications, so the partial result is in another register
+      // and only the last multiplication may overwrite a temporary a.
+      int exponent = element->getExponent();
+      uint n = (uint)(exponent < 0 ? -exponent : exponent);
+      uint bit = mpGetHighestBit(n);
+      uint remaining = bit + mpGetBitCount(n) - 1;
+
+      uint r = allocTemp();
+      uint dst = r;
+      uint src = a;
+
+      while (bit-- > 0)
+      {
+        if (--remaining == 0 && a >= tempBase) dst = a;
+        emit(VM_MUL, dst, src, src);
+        src = roundF32(dst);
+
+        if (n & (1U << bit))
+        {
+          if (--remaining == 0 && a >= tempBase) dst = a;
+          emit(VM_MUL, dst, src, a);
+          src = roundF32(dst);
+        }
+      }
+
+      if (dst == a) releaseTemp(r);
+      if (exponent < 0)
+      {
+        emit(VM_RECIPROCAL, dst, dst);
+        roundF32(dst);
+      }
+      return dst;
+    }
+
+    default:
+      MP_ASSERT_NOT_REACHED();
+      return a;
+  }
+}
+
+uint VMCompiler::doCondition(ASTCondition* element)
+{
+  // Both branches are evaluated like by the JIT compiler, a common
+  // subexpression of a branch may be used after the condition.
+  uint cond = doElement(element->getCondition());
+  uint a = doElement(element->getThen());
+  uint b = doElement(element->getElse());
+  releaseTemp(b);
+  releaseTemp(a);
+  releaseTemp(cond);
+
+  uint dst = allocTemp();
+  emit(VM_SELECT, dst, a, b);
+  if (!outOfMemory) program->code[program->code.getLength() - 1].cond = cond;
+  return dst;
+}
+
+// ============================================================================
+// [MathPresso::VM - Execute]
+// ============================================================================
+
+#if defined(MP_VM_DIRECT_THREADING)
+#define VM_HANDLER(op) _Handler_##op:
+#define VM_DISPATCH() goto *ip->handler
+#else
+#define VM_HANDLER(op) case op:
+#define VM_DISPATCH() goto _Dispatch
+#endif // MP_VM_DIRECT_THREADING
+
+#define VM_NEXT() do { ip++; VM_DISPATCH(); } while (0)
+
+//! @internal
+//!
+//! @brief Evaluate @a program, or if it's NULL, return addresses of handlers
+//! (indexed by opcode) to @a handlersOut.
+static void mpVMRun(const VMProgram* program, mreal_t* result, char* data, size_t stride, size_t count, const void* const** handlersOut)
+{
+#if defined(MP_VM_DIRECT_THREADING)
+  static const void* const handlers[_VM_OPCODE_COUNT] =
+  {
+    &&_Handler_VM_LOAD,
+    &&_Handler_VM_LOAD_F32,
+    &&_Handler_VM_STORE,
+    &&_Handler_VM_STORE_F32,
+    &&_Handler_VM_MOV,
+    &&_Handler_VM_ROUND_F32,
+    &&_Handler_VM_ADD,
+    &&_Handler_VM_SUB,
+    &&_Handler_VM_MUL,
+    &&_Handler_VM_DIV,
+    &&_Handler_VM_MOD,
+    &&_Handler_VM_POW,
+    &&_Handler_VM_NEG,
+    &&_Handler_VM_MIN,
+    &&_Handler_VM_MAX,
+    &&_Handler_VM_AVG,
+    &&_Handler_VM_ABS,
+    &&_Handler_VM_SQRT,
+    &&_Handler_VM_RECIPROCAL,
+    &&_Handler_VM_EQ,
+    &&_Handler_VM_NE,
+    &&_Handler_VM_LT,
+    &&_Handler_VM_LE,
+    &&_Handler_VM_SELECT,
+    &&_Handler_VM_CALL0,
+    &&_Handler_VM_CALL1,
+    &&_Handler_VM_CALL2,
+    &&_Handler_VM_CALLN,
+    &&_Handler_VM_OUT,
+    &&_Handler_VM_OUT_F32,
+    &&_Handler_VM_END,
+    &&_Handler_VM_END_F32
+  };
+
+  if (program == NULL)
+  {
+    *handlersOut = handlers;
+    return;
+  }
+#else
+  if (program == NULL)
+  {
+    *handlersOut = NULL;
+    return;
+  }
+#endif // MP_VM_DIRECT_THREADING
+
+  if (count == 0) return;
+
+  // Register file, constants are loaded once per call.
+  mreal_t buffer[64];
+  mreal_t* r = buffer;
+
+  if (program->registerCount > 64)
+  {
+    r = reinterpret_cast<mreal_t*>(::malloc(program->registerCount * sizeof(mreal_t)));
+    if (r == NULL)
+    {
+      for (size_t i = 0; i < count * program->resultCount; i++) result[i] = 0.0;
+      return;
+    }
+  }
+
+  memcpy(r, program->constants.getData(), program->constants.getLength() * sizeof(mreal_t));
+
+  const VMInst* code = program->code.getData();
+  const VMInst* ip = code;
+
+#if defined(MP_VM_DIRECT_THREADING)
+  VM_DISPATCH();
+#else
+_Dispatch:
+  switch (ip->op)
+#endif // MP_VM_DIRECT_THREADING
+  {
+    VM_HANDLER(VM_LOAD)
+      r[ip->dst] = reinterpret_cast<const mreal_t*>(data + ip->offset)[0];
+      VM_NEXT();
+
+    VM_HANDLER(VM_LOAD_F32)
+      r[ip->dst] = reinterpret_cast<const float*>(data + ip->offset)[0];
+      VM_NEXT();
+
+    VM_HANDLER(VM_STORE)
+      r[ip->dst] = r[ip->a];
+      reinterpret_cast<mreal_t*>(data + ip->offset)[0] = r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_STORE_F32)
+      r[ip->dst] = r[ip->a];
+      reinterpret_cast<float*>(data + ip->offset)[0] = (float)r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_MOV)
+      r[ip->dst] = r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_ROUND_F32)
+      r[ip->dst] = (float)r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_ADD)
+      r[ip->dst] = r[ip->a] + r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_SUB)
+      r[ip->dst] = r[ip->a] - r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_MUL)
+      r[ip->dst] = r[ip->a] * r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_DIV)
+      r[ip->dst] = r[ip->a] / r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_MOD)
+      r[ip->dst] = fmod(r[ip->a], r[ip->b]);
+      VM_NEXT();
+
+    VM_HANDLER(VM_POW)
+      r[ip->dst] = pow(r[ip->a], r[ip->b]);
+      VM_NEXT();
+
+    VM_HANDLER(VM_NEG)
+      r[ip->dst] = -r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_MIN)
+      r[ip->dst] = r[ip->a] < r[ip->b] ? r[ip->a] : r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_MAX)
+      r[ip->dst] = r[ip->a] > r[ip->b] ? r[ip->a] : r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_AVG)
+      r[ip->dst] = (r[ip->a] + r[ip->b]) * 0.5;
+      VM_NEXT();
+
+    VM_HANDLER(VM_ABS)
+      r[ip->dst] = fabs(r[ip->a]);
+      VM_NEXT();
+
+    VM_HANDLER(VM_SQRT)
+      r[ip->dst] = sqrt(r[ip->a]);
+      VM_NEXT();
+
+    VM_HANDLER(VM_RECIPROCAL)
+      r[ip->dst] = 1.0 / r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_EQ)
+      r[ip->dst] = r[ip->a] == r[ip->b] ? 1.0 : 0.0;
+      VM_NEXT();
+
+    VM_HANDLER(VM_NE)
+      r[ip->dst] = r[ip->a] != r[ip->b] ? 1.0 : 0.0;
+      VM_NEXT();
+
+    VM_HANDLER(VM_LT)
+      r[ip->dst] = r[ip->a] < r[ip->b] ? 1.0 : 0.0;
+      VM_NEXT();
+
+    VM_HANDLER(VM_LE)
+      r[ip->dst] = r[ip->a] <= r[ip->b] ? 1.0 : 0.0;
+      VM_NEXT();
+
+    VM_HANDLER(VM_SELECT)
+      r[ip->dst] = r[ip->cond] != 0 ? r[ip->a] : r[ip->b];
+      VM_NEXT();
+
+    VM_HANDLER(VM_CALL0)
+      r[ip->dst] = ((MFunc_Ret_F_ARG0)ip->fn)();
+      VM_NEXT();
+
+    VM_HANDLER(VM_CALL1)
+      r[ip->dst] = ((MFunc_Ret_F_ARG1)ip->fn)(r[ip->a]);
+      VM_NEXT();
+
+    VM_HANDLER(VM_CALL2)
+      r[ip->dst] = ((MFunc_Ret_F_ARG2)ip->fn)(r[ip->a], r[ip->b]);
+      VM_NEXT();
+
+    VM_HANDLER(VM_CALLN)
+    {
+      const mreal_t* t = r + ip->a;
+      void* fn = ip->fn;
+
+      switch (ip->b)
+      {
+        case 3: r[ip->dst] = ((MFunc_Ret_F_ARG3)fn)(t[0], t[1], t[2]); break;
+        case 4: r[ip->dst] = ((MFunc_Ret_F_ARG4)fn)(t[0], t[1], t[2], t[3]); break;
+        case 5: r[ip->dst] = ((MFunc_Ret_F_ARG5)fn)(t[0], t[1], t[2], t[3], t[4]); break;
+        case 6: r[ip->dst] = ((MFunc_Ret_F_ARG6)fn)(t[0], t[1], t[2], t[3], t[4], t[5]); break;
+        case 7: r[ip->dst] = ((MFunc_Ret_F_ARG7)fn)(t[0], t[1], t[2], t[3], t[4], t[5], t[6]); break;
+        case 8: r[ip->dst] = ((MFunc_Ret_F_ARG8)fn)(t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7]); break;
+      }
+      VM_NEXT();
+    }
+
+    VM_HANDLER(VM_OUT)
+      *result++ = r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_OUT_F32)
+      *result++ = (float)r[ip->a];
+      VM_NEXT();
+
+    VM_HANDLER(VM_END)
+      *result++ = r[ip->a];
+      goto _NextRow;
+
+    VM_HANDLER(VM_END_F32)
+      *result++ = (float)r[ip->a];
+      goto _NextRow;
+
+#if !defined(MP_VM_DIRECT_THREADING)
+    default:
+      MP_ASSERT_NOT_REACHED();
+      goto _End;
+#endif // !MP_VM_DIRECT_THREADING
+  }
+
+_NextRow:
+  if (--count != 0)
+  {
+    data += stride;
+    ip = code;
+    VM_DISPATCH();
+  }
+
+#if !defined(MP_VM_DIRECT_THREADING)
+_End:
+#endif // !MP_VM_DIRECT_THREADING
+  if (r != buffer) ::free(r);
+}
+
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_HANDLER
+
+// ============================================================================
+// [MathPresso::VM - API]
+// ============================================================================
+
+static VMProgram* mpVMCompileTree(WorkContext& ctx, ASTElement* tree, bool isSet)
+{
+  VMProgram* program = new(std::nothrow) VMProgram();
+  if (program == NULL) return NULL;
+
+  program->registerCount = 0;
+  program->resultCount = 1;
+
+  VMCompiler compiler(ctx, program);
+  if (!compiler.compile(tree, isSet))
+  {
+    delete program;
+    return NULL;
+  }
+
+  // Replace opcodes by handler addresses.
+  const void* const* handlers;
+  mpVMRun(NULL, NULL, NULL, 0, 0, &handlers);
+
+  if (handlers != NULL)
+  {
+    size_t i, len = program->code.getLength();
+    for (i = 0; i < len; i++) program->code[i].handler = handlers[program->code[i].op];
+  }
+
+  return program;
+}
+
+VMProgram* mpVMCompile(WorkContext& ctx, ASTElement* tree)
+{
+  return mpVMCompileTree(ctx, tree, false);
+}
+
+VMProgram* mpVMCompileSet(WorkContext& ctx, ASTBlock* outputs)
+{
+  return mpVMCompileTree(ctx, outputs, true);
+}
+
+void mpVMFree(VMProgram* program)
+{
+  delete program;
+}
+
+void mpVMExecute(const VMProgram* program, mreal_t* result, void* rows, size_t stride, size_t count)
+{
+  mpVMRun(program, result, reinterpret_cast<char*>(rows), stride, count, NULL);
+}
+
+} // MathPresso namespace
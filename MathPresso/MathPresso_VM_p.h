@@ -0,0 +1,196 @@
+// MathPresso - Mathematical Expression Parser and JIT Compiler.
+
+// Copyright (c) 2008-2010, Petr Kobalicek <kobalicek.petr@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _MATHPRESSO_VM_P_H
+#define _MATHPRESSO_VM_P_H
+
+#include "MathPresso.h"
+#include "MathPresso_AST_p.h"
+#include "MathPresso_Context_p.h"
+#include "MathPresso_Util_p.h"
+
+namespace MathPresso {
+
+// ============================================================================
+// [MathPresso::VM - Configuration]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Dispatch by jumping directly to the handler address stored in each
+//! instruction (GCC and Clang "labels as values"), otherwise by switch.
+#if defined(__GNUC__)
+#define MP_VM_DIRECT_THREADING
+#endif // __GNUC__
+
+// ============================================================================
+// [MathPresso::VM - Opcodes]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Opcode of @ref VMInst.
+//!
+//! Operands are indexes into the register file, @c dst is the destination
+//! and @c a, @c b are sources. Constants are preloaded into the first
+//! registers once per call, variables are loaded into their registers at
+//! the beginning of each row.
+enum VM_OPCODE
+{
+  //! @brief dst = *(mreal_t*)(row + offset)
+  VM_LOAD = 0,
+  //! @brief dst = *(float*)(row + offset)
+  VM_LOAD_F32,
+  //! @brief *(mreal_t*)(row + offset) = dst = a
+  VM_STORE,
+  //! @brief *(float*)(row + offset) = dst = a
+  VM_STORE_F32,
+  //! @brief dst = a
+  VM_MOV,
+  //! @brief dst = (float)a, intermediate result of a single precision
+  //! expression.
+  VM_ROUND_F32,
+
+  VM_ADD,
+  VM_SUB,
+  VM_MUL,
+  VM_DIV,
+  VM_MOD,
+  VM_POW,
+  VM_NEG,
+
+  VM_MIN,
+  VM_MAX,
+  VM_AVG,
+  VM_ABS,
+  VM_SQRT,
+  VM_RECIPROCAL,
+
+  //! @brief dst = a == b ? 1 : 0
+  VM_EQ,
+  //! @brief dst = a != b ? 1 : 0
+  VM_NE,
+  //! @brief dst = a < b ? 1 : 0
+  VM_LT,
+  //! @brief dst = a <= b ? 1 : 0
+  VM_LE,
+  //! @brief dst = cond != 0 ? a : b
+  VM_SELECT,
+
+  //! @brief dst = fn()
+  VM_CALL0,
+  //! @brief dst = fn(a)
+  VM_CALL1,
+  //! @brief dst = fn(a, b)
+  VM_CALL2,
+  //! @brief dst = fn(a, a + 1, ..., a + b - 1)
+  VM_CALLN,
+
+  //! @brief Store a as the next result of the row (expression set).
+  VM_OUT,
+  //! @brief Store a rounded to float as the next result of the row.
+  VM_OUT_F32,
+
+  //! @brief Store a as the row result and continue with the next row.
+  VM_END,
+  //! @brief Store a rounded to float as the row result and continue with
+  //! the next row.
+  VM_END_F32,
+
+  _VM_OPCODE_COUNT
+};
+
+// ============================================================================
+// [MathPresso::VMInst]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief VM instruction.
+struct VMInst
+{
+  //! @brief Handler address (direct threading only).
+  const void* handler;
+  //! @brief Opcode, see @ref VM_OPCODE.
+  uint op;
+
+  uint dst;
+  uint a;
+  uint b;
+
+  union
+  {
+    //! @brief Variable offset (VM_LOAD, VM_STORE).
+    int offset;
+    //! @brief Function (VM_CALL...).
+    void* fn;
+    //! @brief Condition register (VM_SELECT).
+    uint cond;
+  };
+};
+
+// ============================================================================
+// [MathPresso::VMProgram]
+// ============================================================================
+
+//! @internal
+//!
+//! @brief Register bytecode compiled from the AST.
+struct MATHPRESSO_HIDDEN VMProgram
+{
+  //! @brief Instructions evaluated for each row, the last one is VM_END.
+  Vector<VMInst> code;
+  //! @brief Values of registers [0, constants.getLength()).
+  Vector<mreal_t> constants;
+  //! @brief Count of registers.
+  uint registerCount;
+  //! @brief Count of results of each row.
+  uint resultCount;
+};
+
+//! @internal
+//!
+//! @brief Compile @a tree into a @ref VMProgram, return NULL on out of memory.
+MATHPRESSO_HIDDEN VMProgram* mpVMCompile(WorkContext& ctx, ASTElement* tree);
+
+//! @internal
+//!
+//! @brief Compile children of @a outputs into a @ref VMProgram that stores
+//! one result per child, return NULL on out of memory.
+MATHPRESSO_HIDDEN VMProgram* mpVMCompileSet(WorkContext& ctx, ASTBlock* outputs);
+
+//! @internal
+//!
+//! @brief Free program created by @ref mpVMCompile().
+MATHPRESSO_HIDDEN void mpVMFree(VMProgram* program);
+
+//! @internal
+//!
+//! @brief Evaluate @a program for @a count rows (see @ref MEvalFunc).
+MATHPRESSO_HIDDEN void mpVMExecute(const VMProgram* program, mreal_t* result, void* rows, size_t stride, size_t count);
+
+} // MathPresso namespace
+
+#endif // _MATHPRESSO_VM_P_H
@@ -27,8 +27,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !_WIN32
+
 struct TestExpression
 {
   const char* expression;
@@ -42,10 +50,27 @@ struct TestExpression
   (sizeof(table) / sizeof(table[0]))
 
 #define TEST_EXPRESSION(expression) \
-  { #expression, (INITVARS, expression) }
+  { #expression, (MathPresso::mreal_t)(INITVARS, expression) }
 
 #define ADDCONST(c) addConstant(#c, (c))
 
+// Distance of a and b in units in the last place, NaN is equal to NaN and
+// zeros of different signs are not equal.
+static double mpUlpDistance(double a, double b)
+{
+  if (a != a || b != b) return (a != a && b != b) ? 0.0 : HUGE_VAL;
+
+  int64_t ia, ib;
+  memcpy(&ia, &a, sizeof(double));
+  memcpy(&ib, &b, sizeof(double));
+  if (a == b) return (ia == ib) ? 0.0 : HUGE_VAL;
+
+  // Sign and magnitude to a monotonic integer.
+  if (ia < 0) ia = INT64_MIN - ia;
+  if (ib < 0) ib = INT64_MIN - ib;
+  return (double)(ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia);
+}
+
 
 int main(int argc, char* argv[])
 {
@@ -93,6 +118,9 @@ int main(int argc, char* argv[])
     TEST_EXPRESSION( (((((((((x+1.35)+PI)/PI)-y)+z)-z)+y)/x)+0.81) ),
     TEST_EXPRESSION( 1+(x+2)+3 ),
     TEST_EXPRESSION( 1+(x+y)+z ),
+    TEST_EXPRESSION( 1 + x - 2 + y + 3 ),
+    TEST_EXPRESSION( 2*x/4*y ),
+    TEST_EXPRESSION( -x*-y/8 - (1 - z*3)/-2 + 0.5*(t - 1.25 - x)/z/0.25 ),
     TEST_EXPRESSION( x=2*3+1 ),
     TEST_EXPRESSION( (x+y)*z ),
     TEST_EXPRESSION( (x=y)*x ),
@@ -103,12 +131,16 @@ int main(int argc, char* argv[])
     TEST_EXPRESSION( hypot(x, y) ),
     TEST_EXPRESSION( cos(PI/4)*x - sin(PI/4)*y ),
     TEST_EXPRESSION( sqrt(x*x + y*y + z*z) ),
+    TEST_EXPRESSION( exp(-x) * log(y) + sin(z) * cos(t) - log10(x + 100) ),
+    TEST_EXPRESSION( sin(x * 10000000) + cos(y * 10000000) ),
     // operator ^
     { "sqrt(x^2 + y^2 + z^2)", (INITVARS, sqrt(x*x + y*y + z*z)) },
     { "x^-2 + y^-3", (INITVARS, 1/(x*x) + pow(y, -3)) },
+    { "x^0.5 + y^-0.5 - z^-1 + pow(x, 3) - (y+1)^4 + pow(z, -2) + t^0", (INITVARS, sqrt(x) + 1/sqrt(y) - 1/z + pow(x, 3) - pow(y+1, 4) + pow(z, -2) + 1) },
     // semicolon is comma in C++
     { "z=x;x=3*x+1*y;y=1*x-3*z", (INITVARS, z=x,x=3*x+1*y,y=1*x-3*z) },
     { "t = cx*x - cy*y + ox; y = cy*x + cx*y + oy; x = t", (INITVARS, t=cx*x - cy*y + ox, y = cy*x + cx*y + oy, x = t) },
+    { "t = x*2; t = t + y; z = t*t - (y = t); x = t - y + z", (INITVARS, t = x*2, t = t + y, z = t*t - (y = t), x = t - y + z) },
     { "x=cx;y=cy;t=z;z=t;", (INITVARS, x=cx,y=cy,t=z,z=t) },
     // assignment
     { "z = 1*z - 0*z + 1", (INITVARS, z = 1*z - 0*z + 1) },
@@ -123,7 +155,26 @@ int main(int argc, char* argv[])
     // optimization tests
     TEST_EXPRESSION( x = 2 * - - - + + - 2 + 0*y + z/1 ),
     { "1*x - 0*y + z^1 - t/-1 + 0", (INITVARS, 1*x - 0*y + pow(z, 1) - t/-1 + 0) },
-    { "sin(x*1^t) - cos(0*y + PI) + z^(-4/(-2-2))", (INITVARS, sin(x*pow(1,t)) - cos(0*y + PI) + pow(z, -4/(-2-2)) ) }
+    { "x - 10000000000000000 + 10000000000000000", (INITVARS, x - 1e16 + 1e16) },
+    { "x*10^200/10^300*10^200 < 10^101", (INITVARS, (MathPresso::mreal_t)(x*1e200/1e300*1e200 < 1e101)) },
+    { "sin(x*1^t) - cos(0*y + PI) + z^(-4/(-2-2))", (INITVARS, sin(x*pow(1,t)) - cos(0*y + PI) + pow(z, -4/(-2-2)) ) },
+    // rounding
+    { "floor(x/0.25)*0.25 + ceil(y*3) - trunc(-z*7) + round(t*5)", (INITVARS, floor(x/0.25)*0.25 + ceil(y*3) - trunc(-z*7) + round(t*5)) },
+    { "round(t + (0.5 - 1/18014398509481984))", (INITVARS, round(t + 0.49999999999999994)) },
+    { "round(t - 2.5)", (INITVARS, round(t - 2.5)) },
+    { "round(t + 4503599627370497)", (INITVARS, round(t + 4503599627370497.0)) },
+    { "t % 0.75 + (x*10) % y", (INITVARS, fmod(t, 0.75) + fmod(x*10, y)) },
+    // comparisons and conditions
+    TEST_EXPRESSION( (x < y) + (x <= y)*2 + (x > y)*4 + (x >= y)*8 + (x == x)*16 + (x != y)*32 ),
+    TEST_EXPRESSION( x < y ? x*2 : y - z ),
+    TEST_EXPRESSION( y > x ? 1 : z >= 9.8 ? 2 + t : 3 ),
+    TEST_EXPRESSION( x > y ? 1 : z >= 9.8 ? 2 + t : 3 ),
+    TEST_EXPRESSION( x > y ? 1 : z >= 9.95 ? 2 + t : 3 ),
+    TEST_EXPRESSION( (x - 5.1 ? y : 0) + (t ? y : z) * 2 ),
+    // common subexpressions
+    TEST_EXPRESSION( sqrt(x*x + y*y) / (x*x + y*y) ),
+    TEST_EXPRESSION( (x+y)*(y+x) - sin(x+y)*sin(y+x) ),
+    { "t = x*y; x = x*y + 1; y = x*y + t", (INITVARS, t = x*y, x = x*y + 1, y = x*y + t) }
   };
 
   int numok0 = 0,
@@ -201,6 +252,663 @@ int main(int argc, char* argv[])
          "op_jit:  %d of %d ok\n", numok0, n, numok1, n, numok2, n);
   //getchar();
 
+  // Batch evaluation (row loop inside of the compiled function).
+  {
+    const int numRows = 17;
+    MathPresso::mreal_t rows[numRows][4];
+    MathPresso::mreal_t columns[4][numRows];
+    MathPresso::mreal_t out0[numRows];
+    MathPresso::mreal_t out2[numRows];
+    MathPresso::mreal_t outc0[numRows];
+    MathPresso::mreal_t outc2[numRows];
+
+    for (int i = 0; i < numRows; i++)
+    {
+      rows[i][0] = columns[0][i] = i * 0.5;
+      rows[i][1] = columns[1][i] = 2.0 - i;
+      rows[i][2] = columns[2][i] = i * i;
+      rows[i][3] = columns[3][i] = 0.0;
+    }
+    const MathPresso::mreal_t* columnPtrs[4] = { columns[0], columns[1], columns[2], columns[3] };
+
+    e0.create(ctx, "x*y + sqrt(z) - 1.5", MathPresso::MOPTION_NO_JIT);
+    e2.create(ctx, "x*y + sqrt(z) - 1.5");
+    e0.evaluateBatch(rows, sizeof(rows[0]), out0, numRows);
+    e2.evaluateBatch(rows, sizeof(rows[0]), out2, numRows);
+    e0.evaluateColumns(columnPtrs, outc0, numRows);
+    e2.evaluateColumns(columnPtrs, outc2, numRows);
+
+    int numokBatch = 0;
+    for (int i = 0; i < numRows; i++)
+    {
+      MathPresso::mreal_t expected = rows[i][0] * rows[i][1] + sqrt(rows[i][2]) - 1.5;
+      if (fabs(out0[i] - expected) < 0.0000001 &&
+          fabs(out2[i] - expected) < 0.0000001 &&
+          fabs(outc0[i] - expected) < 0.0000001 &&
+          fabs(outc2[i] - expected) < 0.0000001) numokBatch++;
+    }
+    printf("batch:   %d of %d ok\n", numokBatch, numRows);
+  }
+
+  // Inlined exp(), log(), log10(), sin() and cos() against the C library,
+  // by rows and by columns (two rows by each instruction), within 1 ulp
+  // (exp, log) and 2 ulp (log10, sin, cos). NaN, infinity and zero must be
+  // the same, including the sign of zero.
+  {
+    static const double values[] =
+    {
+      NAN, INFINITY, -INFINITY, 0.0, -0.0, 1.0, -1.0, 0.5, 2.0, 10.0, -10.0, 1e-8, -1e-8,
+      // Denormals and the smallest normal number.
+      4.9406564584124654e-324, 1e-310, -1e-310, 2.2250738585072009e-308, 2.2250738585072014e-308,
+      // exp() overflow, denormal results and underflow.
+      709.78, 709.79, 710.0, 800.0, -708.5, -720.0, -745.1, -745.2, -746.0, -800.0,
+      // Close to multiples of pi/2.
+      0.78539816339744828, 1.5707963267948966, 3.1415926535897931, -2.3561944901923448, -1285231.8377688916,
+      // sin() and cos() above 1647099 call the C library.
+      1e6, 1647099.0, 1647100.0, -1647100.0, 2e6, 1e10, 1e22, -3e7, 1e300
+    };
+    const int numRows = (int)TABLE_SIZE(values);
+
+    MathPresso::mreal_t rows[numRows][4];
+    MathPresso::mreal_t out[numRows];
+    MathPresso::mreal_t outc[numRows];
+
+    for (int i = 0; i < numRows; i++)
+    {
+      rows[i][0] = values[i];
+      rows[i][1] = rows[i][2] = rows[i][3] = 0.0;
+    }
+    const MathPresso::mreal_t* columnPtrs[4] = { values, NULL, NULL, NULL };
+
+    static const char* names[] = { "exp(x)", "log(x)", "log10(x)", "sin(x)", "cos(x)" };
+    static double (*const functions[])(double) = { exp, log, log10, sin, cos };
+    static const double bounds[] = { 1, 1, 2, 2, 2 };
+
+    int numokKernels = 0;
+    for (int f = 0; f < 5; f++)
+    {
+      e0.create(ctx, names[f]);
+      e0.evaluateBatch(rows, sizeof(rows[0]), out, numRows);
+      e0.evaluateColumns(columnPtrs, outc, numRows);
+
+      for (int i = 0; i < numRows; i++)
+      {
+        double expected = functions[f](values[i]);
+        if (mpUlpDistance(out[i], expected) <= bounds[f] &&
+            mpUlpDistance(outc[i], expected) <= bounds[f]) numokKernels++;
+        else
+          printf("%s for x=%.17g: %.17g, %.17g by columns, expected %.17g\n",
+            names[f], values[i], out[i], outc[i], expected);
+      }
+    }
+    printf("kernels: %d of %d ok\n", numokKernels, numRows * 5);
+  }
+
+  // Single precision variables (MOPTION_FLOAT32).
+  {
+    const int numRows = 19;
+    float rows[numRows][3];
+    float columns[3][numRows];
+    MathPresso::mreal_t out0[numRows];
+    MathPresso::mreal_t out2[numRows];
+    float outc0[numRows];
+    float outc2[numRows];
+
+    for (int i = 0; i < numRows; i++)
+    {
+      rows[i][0] = columns[0][i] = i * 0.25f;
+      rows[i][1] = columns[1][i] = 3.0f - i;
+      rows[i][2] = columns[2][i] = (float)(i * i);
+    }
+    const float* columnPtrs[3] = { columns[0], columns[1], columns[2] };
+
+    MathPresso::Context ctxf;
+    ctxf.addEnvironment(MathPresso::MENVIRONMENT_MATH);
+    ctxf.addVariable("x", 0 * sizeof(float));
+    ctxf.addVariable("y", 1 * sizeof(float));
+    ctxf.addVariable("z", 2 * sizeof(float));
+
+    const char* exp = "abs(x*y) + sqrt(z) - sin(x) / 3";
+    e0.create(ctxf, exp, MathPresso::MOPTION_FLOAT32 | MathPresso::MOPTION_NO_JIT);
+    e2.create(ctxf, exp, MathPresso::MOPTION_FLOAT32);
+    e0.evaluateBatch(rows, sizeof(rows[0]), out0, numRows);
+    e2.evaluateBatch(rows, sizeof(rows[0]), out2, numRows);
+    e0.evaluateColumns(columnPtrs, outc0, numRows);
+    e2.evaluateColumns(columnPtrs, outc2, numRows);
+
+    int numokFloat = 0;
+    for (int i = 0; i < numRows; i++)
+    {
+      double expected = fabs(rows[i][0] * rows[i][1]) + sqrt(rows[i][2]) - sin(rows[i][0]) / 3;
+      double epsilon = 0.00001 * (1.0 + fabs(expected));
+      if (fabs(out0[i] - expected) < epsilon &&
+          fabs(out2[i] - expected) < epsilon &&
+          fabs(outc0[i] - expected) < epsilon &&
+          fabs(outc2[i] - expected) < epsilon) numokFloat++;
+    }
+    // Odd integers above 2^23 are not rounded to the next even one.
+    float rowRound[3] = { 8388609.0f, -2.5f, 0.0f };
+    MathPresso::mreal_t outRound[2];
+    e0.create(ctxf, "round(x)", MathPresso::MOPTION_FLOAT32 | MathPresso::MOPTION_NO_JIT);
+    e2.create(ctxf, "round(x) + round(y)", MathPresso::MOPTION_FLOAT32);
+    e0.evaluateBatch(rowRound, sizeof(rowRound), &outRound[0], 1);
+    e2.evaluateBatch(rowRound, sizeof(rowRound), &outRound[1], 1);
+    numokFloat += outRound[0] == 8388609.0 && outRound[1] == 8388606.0;
+
+    // Intermediate results are rounded to float by all backends, 2^24 + 1
+    // is 2^24 in single precision.
+    float rowSum[3] = { 16777216.0f, 0.0f, 0.0f };
+    MathPresso::mreal_t outSum[2];
+    e0.create(ctxf, "x + 1 - 1", MathPresso::MOPTION_FLOAT32 | MathPresso::MOPTION_NO_JIT);
+    e2.create(ctxf, "x + 1 - 1", MathPresso::MOPTION_FLOAT32);
+    e0.evaluateBatch(rowSum, sizeof(rowSum), &outSum[0], 1);
+    e2.evaluateBatch(rowSum, sizeof(rowSum), &outSum[1], 1);
+    numokFloat += outSum[0] == 16777215.0 && outSum[1] == 16777215.0;
+
+    printf("float32: %d of %d ok\n", numokFloat, numRows + 2);
+  }
+
+  // Parallel evaluation, results must be the same as evaluated by one thread.
+  {
+    const int numRows = 100003;
+    MathPresso::mreal_t* rows = new MathPresso::mreal_t[numRows * 4];
+    MathPresso::mreal_t* out1 = new MathPresso::mreal_t[numRows];
+    MathPresso::mreal_t* outp = new MathPresso::mreal_t[numRows];
+    MathPresso::mreal_t* outc = new MathPresso::mreal_t[numRows];
+
+    for (int i = 0; i < numRows * 4; i++) rows[i] = (i % 97) * 0.125;
+    const MathPresso::mreal_t* columnPtrs[2] = { rows, rows + numRows };
+
+    MathPresso::ParallelEvaluator pe(4, MathPresso::MPARALLEL_PIN_THREADS);
+    e2.create(ctx, "x*y - sqrt(y) + 2");
+    e2.evaluateBatch(rows, 4 * sizeof(MathPresso::mreal_t), out1, numRows);
+    pe.evaluateBatch(e2, rows, 4 * sizeof(MathPresso::mreal_t), outp, numRows);
+
+    int numokParallel = 0;
+    for (int i = 0; i < numRows; i++)
+    {
+      if (out1[i] == outp[i]) numokParallel++;
+    }
+
+    e2.evaluateColumns(columnPtrs, out1, numRows);
+    pe.evaluateColumns(e2, columnPtrs, outc, numRows);
+    for (int i = 0; i < numRows; i++)
+    {
+      if (out1[i] != outc[i]) numokParallel--;
+    }
+    printf("parallel: %d of %d ok (%u threads)\n", numokParallel, numRows, pe.getThreadCount());
+
+    delete[] outc;
+    delete[] outp;
+    delete[] out1;
+    delete[] rows;
+  }
+
+  // Reduction, results are accumulated without storing them.
+  {
+    const int numRows = 1003;
+    MathPresso::mreal_t* rows = new MathPresso::mreal_t[numRows * 4];
+    MathPresso::mreal_t* out = new MathPresso::mreal_t[numRows];
+
+    for (int i = 0; i < numRows; i++)
+    {
+      rows[i * 4 + 0] = (i % 37) * 0.25;
+      rows[i * 4 + 1] = 3.0 - (i % 11);
+      rows[i * 4 + 2] = 0.0;
+      rows[i * 4 + 3] = 0.0;
+    }
+
+    const char* exp = "x*y - sqrt(x) + (y < 0 ? 1 : 0)";
+    const size_t stride = 4 * sizeof(MathPresso::mreal_t);
+    int numokReduce = 0;
+    int numReduce = 0;
+
+    for (int k = 0; k < 2; k++)
+    {
+      MathPresso::Expression r;
+      r.create(ctx, exp, k == 0 ? MathPresso::MOPTION_NO_JIT : MathPresso::MOPTION_NONE);
+      r.evaluateBatch(rows, stride, out, numRows);
+
+      // Count of rows 0..3 and numRows check the tail of the unrolled loop.
+      const int counts[] = { 0, 1, 3, 4, 7, numRows };
+      for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+      {
+        int n = counts[c];
+        MathPresso::mreal_t sum = 0.0, mn = HUGE_VAL, mx = -HUGE_VAL;
+        size_t imin = (size_t)-1, imax = (size_t)-1;
+
+        for (int i = 0; i < n; i++)
+        {
+          sum += out[i];
+          if (out[i] < mn) { mn = out[i]; imin = i; }
+          if (out[i] > mx) { mx = out[i]; imax = i; }
+        }
+
+        size_t i0, i1, i2;
+        MathPresso::mreal_t rs = r.reduce(rows, stride, n, MathPresso::MREDUCE_SUM, &i0);
+        MathPresso::mreal_t rn = r.reduce(rows, stride, n, MathPresso::MREDUCE_MIN);
+        MathPresso::mreal_t rx = r.reduce(rows, stride, n, MathPresso::MREDUCE_MAX);
+        MathPresso::mreal_t rm = r.reduce(rows, stride, n, MathPresso::MREDUCE_MEAN);
+        MathPresso::mreal_t ran = r.reduce(rows, stride, n, MathPresso::MREDUCE_ARGMIN, &i1);
+        MathPresso::mreal_t rax = r.reduce(rows, stride, n, MathPresso::MREDUCE_ARGMAX, &i2);
+
+        bool ok = fabs(rs - sum) < 0.0000001 * (1.0 + fabs(sum)) && i0 == (size_t)-1 &&
+                  rn == mn && rx == mx &&
+                  (n == 0 ? rm != rm : fabs(rm - sum / n) < 0.0000001) &&
+                  (n == 0 ? ran != ran && rax != rax : ran == mn && rax == mx) &&
+                  i1 == imin && i2 == imax;
+        if (ok) numokReduce++;
+        numReduce++;
+      }
+    }
+    printf("reduce:  %d of %d ok\n", numokReduce, numReduce);
+
+    delete[] out;
+    delete[] rows;
+  }
+
+  // Expression set, more results of each row are computed by one call.
+  {
+    const int numRows = 9;
+    const int numExp = 4;
+    const char* exps[numExp] =
+    {
+      "x*y + sqrt(z)",
+      "sqrt(z) - x*y",
+      "t = x*y; t * 2",
+      "t + (x < y ? z : -z)"
+    };
+
+    int numokSet = 0;
+    for (int k = 0; k < 2; k++)
+    {
+      MathPresso::mreal_t rows[numRows][4];
+      MathPresso::mreal_t copy[numRows][4];
+      MathPresso::mreal_t out[numRows * numExp];
+
+      for (int i = 0; i < numRows; i++)
+      {
+        rows[i][0] = copy[i][0] = i * 0.5;
+        rows[i][1] = copy[i][1] = 2.0 - i;
+        rows[i][2] = copy[i][2] = i * i;
+        rows[i][3] = copy[i][3] = 0.0;
+      }
+
+      int options = k == 0 ? MathPresso::MOPTION_NO_JIT : MathPresso::MOPTION_NONE;
+      MathPresso::ExpressionSet set;
+      if (set.create(ctx, exps, numExp, options) != MathPresso::MRESULT_OK) continue;
+      set.evaluateBatch(rows, sizeof(rows[0]), out, numRows);
+
+      // Each expression evaluated alone, in the same order.
+      MathPresso::Expression single[numExp];
+      for (int j = 0; j < numExp; j++) single[j].create(ctx, exps[j], options);
+
+      for (int i = 0; i < numRows; i++)
+      {
+        bool ok = true;
+        for (int j = 0; j < numExp; j++)
+          ok &= fabs(out[i * numExp + j] - single[j].evaluate(copy[i])) < 0.0000001;
+        ok &= rows[i][3] == copy[i][3];
+        if (ok) numokSet++;
+      }
+    }
+
+    MathPresso::ExpressionSet bad;
+    const char* badExps[2] = { "x + 1", "y * (" };
+    bool okError = bad.create(ctx, badExps, 2) != MathPresso::MRESULT_OK && bad.getErrorIndex() == 1;
+
+    printf("set:     %d of %d ok, error %s\n", numokSet, numRows * 2, okError ? "ok" : "failed");
+  }
+
+  // Expression cache, the same formula written differently is compiled once.
+  {
+    MathPresso::ExpressionCache cache;
+    MathPresso::Expression c0, c1, c2, c3;
+    MathPresso::mreal_t v[4] = { 2.0, 3.0, 0.0, 0.0 };
+
+    c0.create(ctx, "x*y + sqrt(x)", MathPresso::MOPTION_NONE, &cache);
+    c1.create(ctx, "x * y  +  sqrt(x)", MathPresso::MOPTION_NONE, &cache);
+    c2.create(ctx, "sqrt(x) + y*x", MathPresso::MOPTION_NONE, &cache);
+    c3.create(ctx, "x*y + sqrt(x)", MathPresso::MOPTION_NO_JIT, &cache);
+
+    bool ok = cache.getHitCount() == 2 && cache.getMissCount() == 2 &&
+              c0.evaluate(v) == c1.evaluate(v) &&
+              c0.evaluate(v) == c2.evaluate(v) &&
+              c0.evaluate(v) == c3.evaluate(v);
+    printf("cache:   %s (%u hits, %u misses)\n", ok ? "ok" : "failed",
+      (unsigned int)cache.getHitCount(), (unsigned int)cache.getMissCount());
+  }
+
+  // Operands that assign aren't swapped, x*(x=y) reads x before the
+  // assignment and (x=y)*x after it.
+  {
+    MathPresso::ExpressionCache cache;
+    MathPresso::Expression c0, c1, c2, c3;
+    MathPresso::mreal_t v0[4] = { 2.0, 3.0, 0.0, 0.0 };
+    MathPresso::mreal_t v1[4] = { 2.0, 3.0, 0.0, 0.0 };
+    MathPresso::mreal_t v2[4] = { 2.0, 3.0, 0.0, 0.0 };
+    MathPresso::mreal_t v3[4] = { 2.0, 3.0, 0.0, 0.0 };
+
+    c0.create(ctx, "x*(x=y)", MathPresso::MOPTION_NONE, &cache);
+    c1.create(ctx, "(x=y)*x", MathPresso::MOPTION_NONE, &cache);
+    c2.create(ctx, "x*(x=y)", MathPresso::MOPTION_NONE);
+    c3.create(ctx, "(x=y)*x", MathPresso::MOPTION_NONE);
+
+    MathPresso::mreal_t r0 = c0.evaluate(v0);
+    MathPresso::mreal_t r1 = c1.evaluate(v1);
+    bool ok = cache.getHitCount() == 0 && cache.getMissCount() == 2 &&
+              r0 == c2.evaluate(v2) && r1 == c3.evaluate(v3);
+    printf("assign:  %s (%g, %g)\n", ok ? "ok" : "failed", (double)r0, (double)r1);
+  }
+
+#if !defined(_WIN32)
+  // Code stored to a private directory is loaded by another cache, a damaged
+  // file, a file or a directory writable by others is ignored.
+  {
+    char dir[] = "/tmp/mathpresso-XXXXXX";
+    bool ok = mkdtemp(dir) != NULL;
+    std::string file;
+
+    MathPresso::mreal_t v[4] = { 2.0, 3.0, 4.0, 0.0 };
+    size_t loads[5] = { 0, 0, 0, 0, 0 };
+    bool stored = false;
+
+    for (int i = 0; i < 5 && ok; i++)
+    {
+      if (i == 2)
+      {
+        // Flip the last byte of the code, the checksum doesn't match.
+        FILE* f = fopen(file.c_str(), "r+b");
+        int c = -1;
+        if (f != NULL && fseek(f, -1, SEEK_END) == 0 && (c = fgetc(f)) != EOF && fseek(f, -1, SEEK_END) == 0)
+          fputc(c ^ 0xFF, f);
+        if (f != NULL) fclose(f);
+      }
+      if (i == 3) chmod(file.c_str(), 0620);
+      if (i == 4) chmod(dir, 0770);
+
+      MathPresso::ExpressionCache cache;
+      MathPresso::Expression e;
+      cache.setDirectory(dir);
+
+      ok &= e.create(ctx, "x*y + z", MathPresso::MOPTION_NONE, &cache) == MathPresso::MRESULT_OK &&
+            e.evaluate(v) == 10.0;
+      loads[i] = cache.getLoadCount();
+
+      // Code of 64-bit processes is stored if it was compiled.
+      if (i == 0)
+      {
+        DIR* d = opendir(dir);
+        struct dirent* entry;
+        while (d != NULL && (entry = readdir(d)) != NULL)
+          if (strstr(entry->d_name, ".mpc") != NULL) file = std::string(dir) + "/" + entry->d_name;
+        if (d != NULL) closedir(d);
+
+        stored = !file.empty();
+        ok &= stored == (sizeof(void*) == 8 && e.isJitCompiled());
+      }
+    }
+
+    ok &= loads[0] == 0 && loads[1] == (stored ? 1 : 0) && loads[2] == 0 && loads[3] == 0 && loads[4] == 0;
+
+    // Tiered expression stores the code when it's compiled, the next one
+    // loads it when it's created.
+    if (ok && chmod(dir, 0700) == 0)
+    {
+      MathPresso::ExpressionCache c0, c1;
+      MathPresso::Expression t0, t1;
+      c0.setDirectory(dir);
+      c1.setDirectory(dir);
+
+      t0.create(ctx, "x*y - z", MathPresso::MOPTION_TIERED, &c0);
+      t0.setTieredThreshold(1);
+      ok &= t0.evaluate(v) == 2.0 && t0.evaluate(v) == 2.0;
+
+      t1.create(ctx, "x*y - z", MathPresso::MOPTION_TIERED, &c1);
+      ok &= t1.evaluate(v) == 2.0 && c1.getLoadCount() == (stored ? 1 : 0) && t1.isJitCompiled() == stored;
+    }
+
+    printf("disk:    %s (%s)\n", ok ? "ok" : "failed", stored ? "stored and loaded" : "not stored");
+
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+    while (d != NULL && (entry = readdir(d)) != NULL)
+      if (strstr(entry->d_name, ".mpc") != NULL) remove((std::string(dir) + "/" + entry->d_name).c_str());
+    if (d != NULL) closedir(d);
+    rmdir(dir);
+  }
+#endif // !_WIN32
+
+  // Fast math, division by a constant is multiplication by its reciprocal.
+  {
+    MathPresso::Expression f0, f1;
+    MathPresso::mreal_t v[4] = { 100.0, 7.0, 0.0, 0.0 };
+
+    f0.create(ctx, "x / 3.6 + y / 1000", MathPresso::MOPTION_NONE);
+    f1.create(ctx, "x / 3.6 + y / 1000", MathPresso::MOPTION_FAST_MATH);
+
+    MathPresso::mreal_t expected = 100.0 / 3.6 + 7.0 / 1000;
+    bool ok = f0.evaluate(v) == expected && fabs(f1.evaluate(v) - expected) < 0.0000001;
+    printf("fast:    %s\n", ok ? "ok" : "failed");
+  }
+
+  // Tiered expression, interpreted until enough rows were evaluated.
+  {
+    const int numRows = 64;
+    MathPresso::Expression t0, t1, t2;
+    MathPresso::mreal_t rows[numRows][4];
+    MathPresso::mreal_t out[numRows];
+
+    t0.create(ctx, "x*y + sqrt(x) - y/3", MathPresso::MOPTION_NO_JIT);
+    t1.create(ctx, "x*y + sqrt(x) - y/3", MathPresso::MOPTION_NONE);
+    t2.create(ctx, "x*y + sqrt(x) - y/3", MathPresso::MOPTION_TIERED);
+    t2.setTieredThreshold(100);
+
+    bool ok = !t2.isJitCompiled();
+    for (int k = 0; k < 4; k++)
+    {
+      for (int i = 0; i < numRows; i++)
+      {
+        rows[i][0] = k * numRows + i;
+        rows[i][1] = 1.0 - i;
+        rows[i][2] = rows[i][3] = 0.0;
+      }
+
+      t2.evaluateBatch(rows, sizeof(rows[0]), out, numRows);
+      for (int i = 0; i < numRows; i++)
+        ok &= out[i] == t0.evaluate(rows[i]);
+
+      // Columns and reductions are the same before and after the tier-up.
+      MathPresso::mreal_t columns[2][numRows];
+      for (int i = 0; i < numRows; i++)
+      {
+        columns[0][i] = rows[i][0];
+        columns[1][i] = rows[i][1];
+      }
+      const MathPresso::mreal_t* columnPtrs[2] = { columns[0], columns[1] };
+
+      t2.evaluateColumns(columnPtrs, out, numRows);
+      for (int i = 0; i < numRows; i++)
+        ok &= fabs(out[i] - t0.evaluate(rows[i])) <= 0.0000001 * fabs(out[i]);
+      ok &= fabs(t2.reduce(rows, sizeof(rows[0]), numRows, MathPresso::MREDUCE_SUM) -
+                 t0.reduce(rows, sizeof(rows[0]), numRows, MathPresso::MREDUCE_SUM)) < 0.001;
+    }
+
+    // Compiled after the second batch if JIT compilation is available.
+    ok &= t2.isJitCompiled() == t1.isJitCompiled();
+    printf("tiered:  %s\n", ok ? "ok" : "failed");
+  }
+
+  // Asynchronous compilation, interpreted until the background thread is done.
+  {
+    MathPresso::Expression a0, a1, a2;
+    MathPresso::mreal_t v[4] = { 3.0, -2.0, 0.0, 0.0 };
+
+    a0.create(ctx, "x*y - sqrt(x) / y", MathPresso::MOPTION_NO_JIT);
+    a1.create(ctx, "x*y - sqrt(x) / y", MathPresso::MOPTION_NONE);
+
+    bool ok = a2.createAsync(ctx, "x*y - sqrt(x) / y") == MathPresso::MRESULT_OK &&
+              a2.evaluate(v) == a0.evaluate(v);
+    a2.waitCompiled();
+    ok &= a2.evaluate(v) == a0.evaluate(v) && a2.isJitCompiled() == a1.isJitCompiled();
+
+    MathPresso::Expression bad;
+    ok &= bad.createAsync(ctx, "x * (y") != MathPresso::MRESULT_OK;
+    printf("async:   %s\n", ok ? "ok" : "failed");
+  }
+
+  // Many expressions created by more threads.
+  {
+    const int numMany = 200;
+    char texts[numMany][32];
+    const char* sources[numMany];
+
+    for (int i = 0; i < numMany; i++)
+    {
+      sprintf(texts[i], "x * %d + y", i);
+      sources[i] = texts[i];
+    }
+    sprintf(texts[150], "x * (y");
+    sprintf(texts[170], "x * w");
+
+    MathPresso::Expression* many = new MathPresso::Expression[numMany];
+    MathPresso::mresult_t r = ctx.compileMany(sources, numMany, many, MathPresso::MOPTION_NONE, 4);
+    MathPresso::mreal_t v[4] = { 2.0, 0.5, 0.0, 0.0 };
+
+    int numokMany = 0;
+    for (int i = 0; i < numMany; i++)
+    {
+      if (i == 150 || i == 170)
+        numokMany += many[i].evaluate(v) == 0.0;
+      else
+        numokMany += many[i].evaluate(v) == i * 2.0 + 0.5;
+    }
+
+    // The result is the error of the first expression that failed.
+    MathPresso::Expression first;
+    bool okError = r != MathPresso::MRESULT_OK && r == first.create(ctx, texts[150]);
+
+    printf("many:    %d of %d ok, error %s\n", numokMany, numMany, okError ? "ok" : "failed");
+    delete[] many;
+  }
+
+  // Code arena, code of the old generation is unmapped when it's freed.
+  {
+    const int numArena = 10;
+    MathPresso::CodeArena arena;
+    MathPresso::Context actx(ctx);
+    actx.setCodeArena(&arena);
+
+    MathPresso::Expression* gen0 = new MathPresso::Expression[numArena];
+    MathPresso::Expression* gen1 = new MathPresso::Expression[numArena];
+    MathPresso::mreal_t v[4] = { 2.0, 0.5, 0.0, 0.0 };
+    char text[32];
+
+    bool ok = true;
+    for (int i = 0; i < numArena; i++)
+    {
+      sprintf(text, "x * %d + y", i);
+      gen0[i].create(actx, text);
+      ok &= gen0[i].evaluate(v) == i * 2.0 + 0.5;
+    }
+
+    // Without the JIT compiler there is no code in the arena.
+    size_t numCode = gen0[0].isJitCompiled() ? numArena : 0;
+    ok &= arena.getFunctionCount() == numCode && arena.getBlockCount() == (numCode ? 1 : 0);
+
+    arena.nextGeneration();
+    for (int i = 0; i < numArena; i++)
+    {
+      sprintf(text, "x * %d - y", i);
+      gen1[i].create(actx, text);
+      ok &= gen1[i].evaluate(v) == i * 2.0 - 0.5;
+    }
+
+    delete[] gen0;
+    ok &= arena.getFunctionCount() == numCode && arena.getBlockCount() == (numCode ? 1 : 0);
+
+    delete[] gen1;
+    ok &= arena.getFunctionCount() == 0;
+    printf("arena:   %s (%u blocks)\n", ok ? "ok" : "failed", (unsigned int)arena.getBlockCount());
+  }
+
+  // Many symbols, the table grows and deleted symbols are not found.
+  {
+    const int numSymbols = 5000;
+    MathPresso::Context sctx(ctx);
+    MathPresso::mreal_t v[4] = { 2.0, 0.5, 0.0, 0.0 };
+    char name[32];
+    char text[64];
+
+    for (int i = 0; i < numSymbols; i++)
+    {
+      sprintf(name, "c%d", i);
+      sctx.addConstant(name, (MathPresso::mreal_t)i);
+    }
+
+    for (int i = 0; i < numSymbols; i += 2)
+    {
+      sprintf(name, "c%d", i);
+      sctx.delSymbol(name);
+    }
+
+    int numokSymbols = 0;
+    for (int i = 0; i < numSymbols; i += 7)
+    {
+      MathPresso::Expression e;
+      sprintf(text, "c%d * x + y", i);
+
+      if (i % 2 == 0)
+        numokSymbols += e.create(sctx, text) == MathPresso::MRESULT_INVALID_SYMBOL;
+      else
+        numokSymbols += e.create(sctx, text) == MathPresso::MRESULT_OK && e.evaluate(v) == i * 2.0 + 0.5;
+    }
+
+    printf("symbols: %d of %d ok\n", numokSymbols, (numSymbols + 6) / 7);
+
+    // Frozen snapshot finds the same symbols, changing its copy doesn't
+    // change it.
+    MathPresso::Context frozen = sctx.freeze();
+    MathPresso::Context changed(frozen);
+    changed.addConstant("c0", 7.0);
+
+    int numokFrozen = 0;
+    int numFrozen = 0;
+    for (int i = 0; i < numSymbols; i += 7, numFrozen++)
+    {
+      MathPresso::Expression e;
+      sprintf(text, "c%d * x + y", i);
+
+      if (i % 2 == 0)
+        numokFrozen += e.create(frozen, text) == MathPresso::MRESULT_INVALID_SYMBOL;
+      else
+        numokFrozen += e.create(frozen, text) == MathPresso::MRESULT_OK && e.evaluate(v) == i * 2.0 + 0.5;
+    }
+
+    const char* frozenSources[] = { "sin(x) + c1", "c0 + x", "c1 * x + y", "c3 - y" };
+    MathPresso::Expression frozenMany[4];
+    MathPresso::mresult_t r = frozen.compileMany(frozenSources, 4, frozenMany, MathPresso::MOPTION_NONE, 2);
+
+    MathPresso::Expression e0, e1;
+    bool ok = r == MathPresso::MRESULT_INVALID_SYMBOL &&
+              frozenMany[0].evaluate(v) == sin(2.0) + 1.0 &&
+              frozenMany[2].evaluate(v) == 2.5 &&
+              frozenMany[3].evaluate(v) == 2.5 &&
+              e0.create(changed, "c0 + x") == MathPresso::MRESULT_OK && e0.evaluate(v) == 9.0 &&
+              e1.create(frozen, "c1 + x", MathPresso::MOPTION_VERBOSE) == MathPresso::MRESULT_OK &&
+              e1.evaluate(v) == 3.0;
+
+    // Expressions keep the snapshot, it can be destroyed first.
+    MathPresso::Expression outlive;
+    {
+      MathPresso::Context temp = sctx.freeze();
+      outlive.create(temp, "c1 * x + y", MathPresso::MOPTION_TIERED);
+    }
+    ok &= outlive.evaluate(v) == 2.5;
+
+    printf("freeze:  %d of %d ok, %s\n", numokFrozen, numFrozen, ok ? "ok" : "failed");
+  }
+
   MathPresso::mresult_t result;
   do {
     char buffer[4096];